@@ -0,0 +1,89 @@
+//=== server_protocol.h - Messages of the obfuscation server --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// llvm-obfuscate -serve and llvm-obfuscate-client talk over a Unix socket,
+// one request per connection. Messages are frames, each a 64 bit length in
+// the byte order of the machine followed by as many bytes.
+//
+// A request is two frames: the options of the obfuscation, each terminated
+// by a zero, and the bitcode of the module. The response is two frames as
+// well: the status, ok or error, and the obfuscated bitcode or the errors.
+
+#ifndef SERVER_PROTOCOL_H
+#define SERVER_PROTOCOL_H
+
+#include "llvm/ADT/StringRef.h"
+#include <algorithm>
+#include <cerrno>
+#include <stdint.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/types.h>
+using namespace llvm;
+
+namespace ServerProtocol {
+const char *const statusOk = "ok";
+const char *const statusError = "error";
+
+// Frames are not read in full before the length is checked
+const uint64_t maxFrameSize = 512ull << 20;
+
+// Frames are read in chunks of this size, so that memory is only taken for
+// bytes that arrived
+const uint64_t frameChunkSize = 1 << 20;
+
+inline bool writeBytes(int fd, const char *data, uint64_t size) {
+  while (size) {
+    // A client that went away must not kill the server with SIGPIPE
+    ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+inline bool readBytes(int fd, char *data, uint64_t size) {
+  while (size) {
+    ssize_t read = recv(fd, data, size, 0);
+    if (read < 0 && errno == EINTR)
+      continue;
+    if (read <= 0)
+      return false;
+    data += read;
+    size -= read;
+  }
+  return true;
+}
+
+inline bool writeFrame(int fd, StringRef data) {
+  uint64_t size = data.size();
+  return writeBytes(fd, (const char *)&size, sizeof(size)) &&
+         writeBytes(fd, data.data(), size);
+}
+
+inline bool readFrame(int fd, std::string &data) {
+  uint64_t size;
+  if (!readBytes(fd, (char *)&size, sizeof(size)) || size > maxFrameSize)
+    return false;
+  data.clear();
+  while (data.size() < size) {
+    uint64_t offset = data.size();
+    uint64_t chunk = std::min(size - offset, frameChunkSize);
+    data.resize(offset + chunk);
+    if (!readBytes(fd, &data[offset], chunk))
+      return false;
+  }
+  return true;
+}
+};
+
+#endif
@@ -9,9 +9,15 @@
 #ifndef BOGUSCF_H
 #define BOGUSCF_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Value.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
 #include <random>
+#include <string>
+#include <vector>
 
 using namespace llvm;
 
@@ -19,14 +25,36 @@ struct BogusCF : public FunctionPass {
   static char ID;
   std::mt19937_64 engine;
   std::bernoulli_distribution trial;
+  std::discrete_distribution<unsigned> targetKind;
 
   BogusCF() : FunctionPass(ID) {}
 
   // Initialise and check options
   virtual bool doInitialization(Module &M);
   virtual bool runOnFunction(Function &F);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 
   // Check to see if a function is eligible for bogus CF processing
   static bool isEligible(Function &F);
+
+  // Functions given with -bcfFunc, empty if all functions are eligible
+  static ArrayRef<std::string> getRequestedFunctions();
+
+private:
+  // Pick an existing block from targets that the never taken edge out of
+  // block can point to without changing any dominance relation.
+  // Returns nullptr if none is found
+  BasicBlock *findReuseTarget(BasicBlock *block,
+                              const std::vector<BasicBlock *> &targets,
+                              DominatorTree &DT);
+
+  // Create a block of at most bcfJunkSize instructions computed from the
+  // values that originalBlock reads, branching to successor if there is one
+  BasicBlock *createJunkBlock(BasicBlock *block, BasicBlock *originalBlock,
+                              BasicBlock *successor);
+
+  // Check if value can be used at the end of block according to the
+  // dominator tree of the function before it was transformed
+  static bool isAvailable(Value *value, BasicBlock *block, DominatorTree &DT);
 };
 #endif
@@ -9,9 +9,11 @@
 #ifndef COPY_H
 #define COPY_H
 #include "Transform/obf_utilities.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
 #include <random>
+#include <string>
 using namespace llvm;
 
 struct Copy : public ModulePass {
@@ -22,11 +24,15 @@ struct Copy : public ModulePass {
 
   Copy() : ModulePass(ID) {}
   virtual bool runOnModule(Module &M);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 
   // Tag this function as "must obfuscate of type"
   static void tagFunction(Function &F, ObfUtils::ObfType type);
   static bool isFunctionTagged(Function &F, ObfUtils::ObfType type);
 
+  // Functions given with -copyFunc, empty if any function may be copied
+  static ArrayRef<std::string> getRequestedFunctions();
+
 private:
   static StringRef obfString(ObfUtils::ObfType type);
 };
@@ -9,11 +9,19 @@
 #ifndef FLATTEN_H
 #define FLATTEN_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Value.h"
 #include <random>
+#include <string>
 
 using namespace llvm;
 
@@ -21,15 +29,56 @@ struct Flatten : public FunctionPass {
   static char ID;
   std::mt19937_64 engine;
   std::bernoulli_distribution trial;
+  std::bernoulli_distribution edgeTrial;
+  // Loops of the current function whose edges are not flattened
+  SmallPtrSet<Loop *, 8> keptLoops;
   StringRef metaKindName;
 
   Flatten() : FunctionPass(ID), metaKindName("FlattenSwitch") {}
 
+  // Value identifying block in the dispatcher
   inline Value *findBlock(LLVMContext &context,
-                          std::vector<BasicBlock *> &blocks, BasicBlock *block);
+                          DenseMap<BasicBlock *, unsigned> &indices,
+                          BasicBlock *block);
+  // Terminate block with a dispatcher to the block identified by jumpIndex
+  // jumpTable is created on first use if the dispatcher needs one
+  TerminatorInst *createDispatch(BasicBlock *block, Value *jumpIndex,
+                                 std::vector<BasicBlock *> &blocks,
+                                 GlobalVariable *&jumpTable);
+  // Terminate jumpBlock with a two level dispatcher, c.f. flattenGroupSize
+  void createHierarchicalDispatch(BasicBlock *jumpBlock, PHINode *jumpIndex,
+                                  std::vector<BasicBlock *> &blocks);
+  // Demote values used outside their block to the stack, storing them at the
+  // end of the block and reloading them once in jumpBlock
+  void demoteValues(BasicBlock *jumpBlock, PHINode *jumpIndex,
+                    std::vector<BasicBlock *> &blocks);
+  // Move reloads of demoted values out of jumpBlock to their users, so that
+  // blocks can bypass it
+  void sinkReloads(BasicBlock *jumpBlock);
+  // Replace the branches to jumpBlock with copies of its dispatcher
+  void replicateDispatch(BasicBlock *jumpBlock, PHINode *jumpIndex,
+                         std::vector<BasicBlock *> &blocks,
+                         GlobalVariable *jumpTable);
+  // Find the loops whose edges stay direct, c.f. flattenLoops
+  void findKeptLoops(LoopInfo &LI, ScalarEvolution &SE);
+  // Check if the edge is left as a direct branch instead of being flattened
+  bool keepsEdge(LoopInfo &LI, BasicBlock *from, BasicBlock *to);
+  // Blocks at the end of which each value is still needed by a later block
+  typedef DenseMap<Instruction *, SmallPtrSet<BasicBlock *, 8> > LiveOutMap;
+  // Compute LiveOutMap over the original control flow, c.f. flattenSSA
+  void computeLiveOut(Function &F, LiveOutMap &liveOut);
+  // Carry values across blocks with PHI Nodes in jumpBlock instead of
+  // demoting them to the stack. The flattened blocks must already branch to
+  // jumpBlock
+  void carryValues(BasicBlock *jumpBlock, LiveOutMap &liveOut);
   virtual bool doInitialization(Module &M);
   virtual bool runOnFunction(Function &F);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
   static bool isEligible(Function &F);
+  // Check if values are carried in SSA form, c.f. flattenSSA
+  static bool carriesSSA();
+  // Functions given with -flattenFunc, empty if all functions are eligible
+  static ArrayRef<std::string> getRequestedFunctions();
 };
 
 #endif
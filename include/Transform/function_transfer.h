@@ -0,0 +1,68 @@
+//=== function_transfer.h - Move functions between modules ----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Moves the body of a function into a module of its own and back, possibly
+// through bitcode and another context. Globals the function refers to that
+// existed before it was transformed are declared by name, globals created by
+// the transformations are copied along with the function.
+
+#ifndef FUNCTION_TRANSFER_H
+#define FUNCTION_TRANSFER_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/ValueHandle.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include <map>
+#include <string>
+using namespace llvm;
+
+namespace FunctionTransfer {
+typedef std::map<std::string, WeakVH> GlobalsByName;
+typedef std::map<const GlobalValue *, std::string> NamesOfGlobals;
+
+// Named globals of M, taken before the functions are transformed
+void recordGlobals(Module &M, GlobalsByName &globals);
+
+// Names of the globals recorded that still exist
+void getNames(const GlobalsByName &globals, NamesOfGlobals &names);
+
+// Check if F can be moved: it is named, has no debug information, no block
+// whose address is taken and does not refer to unnamed globals
+bool isTransferable(Function &F);
+
+// Maps the named struct types of a module read into a context that already
+// had them, and that were renamed by appending .<number>, back to the types
+// of M
+struct TypeMapper : public ValueMapTypeRemapper {
+  Module &M;
+  DenseMap<Type *, Type *> mapped;
+
+  TypeMapper(Module &M) : M(M) {}
+  virtual Type *remapType(Type *type);
+
+private:
+  Type *findStruct(StructType *type);
+  bool hasSameBody(StructType *type, StructType *original);
+};
+
+// Copy F into into, a module in the same context, as the function name.
+// Globals in originals are declared under their recorded names, the others
+// are copied as definitions. Fails if a global has no usable name
+bool extract(Function &F, StringRef name, const NamesOfGlobals &originals,
+             Module &into);
+
+// Give the declaration F the body of the function name in from. Declarations
+// in from are resolved with originals, then by name in the module of F
+void splice(Function &F, StringRef name, Module &from,
+            const GlobalsByName &originals, TypeMapper &types);
+};
+
+#endif
@@ -9,16 +9,35 @@
 #ifndef LOOP_BOGUSCF_H
 #define LOOP_BOGUSCF_H
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
+#include <random>
 using namespace llvm;
 
 struct LoopBogusCF : public LoopPass {
   static char ID;
+  std::mt19937_64 engine;
+  // Function the engine was last seeded for
+  Function *seededFunction;
+  // Whether the options were checked, which is done with the first loop as
+  // it is the first time a context is at hand
+  bool checkedOptions;
+  bool validOptions;
 
-  LoopBogusCF() : LoopPass(ID) {}
+  LoopBogusCF();
   virtual bool runOnLoop(Loop *loop, LPPassManager &LPM);
   virtual void getAnalysisUsage (AnalysisUsage &) const;
+
+private:
+  // Evaluate the predicate once per loop entry
+  void insertInPreheader(Loop *loop, BasicBlock *exitBlock, LoopInfo &info);
+  // Replace the uses of loop values outside the loop with PHI nodes in the
+  // exit block
+  void formExitPHIs(Loop *loop, BasicBlock *exitBlock);
+  // Evaluate the predicate every loopBcfStride iterations
+  void insertStrided(Loop *loop, BranchInst *branch, BasicBlock *exitBlock,
+                     LoopInfo &info);
 };
 
 #endif
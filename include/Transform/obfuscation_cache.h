@@ -0,0 +1,49 @@
+//=== obfuscation_cache.h - Cache of obfuscated functions ------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Keeps obfuscated function bodies on disk, keyed by the IR of the function
+// before obfuscation, the pass pipeline, the options and the seed, so that
+// unchanged functions are not obfuscated again in the next build.
+//
+// ObfuscationCacheLookup runs before the obfuscation passes and turns every
+// function found in the cache into a declaration, which the passes skip.
+// ObfuscationCacheStore runs after them, writes the functions that were not
+// found to the cache and splices the cached bodies into the others.
+
+#ifndef OBFUSCATION_CACHE_H
+#define OBFUSCATION_CACHE_H
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Pass.h"
+#include "llvm/PassManager.h"
+#include <string>
+using namespace llvm;
+
+struct ObfuscationCacheLookup : public ModulePass {
+  static char ID;
+  // Description of the passes run between lookup and store
+  std::string pipeline;
+
+  ObfuscationCacheLookup(StringRef pipeline = "")
+      : ModulePass(ID), pipeline(pipeline) {}
+  virtual bool runOnModule(Module &M);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+};
+
+struct ObfuscationCacheStore : public ModulePass {
+  static char ID;
+
+  ObfuscationCacheStore() : ModulePass(ID) {}
+  virtual bool runOnModule(Module &M);
+};
+
+namespace ObfuscationCache {
+// Check if a cache directory was given with -obfCache
+bool isEnabled();
+};
+
+#endif
@@ -16,6 +16,8 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include <functional>
 #include <vector>
 using namespace llvm;
@@ -34,14 +36,34 @@ struct OpaquePredicate : public ModulePass {
   typedef std::function<int()> Randomner;
   typedef std::function<PredicateType()> PredicateTypeRandomner;
 
+  // Cost class of a formula on the target, c.f. -opaque-formula
+  enum CostClass {
+    CostCheap,
+    CostMedium,
+    CostStrong
+  };
+
+  struct FormulaInfo {
+    StringRef name;
+    Formula formula;
+    // Sum of the TargetTransformInfo costs of the instructions generated
+    unsigned cost;
+    CostClass costClass;
+
+    FormulaInfo(StringRef name, Formula formula)
+        : name(name), formula(formula), cost(0), costClass(CostMedium) {}
+  };
+
   static char ID;
   std::mt19937_64 engine;
   static StringRef stubName;
   static StringRef unreachableMarkName;
   static StringRef unreachableName;
+  static StringRef stateName;
 
-  OpaquePredicate() : ModulePass(ID) {}
+  OpaquePredicate() : ModulePass(ID), stateTag(nullptr) {}
   virtual bool runOnModule(Module &M);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
 
   static void createStub(BasicBlock *block, BasicBlock *trueBlock,
                          BasicBlock *falseBlock,
@@ -51,40 +73,97 @@ struct OpaquePredicate : public ModulePass {
   static bool isBasicBlockUnreachable(BasicBlock &block);
   static void clearUnreachable(BasicBlock &block);
 
+  // Add a formula to the library. The formula is given a BasicBlock with NO
+  // terminator, two i32 values and the type of predicate wanted, and returns
+  // an i1 condition. Its cost is worked out per target when the pass runs
+  static void registerFormula(StringRef name, Formula formula);
+
 private:
+  // Formulas of the library with their costs on the target of the module.
+  // Kept per pass, like the tag below, so that modules can be transformed
+  // at the same time
+  std::vector<FormulaInfo> formulas;
+  // TBAA access tag of the loads and stores of the globals, or nullptr
+  MDNode *stateTag;
+
   // Prepare module for opaque predicates by adding global variables to the
   // module
   // Returns a vector of pointers to the global variables generated
   // Needs at least 2 global variables
-  static std::vector<GlobalVariable *> prepareModule(Module &M);
+  std::vector<Constant *> prepareModule(Module &M);
+
+  // Create a TBAA access tag of a type of its own, placed under the root
+  // that the accesses of the module already use, c.f. -opaque-tbaa
+  static MDNode *createStateTag(Module &M);
 
   // Given a BasicBlock with NO terminator, and two successor blocks
   // Generate a randomly selected opaque predicate to replace the terminator
   // and then branch to the given blocks
+  // The operands of the predicate are taken from liveValues, or from the
+  // globals if liveValues is empty
   // Returns the type of predicate produced
-  static PredicateType create(BasicBlock *headBlock, BasicBlock *trueBlock,
-                              BasicBlock *falseBlock,
-                              const std::vector<GlobalVariable *> &globals,
-                              Randomner randomner,
-                              PredicateTypeRandomner typeRand);
+  PredicateType create(BasicBlock *headBlock, BasicBlock *trueBlock,
+                       BasicBlock *falseBlock,
+                       const std::vector<Constant *> &globals,
+                       const std::vector<Value *> &liveValues,
+                       Randomner randomner, PredicateTypeRandomner typeRand);
 
   // Given a BasicBlock with NO terminator, and two successor blocks
   // Generate an always true opaque predicate to replace the terminator
   // and then branch to the given blocks
   // Returns the type of predicate produced
-  static void createTrue(BasicBlock *headBlock, BasicBlock *trueBlock,
-                         BasicBlock *falseBlock,
-                         const std::vector<GlobalVariable *> &globals,
-                         Randomner randomner);
+  void createTrue(BasicBlock *headBlock, BasicBlock *trueBlock,
+                  BasicBlock *falseBlock,
+                  const std::vector<Constant *> &globals,
+                  const std::vector<Value *> &liveValues, Randomner randomner);
 
   // Given a BasicBlock with NO terminator, and two successor blocks
   // Generate an always false opaque predicate to replace the terminator
   // and then branch to the given blocks
   // Returns the type of predicate produced
-  static void createFalse(BasicBlock *headBlock, BasicBlock *trueBlock,
-                          BasicBlock *falseBlock,
-                          const std::vector<GlobalVariable *> &globals,
-                          Randomner randomner);
+  void createFalse(BasicBlock *headBlock, BasicBlock *trueBlock,
+                   BasicBlock *falseBlock,
+                   const std::vector<Constant *> &globals,
+                   const std::vector<Value *> &liveValues, Randomner randomner);
+
+  // Produce the two i32 operands of a predicate at the end of headBlock,
+  // either by advancing two globals or from two live values
+  void createOperands(BasicBlock *headBlock,
+                      const std::vector<Constant *> &globals,
+                      const std::vector<Value *> &liveValues,
+                      Randomner randomner, Value *&x, Value *&y);
+
+  // Evaluate -opaque-seeds always false formulas at the end of entryBlock
+  // and add their results, extended to i32 zeroes, to seeds
+  void createSeeds(BasicBlock &entryBlock,
+                   const std::vector<Constant *> &globals,
+                   const std::vector<Value *> &liveValues, Randomner randomner,
+                   std::vector<Value *> &seeds);
+
+  // Given a BasicBlock with NO terminator, and two successor blocks
+  // Generate a predicate of the given type derived from the seeds of the
+  // function and then branch to the given blocks
+  static void createFromSeeds(BasicBlock *headBlock, BasicBlock *trueBlock,
+                              BasicBlock *falseBlock,
+                              const std::vector<Value *> &seeds,
+                              PredicateType type, Randomner randomner);
+
+  // Collect integer values defined in block or in the blocks dominating it,
+  // nearest first, up to -opaque-live-values of them
+  static void getLiveValues(BasicBlock *block, DominatorTree &DT,
+                            std::vector<Value *> &values);
+
+  // Check if value can be neither undef nor poison: an argument, a load, or
+  // computed from those and constants without wrap or exact flags and without
+  // shifts by a variable amount, looking at most depth operands deep
+  static bool isWellDefined(Value *value, unsigned depth);
+
+  // Attach branch weights saying that only the edge the predicate evaluates
+  // to is ever taken, with -opaque-weights
+  static void setWeights(BranchInst *branch, PredicateType type);
+
+  // Move blocks that are never executed out of line, c.f. -opaque-cold
+  static void outlineCold(const std::vector<BasicBlock *> &blocks);
 
   static Value *formula0(BasicBlock *block, Value *x1, Value *y1,
                          OpaquePredicate::PredicateType type);
@@ -95,10 +174,33 @@ private:
   static Value *formula2(BasicBlock *block, Value *x1, Value *y1,
                          OpaquePredicate::PredicateType type);
 
-  static Formula getFormula(OpaquePredicate::Randomner randomner);
+  static Value *formula3(BasicBlock *block, Value *x1, Value *y1,
+                         OpaquePredicate::PredicateType type);
+
+  static Value *formula4(BasicBlock *block, Value *x1, Value *y1,
+                         OpaquePredicate::PredicateType type);
+
+  static Value *formula5(BasicBlock *block, Value *x1, Value *y1,
+                         OpaquePredicate::PredicateType type);
+
+  static Value *formula6(BasicBlock *block, Value *x1, Value *y1,
+                         OpaquePredicate::PredicateType type);
+
+  // The library of formulas, without costs
+  static std::vector<FormulaInfo> &getFormulas();
+
+  // Copy the library into formulas, lower every formula in a scratch
+  // function and class them by the cost the target gives to the
+  // instructions
+  void computeFormulaCosts(Module &M, const TargetTransformInfo &TTI);
+  static unsigned getInstructionCost(Instruction &inst,
+                                     const TargetTransformInfo &TTI);
+
+  // Randomly pick a formula from the class requested by -opaque-formula
+  Formula getFormula(OpaquePredicate::Randomner randomner);
 
-  static Value *advanceGlobal(BasicBlock *block, GlobalVariable *global,
-                              OpaquePredicate::Randomner randomner);
+  Value *advanceGlobal(BasicBlock *block, Constant *global,
+                       OpaquePredicate::Randomner randomner);
 
   static StringRef getStringRef(PredicateType type) {
     switch (type) {
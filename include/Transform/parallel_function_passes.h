@@ -0,0 +1,43 @@
+//=== parallel_function_passes.h - Run function passes on threads ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Runs a sequence of passes that each transform one function at a time on
+// several threads, each with its own LLVMContext and copy of the module, and
+// splices the transformed functions back into the module.
+
+#ifndef PARALLEL_FUNCTION_PASSES_H
+#define PARALLEL_FUNCTION_PASSES_H
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Pass.h"
+#include "llvm/PassManager.h"
+#include <vector>
+using namespace llvm;
+
+struct ParallelFunctionPasses : public ModulePass {
+  static char ID;
+  // Passes to run on every function, in order
+  std::vector<AnalysisID> passes;
+
+  ParallelFunctionPasses(ArrayRef<AnalysisID> passes = ArrayRef<AnalysisID>())
+      : ModulePass(ID), passes(passes.begin(), passes.end()) {}
+  virtual bool runOnModule(Module &M);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+
+  // Check if pass only looks at the function it transforms, so that it can
+  // run on a copy of the module in which other functions are declarations
+  static bool isFunctionLocal(Pass *pass);
+
+  // Threads given with -obfThreads
+  static unsigned getThreads();
+
+private:
+  // Run the passes on the definitions of M on this thread
+  void runPasses(Module &M) const;
+};
+
+#endif
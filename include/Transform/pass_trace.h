@@ -0,0 +1,71 @@
+//=== pass_trace.h - Time passes and the growth of functions --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Records how long each pass takes on each function and how the function
+// grows, for release builds where neither -stats nor -debug are available.
+// The trace is written when it is flushed and when the process exits, c.f.
+// obfTrace and obfTraceSummary.
+
+#ifndef PASS_TRACE_H
+#define PASS_TRACE_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include <stdint.h>
+#include <string>
+using namespace llvm;
+
+namespace PassTrace {
+// Sizes of a function, or of all functions of a module
+struct Counts {
+  unsigned instructions;
+  unsigned blocks;
+  unsigned allocas;
+  unsigned phis;
+
+  Counts() : instructions(0), blocks(0), allocas(0), phis(0) {}
+  void add(Function &F);
+};
+
+// Check if a trace or a summary is written
+bool isEnabled();
+
+// Append the events recorded so far to the trace and the summary and forget
+// them. Tools that do not exit between modules call it after each of them
+void flush();
+
+// Times pass on F from construction to destruction and records the sizes of
+// F before and after. Does nothing if tracing is not enabled
+struct FunctionScope {
+  FunctionScope(Pass *pass, Function &F);
+  ~FunctionScope();
+
+private:
+  Pass *pass;
+  Function *F;
+  std::string name;
+  uint64_t start;
+  Counts before;
+};
+
+// Same for a pass on the whole module. Passes that work function by function
+// also open a FunctionScope for each of them
+struct ModuleScope {
+  ModuleScope(Pass *pass, Module &M);
+  ~ModuleScope();
+
+private:
+  Pass *pass;
+  Module *M;
+  uint64_t start;
+  Counts before;
+};
+};
+
+#endif
@@ -0,0 +1,51 @@
+//=== profile_hotness.h - Profile guided hotness queries -------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Reads execution counts from an instrumented or sampled profile so that the
+// obfuscation passes can avoid (or obfuscate less of) the hot parts of a
+// program.
+
+#ifndef PROFILE_HOTNESS_H
+#define PROFILE_HOTNESS_H
+
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include <cstdint>
+using namespace llvm;
+
+namespace ProfileHotness {
+// Check if a profile was given with -obfProfile and loaded successfully
+bool hasProfile();
+
+// Report the errors met reading the profile or its options on context.
+// Returns false if there were any
+bool checkProfile(LLVMContext &context);
+
+// Entry count of a function according to the profile. 0 if unknown
+uint64_t getEntryCount(Function &F);
+
+// Estimated execution count of a block: the function entry count scaled by
+// the relative block frequency
+uint64_t getBlockCount(BasicBlock &BB, BlockFrequencyInfo &BFI);
+
+// Highest estimated execution count among the blocks of a function
+uint64_t getMaxBlockCount(Function &F, BlockFrequencyInfo &BFI);
+
+// Count at or above which code is considered hot
+uint64_t getHotThreshold();
+
+bool isHot(uint64_t count);
+
+// Scale the probability of transforming code executed count times.
+// Returns the probability unchanged when no profile is loaded
+double scaleProbability(double probability, uint64_t count);
+};
+
+#endif
@@ -0,0 +1,36 @@
+//=== random_service.h - Reproducible random streams ----------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Derives the random stream of a pass for a function from a master seed, the
+// pass and the function alone, so that the obfuscation of a function does not
+// depend on the order in which functions are processed.
+
+#ifndef RANDOM_SERVICE_H
+#define RANDOM_SERVICE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include <random>
+using namespace llvm;
+
+namespace RandomService {
+// Seed used when the seed option of a pass is empty: -obfSeed, or the system
+// time taken once per process if that is empty too
+StringRef getMasterSeed();
+
+// Check if the master seed was given with -obfSeed, i.e. is the same in every
+// process
+bool hasMasterSeed();
+
+// Seed engine with the stream of pass for F. passSeed is the seed option of
+// the pass and takes the place of the master seed when given
+void seed(std::mt19937_64 &engine, StringRef pass, StringRef passSeed,
+          const Function &F);
+}
+
+#endif
@@ -8,15 +8,26 @@
 //===----------------------------------------------------------------------===//
 #ifndef REPLACE_INSTRUCTION_H
 #define REPLACE_INSTRUCTION_H
+#include "Transform/pass_trace.h"
 #include "llvm/Pass.h"
 #include "llvm/PassManager.h"
+#include <memory>
+#include <random>
 using namespace llvm;
 
 struct ReplaceInstruction : public BasicBlockPass {
   static char ID;
+  std::mt19937_64 engine;
+  // Open from the first block of a function to the last
+  std::unique_ptr<PassTrace::FunctionScope> trace;
 
   ReplaceInstruction() : BasicBlockPass(ID) {}
+  // Seed the engine for the blocks of F
+  using BasicBlockPass::doInitialization;
+  virtual bool doInitialization(Function &F);
   virtual bool runOnBasicBlock (BasicBlock &BB);
+  using BasicBlockPass::doFinalization;
+  virtual bool doFinalization(Function &F);
 };
 
 #endif
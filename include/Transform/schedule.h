@@ -0,0 +1,47 @@
+//=== schedule.h - Schedule the passes ------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// The obfuscation pipeline is added after the optimizations of every
+// translation unit. With -obfLTO it is left out there and run once on the
+// linked program instead, by the obfuscate pass or a link time tool.
+
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Pass.h"
+#include "llvm/PassManager.h"
+using namespace llvm;
+
+// Runs the obfuscation pipeline on the module, for drivers that can only
+// name passes, such as opt on the output of llvm-link
+struct Obfuscate : public ModulePass {
+  static char ID;
+
+  Obfuscate() : ModulePass(ID) {}
+  virtual bool runOnModule(Module &M);
+};
+
+namespace ObfuscationSchedule {
+// Add the obfuscation passes selected by the options to PM
+void addPasses(PassManagerBase &PM);
+
+// Check if obfuscation is left for link time, c.f. obfLTO
+bool isLinkTime();
+
+// Functions the obfuscations are restricted to with -bcfFunc, -flattenFunc
+// and -copyFunc. Returns false if a scheduled obfuscation is not restricted,
+// which LoopBogusCF never is. The passes that only act on what those left,
+// such as OpaquePredicate, and the LLVM passes of the schedule are not
+// counted
+bool getSelectedFunctions(StringSet<> &names);
+
+// Check if the pass of the given ID is part of the pipeline
+bool isScheduled(AnalysisID pass);
+};
+
+#endif
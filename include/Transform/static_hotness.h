@@ -0,0 +1,58 @@
+//=== static_hotness.h - Static execution frequency estimates -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Estimates how often blocks execute when no profile is available, so that
+// the obfuscation passes can favour cold code.
+#ifndef STATIC_HOTNESS_H
+#define STATIC_HOTNESS_H
+
+#include "llvm/ADT/ValueMap.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Pass.h"
+#include "llvm/PassManager.h"
+using namespace llvm;
+
+struct StaticHotness : public ModulePass {
+  static char ID;
+
+  StaticHotness() : ModulePass(ID) {}
+  virtual bool runOnModule(Module &M);
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual void releaseMemory();
+
+  // Estimated executions of the function per run of the program. Functions
+  // callable from outside the module are entered at least once
+  double getFunctionFrequency(Function &F);
+  // Estimated executions of the block per run of the program
+  double getBlockFrequency(BasicBlock &BB);
+  // Highest estimated frequency among the blocks of a function
+  double getMaxBlockFrequency(Function &F);
+
+  // Record the function frequencies in M, so that a copy of M in which
+  // other functions are declarations estimates the same frequencies
+  void exportFunctionFrequencies(Module &M);
+  static void removeExportedFrequencies(Module &M);
+
+  // Check if the passes should query the estimates, c.f. obfStaticHotness
+  static bool isEnabled();
+  // Scale the probability of transforming code executed frequency times.
+  // Code executed at most once keeps its probability
+  static double scaleProbability(double probability, double frequency);
+
+private:
+  bool importFunctionFrequencies(Module &M);
+
+  // Frequency of each block relative to the entry of its function. The
+  // passes that preserve the estimates change the CFG, so entries follow the
+  // blocks and functions and go away when they are deleted
+  ValueMap<const BasicBlock *, double> relativeFrequencies;
+  ValueMap<const Function *, double> functionFrequencies;
+};
+
+#endif
@@ -16,7 +16,29 @@
 // Command line options
 // - bcfFunc - List of functions to apply transformation to. Default is all
 // - bfcProbability - Probability that basic block is transformed. Default 0.5
-// - bcfSeed - Seed for random number generator. Defaults to system time
+// - bcfSeed - Seed for random number generator. Defaults to obfSeed
+// - bcfCloneWeight - Relative weight of cloning the split block as the target
+//                    of the never taken edge. Default 1
+// - bcfReuseWeight - Relative weight of pointing the never taken edge at an
+//                    existing block of the function instead. Default 0
+// - bcfJunkWeight - Relative weight of pointing the never taken edge at a new
+//                   block of junk instructions instead. Default 0
+// - bcfJunkSize - Maximum number of instructions in a junk block. Default 8
+//
+// A clone doubles the size of every transformed block. Reused blocks cost
+// nothing and junk blocks at most bcfJunkSize instructions, at the price of a
+// bogus target that does not look like the real one. Reused blocks are only
+// picked if the new edge does not change the dominator tree, and fall back to
+// a clone if none is found.
+//
+// PHI Nodes stay in the first half of a split block. Values of the second half
+// are rewritten with SSAUpdater once the half is cloned, so the function stays
+// in SSA form throughout.
+//
+// When a profile is given with -obfProfile, the probability for blocks above
+// the hot threshold is scaled down by -obfHotScale (c.f. profile_hotness.cpp).
+// Otherwise it is scaled down by the statically estimated frequency of the
+// block (c.f. static_hotness.cpp)
 //
 // Debug types:
 // - boguscf - Bogus CF related
@@ -28,7 +50,14 @@
 #include "Transform/copy.h"
 #include "Transform/opaque_predicate.h"
 #include "Transform/obf_utilities.h"
+#include "Transform/pass_trace.h"
+#include "Transform/profile_hotness.h"
+#include "Transform/random_service.h"
+#include "Transform/static_hotness.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/Dominators.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Transforms/Utils/Cloning.h"
@@ -42,10 +71,9 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CFG.h"
-#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 #include <algorithm>
 #include <vector>
-#include <chrono>
 
 static cl::list<std::string>
     bcfFunc("bcfFunc", cl::CommaSeparated,
@@ -58,34 +86,69 @@ static cl::opt<double>
 
 static cl::opt<std::string> bcfSeed(
     "bcfSeed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to obfSeed"));
 
 static cl::opt<bool> disableBcf(
     "disableBcf", cl::init(false),
     cl::desc("Disable BCF pass regardless. Useful when used in -OX mode."));
 
+static cl::opt<unsigned> bcfCloneWeight(
+    "bcfCloneWeight", cl::init(1),
+    cl::desc("Relative weight of cloning the split block as bogus target"));
+
+static cl::opt<unsigned> bcfReuseWeight(
+    "bcfReuseWeight", cl::init(0),
+    cl::desc("Relative weight of reusing an existing block as bogus target"));
+
+static cl::opt<unsigned> bcfJunkWeight(
+    "bcfJunkWeight", cl::init(0),
+    cl::desc("Relative weight of a junk block as bogus target"));
+
+static cl::opt<unsigned>
+    bcfJunkSize("bcfJunkSize", cl::init(8),
+                cl::desc("Maximum number of instructions in a junk block"));
+
+// Kinds of bogus targets, in the order of their weights
+enum BogusTarget {
+  cloneTarget,
+  reuseTarget,
+  junkTarget
+};
+
+// Number of existing blocks looked at before giving up on reusing one
+static const unsigned maxReuseAttempts = 16;
+
 STATISTIC(NumBlocksSeen, "Number of basic blocks processed (excluding skips "
                          "due to PHI/terminator only blocks)");
 STATISTIC(NumBlocksSkipped,
           "Number of blocks skipped due to PHI/terminator only blocks");
 STATISTIC(NumBlocksTransformed, "Number of basic blocks transformed");
+STATISTIC(NumBlocksHot, "Number of hot basic blocks according to profile");
+STATISTIC(NumTargetsCloned, "Number of bogus targets cloned");
+STATISTIC(NumTargetsReused, "Number of bogus targets reusing existing blocks");
+STATISTIC(NumTargetsJunk, "Number of bogus targets made of junk");
 
 // Initialise and check options
 bool BogusCF::doInitialization(Module &M) {
+  LLVMContext &ctx = M.getContext();
+  if (!ProfileHotness::checkProfile(ctx))
+    return false;
   if (bcfProbability < 0.f || bcfProbability > 1.f) {
-    LLVMContext &ctx = getGlobalContext();
     ctx.emitError("BogusCF: Probability must be between 0 and 1");
+    return false;
   }
-
-  // Seed engine and create distribution
-  if (!bcfSeed.empty()) {
-    std::seed_seq seed(bcfSeed.begin(), bcfSeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
+  if (bcfCloneWeight + bcfReuseWeight + bcfJunkWeight == 0) {
+    ctx.emitError("BogusCF: At least one bogus target weight must be non-zero");
+    return false;
   }
+
+  // Create distributions, the engine is seeded for each function
   trial.param(std::bernoulli_distribution::param_type((double)bcfProbability));
+  std::vector<double> weights = { (double)bcfCloneWeight,
+                                  (double)bcfReuseWeight,
+                                  (double)bcfJunkWeight };
+  targetKind.param(std::discrete_distribution<unsigned>::param_type(
+      weights.begin(), weights.end()));
 
   return false;
 }
@@ -93,6 +156,7 @@ bool BogusCF::doInitialization(Module &M) {
 bool BogusCF::runOnFunction(Function &F) {
   if (disableBcf)
     return false;
+  PassTrace::FunctionScope trace(this, F);
 
   bool hasBeenModified = false;
   // If the function is declared elsewhere in other translation unit
@@ -123,13 +187,14 @@ bool BogusCF::runOnFunction(Function &F) {
   // splitting into two bogus control flow for a later time
   std::vector<BasicBlock *> blocks;
   blocks.reserve(F.size());
-  std::vector<PHINode *> phis;
 
   DEBUG(errs() << "\t" << F.size() << " basic blocks found\n");
   Twine blockPrefix = "block_";
   unsigned i = 0;
   DEBUG(errs() << "\tListing and filtering blocks\n");
   BasicBlock &entryBlock = F.getEntryBlock();
+  // Existing blocks that never taken edges may point to
+  std::vector<BasicBlock *> targets;
   // Get original list of blocks
   for (auto &block : F) {
     DEBUG(if (!block.hasName()) {
@@ -138,11 +203,10 @@ bool BogusCF::runOnFunction(Function &F) {
     });
 
     DEBUG(errs() << "\tBlock " << block.getName() << "\n");
-    for (auto &inst : block) {
-      if (PHINode *phi = dyn_cast<PHINode>(&inst)) {
-        phis.push_back(phi);
-      }
+    if (bcfReuseWeight > 0 && &block != &entryBlock && !block.isLandingPad()) {
+      targets.push_back(&block);
     }
+
     BasicBlock::iterator inst1 = block.begin();
     if (block.getFirstNonPHIOrDbgOrLifetime()) {
       inst1 = block.getFirstNonPHIOrDbgOrLifetime();
@@ -167,8 +231,8 @@ bool BogusCF::runOnFunction(Function &F) {
       continue;
     }
 
-    // We skip functions with InvokeInst because PHI demotions are not
-    // supported with invoke edges by LLVM yet.
+    // We skip functions with InvokeInst because the edges of an invoke
+    // cannot be split to join the original and cloned blocks.
     TerminatorInst *terminator = block.getTerminator();
     if (isa<InvokeInst>(terminator)) {
       DEBUG(errs() << "\tFunction has InvokeInst -- skipping\n");
@@ -185,16 +249,33 @@ bool BogusCF::runOnFunction(Function &F) {
     return hasBeenModified;
   }
 
-  DEBUG(errs() << "\tDemoting PHI instructions to allocas\n");
-  for (auto phi : phis) {
-    DemotePHIToStack(phi);
+  // Block counts have to be worked out before any block is split
+  DenseMap<BasicBlock *, uint64_t> blockCounts;
+  if (!mustObfuscate && ProfileHotness::hasProfile()) {
+    DEBUG(errs() << "\tEstimating block counts from profile\n");
+    BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfo>();
+    for (BasicBlock *block : blocks) {
+      blockCounts[block] = ProfileHotness::getBlockCount(*block, BFI);
+    }
+  }
+
+  // Without a profile, frequencies are estimated statically
+  DenseMap<BasicBlock *, double> blockFrequencies;
+  if (!mustObfuscate && !ProfileHotness::hasProfile() &&
+      StaticHotness::isEnabled()) {
+    StaticHotness &hotness = getAnalysis<StaticHotness>();
+    for (BasicBlock *block : blocks) {
+      blockFrequencies[block] = hotness.getBlockFrequency(*block);
+    }
   }
 
   // DEBUG_WITH_TYPE("cfg", F.viewCFG());
 
+  RandomService::seed(engine, "boguscf", bcfSeed, F);
   trial.reset(); // Independent per function
+  targetKind.reset();
   DEBUG(errs() << "\tRandomly shuffling list of basic blocks\n");
-  std::random_shuffle(blocks.begin(), blocks.end());
+  std::shuffle(blocks.begin(), blocks.end(), engine);
 
   for (BasicBlock *block : blocks) {
     DEBUG(errs() << "\tBlock " << block->getName() << "\n");
@@ -205,7 +286,25 @@ bool BogusCF::runOnFunction(Function &F) {
     }
 
     // Now let's decide if we want to transform this block or not
-    if (!trial(engine)) {
+    if (ProfileHotness::isHot(blockCounts.lookup(block))) {
+      DEBUG(errs() << "\t\tHot block: " << blockCounts.lookup(block) << "\n");
+      ++NumBlocksHot;
+      std::bernoulli_distribution hotTrial(ProfileHotness::scaleProbability(
+          trial.p(), blockCounts.lookup(block)));
+      if (!hotTrial(engine)) {
+        DEBUG(errs() << "\t\tSkipping: Bernoulli trial failed\n");
+        continue;
+      }
+    } else if (blockFrequencies.lookup(block) > 1.0) {
+      DEBUG(errs() << "\t\tEstimated frequency: "
+                   << blockFrequencies.lookup(block) << "\n");
+      std::bernoulli_distribution coldTrial(StaticHotness::scaleProbability(
+          trial.p(), blockFrequencies.lookup(block)));
+      if (!coldTrial(engine)) {
+        DEBUG(errs() << "\t\tSkipping: Bernoulli trial failed\n");
+        continue;
+      }
+    } else if (!trial(engine)) {
       DEBUG(errs() << "\t\tSkipping: Bernoulli trial failed\n");
       continue;
     }
@@ -230,174 +329,125 @@ bool BogusCF::runOnFunction(Function &F) {
     DEBUG(errs() << "\t\tSplitting Basic Block\n");
     BasicBlock *originalBlock = block->splitBasicBlock(inst1);
     DEBUG(originalBlock->setName(block->getName() + "_original"));
-    DEBUG(errs() << "\t\tCloning Basic Block\n");
-    Twine prefix = "Cloned";
-    ValueToValueMapTy VMap;
-    BasicBlock *copyBlock = CloneBasicBlock(originalBlock, VMap, prefix, &F);
-    DEBUG(copyBlock->setName(block->getName() + "_cloned"));
 
-    // Remap operands, phi nodes, and metadata
-    DEBUG(errs() << "\t\tRemapping information\n");
+    // Clear the unconditional branch from the "husk" original block
+    block->getTerminator()->eraseFromParent();
 
-    for (auto &inst : *copyBlock) {
-      RemapInstruction(&inst, VMap, RF_IgnoreMissingEntries);
+    unsigned kind = targetKind(engine);
+    BasicBlock *bogusBlock = nullptr;
+    if (kind == reuseTarget) {
+      DEBUG(errs() << "\t\tLooking for an existing block to reuse\n");
+      bogusBlock =
+          findReuseTarget(block, targets, getAnalysis<DominatorTree>());
+      if (!bogusBlock) {
+        DEBUG(errs() << "\t\tNone found -- cloning instead\n");
+        kind = cloneTarget;
+      }
     }
 
-    // If this block has a successor, we need to worry about use of Values
-    // generated by this block
-    if (successor) {
-      DEBUG(errs() << "\t\tHandling successor use\n");
-      for (auto &inst : *originalBlock) {
-        DEBUG(errs() << "\t\t\t" << inst << "\n");
-        DEBUG(errs() << "\t\t\t\t" << inst.getNumUses() << " Users\n");
-        if (!inst.getNumUses())
-          continue;
-        std::vector<User *> users;
-        std::vector<PHINode *> phiUsers;
-        bool used = false, usedNonPhi = false;
-        // The instruction object itself is the Value for the result
-        for (auto user = inst.use_begin(), useEnd = inst.use_end();
-             user != useEnd; ++user) {
-          // User is an instruction
-          Instruction *userInst = dyn_cast<Instruction>(*user);
-          assert(userInst && "User is not an instruction!");
-          BasicBlock *userBlock = userInst->getParent();
-          // Instruction belongs to another block that is not us
-          if (userBlock != copyBlock && userBlock != originalBlock) {
-            used = true;
-            DEBUG(errs() << "\t\t\t\tUsed in " << userBlock->getName() << ": "
-                         << *userInst << "\n");
-            // Find a PHI Node
-            PHINode *phiCheck = dyn_cast<PHINode>(userInst);
-            if (phiCheck) {
-              if (phiCheck->getParent() == successor) {
-                DEBUG(errs() << "\t\t\t\t\tSuccessor PHI Node\n");
-                phiUsers.push_back(phiCheck);
-              } else {
-                DEBUG(errs() << "\t\t\t\t\tNon-Successor PHI Node\n");
-                usedNonPhi = true;
-                users.push_back(*user);
-              }
-            } else {
-              DEBUG(errs() << "\t\t\t\t\tNone-PHI Node\n");
-              usedNonPhi = true;
-              users.push_back(*user);
-            }
-#if 0
-              // Check if inst is a phinode in successor
-              // If it's not in a successor, it's the same as the else case
-              PHINode *phiCheck = dyn_cast<PHINode>(userInst);
-              if (phiCheck && phiCheck->getParent() == successor) {
-                DEBUG(errs() << "\t\t\t\t\tPHI Node\n");
-                if (phiCheck->getBasicBlockIndex(originalBlock) != -1) {
-                  phiCheck->addIncoming(VMap[&inst], copyBlock);
-                }
-                // break;
-              } else {
-                // This is an artificially created PHINode whose value will
-                // always come from the "upper" blocks as originally
-                // Might only happen in a loop
-                // cf
-                // http://llvm.org/docs/doxygen/html/classllvm_1_1LoopInfo.html
-                DEBUG(errs() << "\t\t\t\t\tNone-PHI Node\n");
-                if (!phi) {
-                  DEBUG(errs() << "\t\t\t\t\t\tCreating PHI Node\n");
-                  // If still not, then we will create in successor
-                  phi = PHINode::Create(
-                      inst.getType(), 2, "",
-                      successor->getFirstNonPHIOrDbgOrLifetime());
-                  phi->addIncoming(&inst, originalBlock);
-
-                }
-                users.push_back(*user);
-              }
-#endif
-          }
-        }
-        if (!used) {
-          DEBUG(errs() << "\t\t\t\t\tNo use outside of basic block\n");
-          continue;
-        }
+    ValueToValueMapTy VMap;
+    if (kind == cloneTarget) {
+      DEBUG(errs() << "\t\tCloning Basic Block\n");
+      ++NumTargetsCloned;
+      Twine prefix = "Cloned";
+      bogusBlock = CloneBasicBlock(originalBlock, VMap, prefix, &F);
+      DEBUG(bogusBlock->setName(block->getName() + "_cloned"));
+
+      // Remap operands, phi nodes, and metadata
+      DEBUG(errs() << "\t\tRemapping information\n");
+
+      for (auto &inst : *bogusBlock) {
+        RemapInstruction(&inst, VMap, RF_IgnoreMissingEntries);
+      }
 
-        if (usedNonPhi) {
-          DEBUG(errs() << "\t\t\t\tCreating PHI Node\n");
-          // If still not, then we will create in successor
-          PHINode *phi =
-              PHINode::Create(inst.getType(), 2, "",
-                              successor->getFirstNonPHIOrDbgOrLifetime());
-          phiUsers.push_back(phi);
-        }
-        DEBUG(errs() << "\t\t\t\tUpdating PHI Nodes\n");
-        for (auto phi : phiUsers) {
-          DEBUG(errs() << "\t\t\t\t" << *phi << "\n");
-          if (phi->getBasicBlockIndex(originalBlock) == -1)
-            phi->addIncoming(&inst, originalBlock);
-          if (phi->getBasicBlockIndex(copyBlock) == -1)
-            phi->addIncoming(VMap[&inst], copyBlock);
-          DEBUG(errs() << "\t\t\t\t\tUpdating use\n");
-          // Update users
-          for (User *user : users) {
-            user->replaceUsesOfWith(&inst, phi);
+      // The copy is either branch of the predicate
+      OpaquePredicate::createStub(block, originalBlock, bogusBlock);
+    } else if (kind == reuseTarget) {
+      DEBUG(errs() << "\t\tReusing " << bogusBlock->getName() << "\n");
+      ++NumTargetsReused;
+
+      // The husk is a new predecessor of the reused block
+      for (auto &inst : *bogusBlock) {
+        PHINode *phi = dyn_cast<PHINode>(&inst);
+        if (!phi)
+          break;
+        Value *incoming = UndefValue::get(phi->getType());
+        for (unsigned i = 0, e = phi->getNumIncomingValues(); i != e; ++i) {
+          if (isAvailable(phi->getIncomingValue(i), block,
+                          getAnalysis<DominatorTree>())) {
+            incoming = phi->getIncomingValue(i);
+            break;
           }
-#if 0
-            DEBUG(errs()
-                  << "\t\t\t\t\tAdding missing incomings for predecessors\n");
-            // Add incoming phi nodes for all the successor's predecessors
-            // to point to itself
-            // This is because the Value was used not in a PHINode but from
-            // our own created one, then the Value must have only been
-            // produced
-            // in the block that we just split. And thus not going to be
-            // changed
-
-            for (auto pred = pred_begin(successor),
-                      predEnd = pred_end(successor);
-                 pred != predEnd; ++pred) {
-              DEBUG(errs() << "\t\t\t\t\t\t" << (*pred)->getName() << "\n");
-              if (*pred != originalBlock && *pred != copyBlock &&
-                  phi->getBasicBlockIndex(*pred) == -1) {
-                DEBUG(errs() << "\t\t\t\t\t\t\tAdding\n");
-                phi->addIncoming(phi, *pred);
-              }
-            }
-#endif
-
-          DEBUG(errs() << "\t\t\t\t\tDemoting PHI Node to stack\n");
-          DemotePHIToStack(phi);
         }
+        phi->addIncoming(incoming, block);
       }
 
-#if 0
-        // Now iterate through all the PHINode of successor to see if there
-        // are any incoming blocks from the original block but not from the
-        // clone block -- could be due to constant Value for example
-        for (auto &inst : *successor) {
-          if (PHINode *phi = dyn_cast<PHINode>(&inst)) {
-            bool phiOriginalBlock = false, phiClonedBlock = false;
-            Value *originalValue = nullptr;
-
-            for (unsigned j = 0, jEnd = phi->getNumIncomingValues(); j != jEnd;
-                 ++j) {
-              if (phi->getIncomingBlock(j) == originalBlock) {
-                phiOriginalBlock = true;
-                originalValue = phi->getIncomingValue(j);
-              } else if (phi->getIncomingBlock(j) == copyBlock) {
-                phiClonedBlock = true;
-              }
-            }
-            if (!phiClonedBlock && phiOriginalBlock && originalValue) {
-              phi->addIncoming(originalValue, copyBlock);
-            }
-          }
-        }
-#endif
+      // The reused block is live, so it must neither be taken by the
+      // predicate nor marked unreachable
+      OpaquePredicate::createStub(block, originalBlock, bogusBlock,
+                                  OpaquePredicate::PredicateTrue, false);
+    } else {
+      DEBUG(errs() << "\t\tCreating junk block\n");
+      ++NumTargetsJunk;
+      bogusBlock = createJunkBlock(block, originalBlock, successor);
+      DEBUG(bogusBlock->setName(block->getName() + "_junk"));
+      OpaquePredicate::createStub(block, originalBlock, bogusBlock,
+                                  OpaquePredicate::PredicateTrue);
     }
+    hasBeenModified |= true;
 
-    // Clear the unconditional branch from the "husk" original block
-    block->getTerminator()->eraseFromParent();
+    // A copy or junk block is a new predecessor of the successor
+    if (successor && kind != reuseTarget) {
+      DEBUG(errs() << "\t\tAdding incoming values from bogus block\n");
+      for (auto &inst : *successor) {
+        PHINode *phi = dyn_cast<PHINode>(&inst);
+        if (!phi)
+          break;
+        Value *incoming = phi->getIncomingValueForBlock(originalBlock);
+        Value *mapped = VMap.lookup(incoming);
+        if (mapped) {
+          incoming = mapped;
+        } else if (kind == junkTarget && isa<Instruction>(incoming) &&
+                   cast<Instruction>(incoming)->getParent() == originalBlock) {
+          // Values of the original block are not defined on the junk path
+          incoming = UndefValue::get(phi->getType());
+        }
+        phi->addIncoming(incoming, bogusBlock);
+      }
+    }
 
-    OpaquePredicate::createStub(block, originalBlock, copyBlock);
-    hasBeenModified |= true;
+    // Values of the original block are now also defined by the copy. Their
+    // uses in other blocks are rewritten by SSAUpdater, which inserts PHI
+    // Nodes where the two definitions meet. Paths through a reused or junk
+    // block carry no definition and get undef
+    DEBUG(errs() << "\t\tHandling successor use\n");
+    for (auto &inst : *originalBlock) {
+      std::vector<Use *> uses;
+      for (auto user = inst.use_begin(), useEnd = inst.use_end();
+           user != useEnd; ++user) {
+        Instruction *userInst = dyn_cast<Instruction>(*user);
+        assert(userInst && "User is not an instruction!");
+        BasicBlock *userBlock = userInst->getParent();
+        if (userBlock != originalBlock &&
+            (kind != cloneTarget || userBlock != bogusBlock)) {
+          uses.push_back(&user.getUse());
+        }
+      }
+      if (uses.empty())
+        continue;
+
+      DEBUG(errs() << "\t\t\t" << inst << "\n");
+      DEBUG(errs() << "\t\t\t\t" << uses.size() << " uses outside\n");
+      SSAUpdater updater;
+      updater.Initialize(inst.getType(), inst.getName());
+      updater.AddAvailableValue(originalBlock, &inst);
+      if (kind == cloneTarget) {
+        updater.AddAvailableValue(bogusBlock, VMap[&inst]);
+      }
+      for (Use *use : uses) {
+        updater.RewriteUse(*use);
+      }
+    }
   }
   // DEBUG_WITH_TYPE("cfg", F.viewCFG());
   if (hasBeenModified)
@@ -405,6 +455,139 @@ bool BogusCF::runOnFunction(Function &F) {
   return hasBeenModified;
 }
 
+BasicBlock *BogusCF::findReuseTarget(BasicBlock *block,
+                                     const std::vector<BasicBlock *> &targets,
+                                     DominatorTree &DT) {
+  if (targets.empty())
+    return nullptr;
+
+  std::uniform_int_distribution<size_t> start(0, targets.size() - 1);
+  size_t first = start(engine);
+  size_t attempts = std::min<size_t>(maxReuseAttempts, targets.size());
+  for (size_t i = 0; i < attempts; ++i) {
+    BasicBlock *target = targets[(first + i) % targets.size()];
+    if (target == block)
+      continue;
+
+    // Unreachable blocks are not in the tree
+    DomTreeNode *node = DT.getNode(target);
+    if (!node || !node->getIDom())
+      continue;
+
+    // The new edge leaves the dominator tree unchanged if the immediate
+    // dominator of the target also dominates block
+    if (!DT.dominates(node->getIDom()->getBlock(), block))
+      continue;
+
+    // Values used by the target have to be defined along the new edge. This
+    // also rejects values that have been moved into split blocks
+    bool usable = true;
+    for (auto &inst : *target) {
+      if (isa<PHINode>(&inst))
+        continue;
+      for (unsigned j = 0, e = inst.getNumOperands(); j != e && usable; ++j) {
+        Instruction *operand = dyn_cast<Instruction>(inst.getOperand(j));
+        if (operand && operand->getParent() != target)
+          usable = isAvailable(operand, block, DT);
+      }
+      if (!usable)
+        break;
+    }
+    if (usable)
+      return target;
+  }
+  return nullptr;
+}
+
+BasicBlock *BogusCF::createJunkBlock(BasicBlock *block,
+                                     BasicBlock *originalBlock,
+                                     BasicBlock *successor) {
+  LLVMContext &context = block->getContext();
+  Function *F = block->getParent();
+  BasicBlock *junkBlock = BasicBlock::Create(context, "", F);
+
+  // Integer values read by the original block are also available at the end
+  // of block, which is its only predecessor
+  std::vector<Value *> operands;
+  for (auto &inst : *originalBlock) {
+    for (unsigned i = 0, e = inst.getNumOperands(); i != e; ++i) {
+      Value *operand = inst.getOperand(i);
+      if (!operand->getType()->isIntegerTy())
+        continue;
+      Instruction *operandInst = dyn_cast<Instruction>(operand);
+      if (isa<Argument>(operand) ||
+          (operandInst && operandInst->getParent() != originalBlock))
+        operands.push_back(operand);
+    }
+  }
+
+  Type *type = Type::getInt32Ty(context);
+  if (!operands.empty()) {
+    std::uniform_int_distribution<size_t> pick(0, operands.size() - 1);
+    type = operands[pick(engine)]->getType();
+    operands.erase(std::remove_if(operands.begin(), operands.end(),
+                                  [type](Value *operand) {
+                     return operand->getType() != type;
+                   }),
+                   operands.end());
+  }
+
+  static const Instruction::BinaryOps opcodes[] = {
+    Instruction::Add, Instruction::Sub, Instruction::Mul,
+    Instruction::Xor, Instruction::And, Instruction::Or
+  };
+  std::uniform_int_distribution<unsigned> opcode(
+      0, sizeof(opcodes) / sizeof(opcodes[0]) - 1);
+  std::uniform_int_distribution<uint64_t> constant;
+  auto getOperand = [&]() -> Value * {
+    // One past the end stands for a new constant
+    std::uniform_int_distribution<size_t> pick(0, operands.size());
+    size_t index = pick(engine);
+    if (index == operands.size())
+      return ConstantInt::get(type, constant(engine));
+    return operands[index];
+  };
+
+  Value *last = nullptr;
+  for (unsigned i = 0; i < bcfJunkSize; ++i) {
+    Value *lhs = getOperand();
+    Value *rhs = getOperand();
+    last = BinaryOperator::Create(opcodes[opcode(engine)], lhs, rhs, "",
+                                  junkBlock);
+    operands.push_back(last);
+  }
+
+  TerminatorInst *terminator = originalBlock->getTerminator();
+  if (successor) {
+    BranchInst::Create(successor, junkBlock);
+  } else if (isa<ReturnInst>(terminator)) {
+    Type *returnType = F->getReturnType();
+    if (returnType->isVoidTy()) {
+      ReturnInst::Create(context, junkBlock);
+    } else if (last && last->getType() == returnType) {
+      ReturnInst::Create(context, last, junkBlock);
+    } else {
+      ReturnInst::Create(context, Constant::getNullValue(returnType),
+                         junkBlock);
+    }
+  } else {
+    new UnreachableInst(context, junkBlock);
+  }
+  return junkBlock;
+}
+
+bool BogusCF::isAvailable(Value *value, BasicBlock *block, DominatorTree &DT) {
+  // Constants, globals and arguments are available everywhere
+  Instruction *inst = dyn_cast<Instruction>(value);
+  if (!inst)
+    return true;
+  // Blocks created since the tree was computed are not in it
+  BasicBlock *parent = inst->getParent();
+  return DT.getNode(parent) && DT.dominates(parent, block);
+}
+
+ArrayRef<std::string> BogusCF::getRequestedFunctions() { return bcfFunc; }
+
 bool BogusCF::isEligible(Function &F) {
   DEBUG(errs() << "BogusCF: Checking " << F.getName() << " eligibility:\n");
   if (F.isDeclaration()) {
@@ -430,8 +613,8 @@ bool BogusCF::isEligible(Function &F) {
       continue;
     }
 
-    // We skip functions with InvokeInst because PHI demotions are not
-    // supported with invoke edges by LLVM yet.
+    // We skip functions with InvokeInst because the edges of an invoke
+    // cannot be split to join the original and cloned blocks.
     TerminatorInst *terminator = block.getTerminator();
     if (isa<InvokeInst>(terminator)) {
       DEBUG(errs() << "\tIneligible -- Function has InvokeInst\n");
@@ -448,6 +631,16 @@ bool BogusCF::isEligible(Function &F) {
   return true;
 }
 
+void BogusCF::getAnalysisUsage(AnalysisUsage &AU) const {
+  // Block frequencies are only needed to scale the profile counts
+  if (ProfileHotness::hasProfile())
+    AU.addRequired<BlockFrequencyInfo>();
+  AU.addRequired<DominatorTree>();
+  if (StaticHotness::isEnabled() && !ProfileHotness::hasProfile())
+    AU.addRequired<StaticHotness>();
+  AU.addPreserved<StaticHotness>();
+}
+
 char BogusCF::ID = 0;
 static RegisterPass<BogusCF>
     X("boguscf", "Insert bogus control flow paths into basic blocks", false,
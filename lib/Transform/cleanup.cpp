@@ -9,6 +9,7 @@
 #define DEBUG_TYPE "cleanup"
 #include "Transform/cleanup.h"
 #include "Transform/obf_utilities.h"
+#include "Transform/pass_trace.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
@@ -20,6 +21,7 @@
 #include "llvm/Support/CFG.h"
 
 bool CleanupPass::runOnFunction(Function &F) {
+  PassTrace::FunctionScope trace(this, F);
   bool hasBeenModified = false;
   for (auto &block : F) {
     for (auto &inst : block) {
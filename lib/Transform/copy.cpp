@@ -10,6 +10,10 @@
 #include "Transform/copy.h"
 #include "Transform/boguscf.h"
 #include "Transform/flatten.h"
+#include "Transform/pass_trace.h"
+#include "Transform/profile_hotness.h"
+#include "Transform/random_service.h"
+#include "Transform/static_hotness.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Value.h"
@@ -24,7 +28,6 @@
 #include "llvm/Support/CFG.h"
 #include <algorithm>
 #include <vector>
-#include <chrono>
 
 static cl::list<std::string> copyFunc("copyFunc", cl::CommaSeparated,
                                       cl::desc("Only copy some functions: "
@@ -42,7 +45,7 @@ static cl::opt<double>
 
 static cl::opt<std::string> copySeed(
     "copySeed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to obfSeed"));
 
 static cl::opt<bool> copyEnsureEligibility(
     "copyEnsureEligibility", cl::init(true),
@@ -61,30 +64,24 @@ static cl::opt<bool> disableCopy(
 bool Copy::runOnModule(Module &M) {
   if (disableCopy)
     return false;
+  PassTrace::ModuleScope trace(this, M);
 
   // Initialise
   if (copyProbability < 0.f || copyProbability > 1.f) {
-    LLVMContext &ctx = getGlobalContext();
-    ctx.emitError("Copy: Probability must be between 0 and 1");
+    M.getContext().emitError("Copy: Probability must be between 0 and 1");
+    return false;
   }
 
   if (copyReplaceProbability < 0.f || copyReplaceProbability > 1.f) {
-    LLVMContext &ctx = getGlobalContext();
-    ctx.emitError("Copy: copyReplaceProbability must be between 0 and 1");
+    M.getContext().emitError(
+        "Copy: copyReplaceProbability must be between 0 and 1");
+    return false;
   }
 
   if (copyProbability == 0.f) {
     return false;
   }
-  // Seed engine and create distribution
-  if (!copySeed.empty()) {
-    std::seed_seq seed(copySeed.begin(), copySeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
-  }
-
+  // Create distributions, the engine is seeded for each function
   trial.param(std::bernoulli_distribution::param_type((double)copyProbability));
   trialReplace.param(
       std::bernoulli_distribution::param_type((double)copyReplaceProbability));
@@ -92,12 +89,27 @@ bool Copy::runOnModule(Module &M) {
   bool hasBeenModified = false;
   auto funcListStart = copyFunc.begin(), funcListEnd = copyFunc.end();
   std::vector<Function *> cloneList;
+  // Without a profile, frequently called functions are copied less often
+  StaticHotness *hotness = nullptr;
+  if (!ProfileHotness::hasProfile() && StaticHotness::isEnabled()) {
+    hotness = &getAnalysis<StaticHotness>();
+  }
   for (auto &F : M) {
     if (F.isDeclaration())
       continue;
 
     DEBUG(errs() << "Copy: Function '" << F.getName() << "'\n");
-    if (copyFunc.empty()) {
+    RandomService::seed(engine, "copy", copySeed, F);
+    double frequency = hotness ? hotness->getFunctionFrequency(F) : 0.0;
+    if (copyFunc.empty() && frequency > 1.0) {
+      DEBUG(errs() << "\tEstimated frequency: " << frequency << "\n");
+      std::bernoulli_distribution coldTrial(
+          StaticHotness::scaleProbability(trial.p(), frequency));
+      if (!coldTrial(engine)) {
+        DEBUG(errs() << "\tSkipping: Bernoulli trial failed\n");
+        continue;
+      }
+    } else if (copyFunc.empty()) {
       // Play dice
       if (!trial(engine)) {
         DEBUG(errs() << "\tSkipping: Bernoulli trial failed\n");
@@ -115,6 +127,9 @@ bool Copy::runOnModule(Module &M) {
 
   for (Function *F : cloneList) {
     DEBUG(errs() << F->getName() << ":\n");
+    PassTrace::FunctionScope functionTrace(this, *F);
+    // A stream of its own so that it does not depend on the trials above
+    RandomService::seed(engine, "copy-replace", copySeed, *F);
 
     ObfUtils::ObfType mustObfType = ObfUtils::NoneObf;
     if (copyEnsureEligibility) {
@@ -232,6 +247,11 @@ bool Copy::runOnModule(Module &M) {
   return hasBeenModified;
 }
 
+void Copy::getAnalysisUsage(AnalysisUsage &AU) const {
+  if (StaticHotness::isEnabled() && !ProfileHotness::hasProfile())
+    AU.addRequired<StaticHotness>();
+}
+
 void Copy::tagFunction(Function &F, ObfUtils::ObfType type) {
   ObfUtils::tagFunction(F, ObfUtils::CopyObf,
                         MDString::get(F.getContext(), obfString(type)));
@@ -252,6 +272,8 @@ bool Copy::isFunctionTagged(Function &F, ObfUtils::ObfType type) {
   return false;
 }
 
+ArrayRef<std::string> Copy::getRequestedFunctions() { return copyFunc; }
+
 StringRef Copy::obfString(ObfUtils::ObfType type) {
   switch (type) {
   case ObfUtils::BogusCFObf:
@@ -7,11 +7,62 @@
 //
 //===----------------------------------------------------------------------===//
 // http://ac.inf.elte.hu/Vol_030_2009/003.pdf
+//
+// Command line options
+// - flattenFunc - List of functions to flatten. Default is all
+// - flattenProbability - Probability that a function is flattened. Default 0.5
+// - flattenSeed - Seed for random number generator. Defaults to obfSeed
+// - flattenDispatch - How the dispatcher jumps to the next block
+//   - table: Load the block address from a private table (default)
+//   - address: Each block selects the address of its successor directly, so
+//              the dispatcher needs no load
+//   - switch: Switch on the block index, which the backend lowers to a jump
+//             table or a binary tree
+// - flattenReplicate - Copy the dispatcher into the tail of every block, so
+//                      the branch predictor sees one dispatch site per block
+//                      like a threaded interpreter. Default false. Only with
+//                      table dispatch: a copied address or switch dispatcher
+//                      branches on constants, which SimplifyCFG folds back
+//                      into direct branches
+// - flattenReplicateLimit - Stop replicating once this many dispatch
+//                           destinations have been added. Default 4096
+// - flattenGroupSize - Functions with more blocks than this get a two level
+//                      dispatcher: the high bits of the index select a group
+//                      and the low bits a block in it. Blocks with a single
+//                      successor jump straight to the sub-dispatcher of its
+//                      group. Must be a power of 2. Default 0, i.e. disabled.
+//                      Takes precedence over flattenReplicate
+// - flattenSSA - Carry values across the dispatcher with PHI Nodes built from
+//                a liveness analysis instead of demoting them to the stack.
+//                A value gets undef from every block where it is dead, so it
+//                is only kept in a register where it is live. Default false.
+//                The dispatcher is not replicated or split in this mode
+// - flattenLoops - Which loops keep their back edges and the edges between
+//                  their blocks as direct branches
+//   - all: Flatten every loop (default)
+//   - innermost: Keep innermost loops
+//   - trips: Keep loops with a constant trip count of at least
+//            flattenLoopTrips
+// - flattenLoopTrips - Trip count from which loops are kept. Default 16
+// - flattenEdgeProbability - Probability that each remaining edge is
+//                            flattened. Default 1.0
+//
+// Loops and edges are always flattened together with flattenSSA
+//
+// When a profile is given with -obfProfile, functions containing blocks above
+// the hot threshold are flattened with a probability scaled by -obfHotScale.
+// Otherwise the probability is scaled down by the statically estimated
+// frequency of the most frequently executed block (c.f. static_hotness.cpp)
 #define DEBUG_TYPE "flatten"
 #include "Transform/flatten.h"
 #include "Transform/copy.h"
 #include "Transform/obf_utilities.h"
+#include "Transform/pass_trace.h"
+#include "Transform/profile_hotness.h"
+#include "Transform/random_service.h"
+#include "Transform/static_hotness.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/Dominators.h"
 #include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Scalar.h"
@@ -26,11 +77,11 @@
 #include "llvm/IR/User.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CFG.h"
 #include <algorithm>
 #include <vector>
-#include <chrono>
 #include <random>
 
 using namespace llvm;
@@ -42,23 +93,525 @@ flattenFunc("flattenFunc", cl::CommaSeparated,
 
 static cl::opt<std::string> flattenSeed(
     "flattenSeed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to obfSeed"));
 
 static cl::opt<double>
 flattenProbability("flattenProbability", cl::init(0.5),
                    cl::desc("Probability that a function will be split"));
 
+enum FlattenDispatch {
+  tableDispatch,
+  addressDispatch,
+  switchDispatch
+};
+
+static cl::opt<FlattenDispatch> flattenDispatch(
+    "flattenDispatch", cl::init(tableDispatch),
+    cl::desc("How the flattened blocks are dispatched to"),
+    cl::values(clEnumValN(tableDispatch, "table",
+                          "Load the address from a table and branch to it"),
+               clEnumValN(addressDispatch, "address",
+                          "Select the address and branch to it"),
+               clEnumValN(switchDispatch, "switch",
+                          "Switch on the index of the block"),
+               clEnumValEnd));
+
+static cl::opt<bool> flattenReplicate(
+    "flattenReplicate", cl::init(false),
+    cl::desc("Copy the dispatcher into the tail of every flattened block. "
+             "Requires flattenDispatch=table"));
+
+static cl::opt<unsigned> flattenReplicateLimit(
+    "flattenReplicateLimit", cl::init(4096),
+    cl::desc("Maximum number of dispatch destinations added per function by "
+             "flattenReplicate"));
+
+static cl::opt<unsigned> flattenGroupSize(
+    "flattenGroupSize", cl::init(0),
+    cl::desc("Dispatch through sub-dispatchers of this many blocks each when "
+             "a function has more blocks. Must be a power of 2. Default 0 "
+             "disables"));
+
+static cl::opt<bool> flattenSSA(
+    "flattenSSA", cl::init(false),
+    cl::desc("Carry values across the dispatcher in SSA form pruned by "
+             "liveness instead of demoting them to the stack"));
+
+enum FlattenLoops {
+  allLoops,
+  innermostLoops,
+  tripLoops
+};
+
+static cl::opt<FlattenLoops> flattenLoops(
+    "flattenLoops", cl::init(allLoops),
+    cl::desc("Loops whose edges are kept as direct branches"),
+    cl::values(clEnumValN(allLoops, "all", "Flatten every loop"),
+               clEnumValN(innermostLoops, "innermost", "Keep innermost loops"),
+               clEnumValN(tripLoops, "trips",
+                          "Keep loops iterating at least flattenLoopTrips "
+                          "times"),
+               clEnumValEnd));
+
+static cl::opt<unsigned> flattenLoopTrips(
+    "flattenLoopTrips", cl::init(16),
+    cl::desc("Constant trip count from which loops are kept with "
+             "flattenLoops=trips"));
+
+static cl::opt<double> flattenEdgeProbability(
+    "flattenEdgeProbability", cl::init(1.0),
+    cl::desc("Probability that an edge outside kept loops is flattened"));
+
 static cl::opt<bool> disableFlatten(
     "disableFlatten", cl::init(false),
     cl::desc("Disable Flatten pass regardless. Useful when used in -OX mode."));
 
 Value *Flatten::findBlock(LLVMContext &context,
-                          std::vector<BasicBlock *> &blocks,
+                          DenseMap<BasicBlock *, unsigned> &indices,
                           BasicBlock *block) {
-  auto iterator = std::find(blocks.begin(), blocks.end(), block);
-  assert(iterator != blocks.end() && "Block does not exist in vector!");
-  unsigned index = iterator - blocks.begin();
-  return ConstantInt::get(Type::getInt32Ty(context), index, false);
+  if (flattenDispatch == addressDispatch)
+    return BlockAddress::get(block);
+
+  auto iterator = indices.find(block);
+  assert(iterator != indices.end() && "Block does not exist in vector!");
+  return ConstantInt::get(Type::getInt32Ty(context), iterator->second, false);
+}
+
+TerminatorInst *Flatten::createDispatch(BasicBlock *block, Value *jumpIndex,
+                                        std::vector<BasicBlock *> &blocks,
+                                        GlobalVariable *&jumpTable) {
+  Function &F = *block->getParent();
+  LLVMContext &context = F.getContext();
+  IRBuilder<> builder(block);
+
+  switch (flattenDispatch) {
+  case switchDispatch: {
+    DEBUG(errs() << "\tCreating switch dispatcher\n");
+    // The last block is the default so that no extra block is needed
+    SwitchInst *switchInst =
+        builder.CreateSwitch(jumpIndex, blocks.back(), blocks.size() - 1);
+    for (unsigned i = 0, iEnd = blocks.size() - 1; i < iEnd; ++i) {
+      switchInst->addCase(ConstantInt::get(Type::getInt32Ty(context), i),
+                          blocks[i]);
+    }
+    return switchInst;
+  }
+  case addressDispatch: {
+    DEBUG(errs() << "\tCreating address dispatcher\n");
+    IndirectBrInst *indirectBranch =
+        builder.CreateIndirectBr(jumpIndex, blocks.size());
+    for (BasicBlock *destination : blocks) {
+      indirectBranch->addDestination(destination);
+    }
+    return indirectBranch;
+  }
+  case tableDispatch:
+    break;
+  }
+
+  // Create JumpTables, shared by every dispatcher of the function
+  if (!jumpTable) {
+    DEBUG(errs() << "\tCreating jump table:\n");
+    std::vector<Constant *> blockAddresses(blocks.size());
+    for (unsigned i = 0, iEnd = blocks.size(); i < iEnd; ++i) {
+      blockAddresses[i] = (Constant *)BlockAddress::get(blocks[i]);
+    }
+    ArrayType *jumpType =
+        ArrayType::get(Type::getInt8PtrTy(context), blocks.size());
+    Constant *jumpValues = ConstantArray::get(jumpType, blockAddresses);
+    Twine jumpTableName("");
+    DEBUG(jumpTableName =
+              jumpTableName.concat(F.getName()).concat("_jumpTable"));
+    jumpTable = new GlobalVariable(*(F.getParent()), jumpType, false,
+                                   GlobalValue::PrivateLinkage, jumpValues,
+                                   jumpTableName);
+  }
+
+  Value *indices[2];
+  indices[0] = ConstantInt::get(Type::getInt32Ty(context), 0, true);
+  indices[1] = jumpIndex;
+
+  // Create indirect branch
+  Twine jumpAddrPtrName("");
+  DEBUG(jumpAddrPtrName = jumpAddrPtrName.concat("jump_addr_ptr"));
+  Value *jumpAddressPtr =
+      builder.CreateInBoundsGEP(jumpTable, indices, jumpAddrPtrName);
+  Twine jumpAddrName("");
+  DEBUG(jumpAddrName = jumpAddrName.concat("jump_addr"));
+  LoadInst *jumpAddr = builder.CreateLoad(jumpAddressPtr, jumpAddrName);
+  IndirectBrInst *indirectBranch =
+      builder.CreateIndirectBr(jumpAddr, blocks.size());
+  assert(indirectBranch && "IndirectBranchInst cannot be null!");
+  for (BasicBlock *destination : blocks) {
+    indirectBranch->addDestination(destination);
+  }
+  return indirectBranch;
+}
+
+void Flatten::demoteValues(BasicBlock *jumpBlock, PHINode *jumpIndex,
+                           std::vector<BasicBlock *> &blocks) {
+  // Collect first, since demoting adds stores and reloads
+  std::vector<Instruction *> values;
+  for (BasicBlock *block : blocks) {
+    if (block->getTerminator()->getNumSuccessors() == 0)
+      continue;
+    for (auto &inst : *block) {
+      for (auto user = inst.use_begin(), useEnd = inst.use_end();
+           user != useEnd; ++user) {
+        Instruction *userInst = dyn_cast<Instruction>(*user);
+        assert(userInst && "User is not an instruction");
+        if (userInst != jumpIndex && userInst->getParent() != block) {
+          values.push_back(&inst);
+          break;
+        }
+      }
+    }
+  }
+  DEBUG(errs() << "\tDemoting " << values.size() << " values to stack\n");
+
+  Instruction *allocaPoint = jumpBlock->getParent()->getEntryBlock().begin();
+  for (Instruction *inst : values) {
+    BasicBlock *block = inst->getParent();
+    std::vector<Instruction *> users;
+    for (auto user = inst->use_begin(), useEnd = inst->use_end();
+         user != useEnd; ++user) {
+      Instruction *userInst = cast<Instruction>(*user);
+      if (userInst != jumpIndex && userInst->getParent() != block)
+        users.push_back(userInst);
+    }
+
+    AllocaInst *slot = new AllocaInst(
+        inst->getType(), inst->getName() + ".reg2mem", allocaPoint);
+    new StoreInst(inst, slot, block->getTerminator());
+    LoadInst *reload =
+        new LoadInst(slot, inst->getName() + ".reload", jumpBlock);
+    for (Instruction *userInst : users) {
+      userInst->replaceUsesOfWith(inst, reload);
+    }
+  }
+}
+
+void Flatten::sinkReloads(BasicBlock *jumpBlock) {
+  // Values reloaded in jumpBlock from demoted PHIs would no longer dominate
+  // their users once blocks bypass it -- reload them at each use instead
+  std::vector<LoadInst *> reloads;
+  for (auto &inst : *jumpBlock) {
+    LoadInst *load = dyn_cast<LoadInst>(&inst);
+    if (load && isa<AllocaInst>(load->getPointerOperand())) {
+      reloads.push_back(load);
+    }
+  }
+  for (LoadInst *load : reloads) {
+    std::vector<Instruction *> users;
+    for (auto user = load->use_begin(), useEnd = load->use_end();
+         user != useEnd; ++user) {
+      Instruction *userInst = dyn_cast<Instruction>(*user);
+      assert(userInst && "User is not an instruction");
+      assert(!isa<PHINode>(userInst) && "PHI Nodes should have been demoted");
+      users.push_back(userInst);
+    }
+    for (Instruction *userInst : users) {
+      LoadInst *reload =
+          new LoadInst(load->getPointerOperand(), "", userInst);
+      userInst->replaceUsesOfWith(load, reload);
+    }
+    load->eraseFromParent();
+  }
+}
+
+void Flatten::createHierarchicalDispatch(BasicBlock *jumpBlock,
+                                         PHINode *jumpIndex,
+                                         std::vector<BasicBlock *> &blocks) {
+  Function &F = *jumpBlock->getParent();
+  LLVMContext &context = F.getContext();
+  Type *intType = Type::getInt32Ty(context);
+  unsigned groupSize = flattenGroupSize;
+  unsigned shift = Log2_32(groupSize);
+  unsigned groupCount = (blocks.size() + groupSize - 1) / groupSize;
+  DEBUG(errs() << "\tCreating " << groupCount << " groups of " << groupSize
+               << " blocks\n");
+
+  // Blocks will be able to bypass jumpBlock
+  sinkReloads(jumpBlock);
+
+  // One sub-dispatcher per group, dispatching on the low bits of the index
+  std::vector<BasicBlock *> subBlocks(groupCount);
+  std::vector<PHINode *> subIndices(groupCount);
+  for (unsigned i = 0; i < groupCount; ++i) {
+    subBlocks[i] = BasicBlock::Create(context, "", &F, blocks.front());
+    DEBUG(subBlocks[i]->setName("sub_jump_block"));
+    subIndices[i] = PHINode::Create(intType, 2, "", subBlocks[i]);
+  }
+
+  // Blocks that know their successor jump straight to its sub-dispatcher,
+  // keeping the top level PHI small. The remaining incoming values are
+  // compacted to the front, as removing each one would be quadratic
+  unsigned remaining = 0;
+  for (unsigned i = 0, iEnd = jumpIndex->getNumIncomingValues(); i < iEnd;
+       ++i) {
+    BasicBlock *block = jumpIndex->getIncomingBlock(i);
+    ConstantInt *index = dyn_cast<ConstantInt>(jumpIndex->getIncomingValue(i));
+    if (!index) {
+      jumpIndex->setIncomingValue(remaining, jumpIndex->getIncomingValue(i));
+      jumpIndex->setIncomingBlock(remaining, block);
+      ++remaining;
+      continue;
+    }
+    unsigned group = index->getZExtValue() >> shift;
+    // Kept edges of a conditional branch stay as they are
+    BranchInst *branch = dyn_cast<BranchInst>(block->getTerminator());
+    assert(branch && "Block should branch to jumpBlock");
+    for (unsigned j = 0, jEnd = branch->getNumSuccessors(); j < jEnd; ++j) {
+      if (branch->getSuccessor(j) == jumpBlock)
+        branch->setSuccessor(j, subBlocks[group]);
+    }
+    subIndices[group]->addIncoming(index, block);
+  }
+  while (jumpIndex->getNumIncomingValues() > remaining) {
+    jumpIndex->removeIncomingValue(jumpIndex->getNumIncomingValues() - 1,
+                                   false);
+  }
+
+  // Top level dispatches on the high bits of the index
+  IRBuilder<> jumpBuilder(jumpBlock);
+  Value *group = jumpBuilder.CreateLShr(jumpIndex, shift);
+  GlobalVariable *groupTable = nullptr;
+  createDispatch(jumpBlock, group, subBlocks, groupTable);
+
+  for (unsigned i = 0; i < groupCount; ++i) {
+    subIndices[i]->addIncoming(jumpIndex, jumpBlock);
+
+    std::vector<BasicBlock *> groupBlocks(
+        blocks.begin() + i * groupSize,
+        blocks.begin() + std::min<unsigned>((i + 1) * groupSize, blocks.size()));
+    IRBuilder<> subBuilder(subBlocks[i]);
+    Value *local = subBuilder.CreateAnd(subIndices[i], groupSize - 1);
+    GlobalVariable *subTable = nullptr;
+    createDispatch(subBlocks[i], local, groupBlocks, subTable);
+  }
+}
+
+void Flatten::replicateDispatch(BasicBlock *jumpBlock, PHINode *jumpIndex,
+                                std::vector<BasicBlock *> &blocks,
+                                GlobalVariable *jumpTable) {
+  DEBUG(errs() << "\tReplicating dispatcher\n");
+  if (blocks.size() > flattenReplicateLimit) {
+    DEBUG(errs() << "\t\tDispatcher too big to replicate\n");
+    return;
+  }
+
+  sinkReloads(jumpBlock);
+
+  // Copy the dispatcher into the tail of each block, subject to the total
+  // number of destinations replicated
+  unsigned budget = flattenReplicateLimit;
+  for (BasicBlock *block : blocks) {
+    if (budget < blocks.size()) {
+      DEBUG(errs() << "\t\tReplication limit reached\n");
+      break;
+    }
+    int index = jumpIndex->getBasicBlockIndex(block);
+    if (index == -1)
+      continue;
+    // Blocks that keep one of their edges branch conditionally
+    BranchInst *branch = dyn_cast<BranchInst>(block->getTerminator());
+    if (branch && branch->isConditional())
+      continue;
+
+    DEBUG(errs() << "\t\t" << block->getName() << "\n");
+    Value *target = jumpIndex->getIncomingValue(index);
+    jumpIndex->removeIncomingValue(index, false);
+    block->getTerminator()->eraseFromParent();
+    createDispatch(block, target, blocks, jumpTable);
+    budget -= blocks.size();
+  }
+}
+
+void Flatten::findKeptLoops(LoopInfo &LI, ScalarEvolution &SE) {
+  keptLoops.clear();
+  if (flattenLoops == allLoops)
+    return;
+
+  std::vector<Loop *> worklist(LI.begin(), LI.end());
+  while (!worklist.empty()) {
+    Loop *loop = worklist.back();
+    worklist.pop_back();
+    worklist.insert(worklist.end(), loop->begin(), loop->end());
+
+    bool keep;
+    if (flattenLoops == innermostLoops) {
+      keep = loop->empty();
+    } else {
+      BasicBlock *exiting = loop->getExitingBlock();
+      keep = exiting &&
+             SE.getSmallConstantTripCount(loop, exiting) >= flattenLoopTrips;
+    }
+    if (keep) {
+      DEBUG(errs() << "\tKeeping loop at " << loop->getHeader()->getName()
+                   << "\n");
+      keptLoops.insert(loop);
+    }
+  }
+}
+
+bool Flatten::keepsEdge(LoopInfo &LI, BasicBlock *from, BasicBlock *to) {
+  for (Loop *loop = LI.getLoopFor(from); loop; loop = loop->getParentLoop()) {
+    if (keptLoops.count(loop) && loop->contains(to))
+      return true;
+  }
+  return flattenEdgeProbability < 1.0 && !edgeTrial(engine);
+}
+
+void Flatten::computeLiveOut(Function &F, LiveOutMap &liveOut) {
+  BasicBlock *entryBlock = &F.getEntryBlock();
+  for (auto &block : F) {
+    // Values of the entry block dominate jumpBlock and need no carrying
+    if (&block == entryBlock)
+      continue;
+
+    for (auto &inst : block) {
+      // Walk backwards from each use until the definition is reached
+      SmallPtrSet<BasicBlock *, 8> liveIn, out;
+      std::vector<BasicBlock *> worklist;
+      for (auto user = inst.use_begin(), useEnd = inst.use_end();
+           user != useEnd; ++user) {
+        Instruction *userInst = dyn_cast<Instruction>(*user);
+        assert(userInst && "User is not an instruction");
+        if (PHINode *phi = dyn_cast<PHINode>(userInst)) {
+          // Used at the end of the incoming blocks
+          for (unsigned i = 0, iEnd = phi->getNumIncomingValues(); i < iEnd;
+               ++i) {
+            if (phi->getIncomingValue(i) == &inst) {
+              out.insert(phi->getIncomingBlock(i));
+              worklist.push_back(phi->getIncomingBlock(i));
+            }
+          }
+        } else if (userInst->getParent() != &block) {
+          worklist.push_back(userInst->getParent());
+        }
+      }
+      while (!worklist.empty()) {
+        BasicBlock *current = worklist.back();
+        worklist.pop_back();
+        if (current == &block || !liveIn.insert(current))
+          continue;
+        for (auto pred = pred_begin(current), predEnd = pred_end(current);
+             pred != predEnd; ++pred) {
+          out.insert(*pred);
+          worklist.push_back(*pred);
+        }
+      }
+      if (!out.empty())
+        liveOut[&inst] = out;
+    }
+  }
+}
+
+void Flatten::carryValues(BasicBlock *jumpBlock, LiveOutMap &liveOut) {
+  Function &F = *jumpBlock->getParent();
+  std::vector<BasicBlock *> preds(pred_begin(jumpBlock), pred_end(jumpBlock));
+
+  // Every PHI Node of a flattened block is replaced by one in jumpBlock
+  // selecting its incoming value, and every value live across blocks gets
+  // one carrying it. Created up front since they refer to each other
+  std::vector<Instruction *> values;
+  DenseMap<PHINode *, PHINode *> incomingPhis;
+  DenseMap<Instruction *, PHINode *> carriedPhis;
+  for (auto &block : F) {
+    if (&block == jumpBlock)
+      continue;
+    for (auto &inst : block) {
+      PHINode *phi = dyn_cast<PHINode>(&inst);
+      bool isLive = liveOut.count(&inst);
+      if (!phi && !isLive)
+        continue;
+      values.push_back(&inst);
+      if (phi) {
+        incomingPhis[phi] =
+            PHINode::Create(phi->getType(), preds.size(), "", jumpBlock);
+      }
+      if (isLive) {
+        carriedPhis[&inst] =
+            PHINode::Create(inst.getType(), preds.size(), "", jumpBlock);
+      }
+    }
+  }
+  DEBUG(errs() << "	Carrying " << carriedPhis.size() << " values and "
+               << incomingPhis.size() << " PHI Nodes\n");
+
+  // Within its block a value is itself, or the incoming value for a PHI
+  // Node. Everywhere else it is carried
+  for (Instruction *inst : values) {
+    PHINode *phi = dyn_cast<PHINode>(inst);
+    Value *local = phi ? incomingPhis[phi] : inst;
+    PHINode *carried = carriedPhis.lookup(inst);
+    std::vector<Instruction *> users;
+    for (auto user = inst->use_begin(), useEnd = inst->use_end();
+         user != useEnd; ++user) {
+      Instruction *userInst = cast<Instruction>(*user);
+      PHINode *userPhi = dyn_cast<PHINode>(userInst);
+      // Original PHI Nodes are removed below
+      if (!userPhi || !incomingPhis.count(userPhi))
+        users.push_back(userInst);
+    }
+    for (Instruction *userInst : users) {
+      if (userInst->getParent() == inst->getParent()) {
+        userInst->replaceUsesOfWith(inst, local);
+      } else {
+        assert(carried && "Value used in another block is not carried");
+        userInst->replaceUsesOfWith(inst, carried);
+      }
+    }
+  }
+
+  // Value that inst has at the end of block
+  auto valueAtEnd = [&](Value *value, BasicBlock *block) -> Value * {
+    Instruction *inst = dyn_cast<Instruction>(value);
+    if (!inst)
+      return value;
+    if (inst->getParent() == block) {
+      PHINode *phi = dyn_cast<PHINode>(inst);
+      return phi ? incomingPhis[phi] : inst;
+    }
+    // Defined in the entry block otherwise
+    PHINode *carried = carriedPhis.lookup(inst);
+    return carried ? carried : inst;
+  };
+
+  for (Instruction *inst : values) {
+    PHINode *phi = dyn_cast<PHINode>(inst);
+    if (phi) {
+      // Incoming value for the block, undef when coming from elsewhere
+      PHINode *incoming = incomingPhis[phi];
+      for (BasicBlock *pred : preds) {
+        int index = phi->getBasicBlockIndex(pred);
+        incoming->addIncoming(
+            index == -1 ? UndefValue::get(phi->getType())
+                        : valueAtEnd(phi->getIncomingValue(index), pred),
+            pred);
+      }
+    }
+
+    PHINode *carried = carriedPhis.lookup(inst);
+    if (!carried)
+      continue;
+    // Defined by its block, kept where live and undef where dead
+    SmallPtrSet<BasicBlock *, 8> &live = liveOut[inst];
+    for (BasicBlock *pred : preds) {
+      if (pred == inst->getParent()) {
+        carried->addIncoming(valueAtEnd(inst, pred), pred);
+      } else if (live.count(pred)) {
+        carried->addIncoming(carried, pred);
+      } else {
+        carried->addIncoming(UndefValue::get(inst->getType()), pred);
+      }
+    }
+  }
+
+  for (auto &pair : incomingPhis) {
+    pair.first->replaceAllUsesWith(UndefValue::get(pair.first->getType()));
+    pair.first->eraseFromParent();
+  }
 }
 
 // Initialise and check options
@@ -66,25 +619,39 @@ bool Flatten::doInitialization(Module &M) {
   if (disableFlatten)
     return false;
 
+  LLVMContext &ctx = M.getContext();
+  if (!ProfileHotness::checkProfile(ctx))
+    return false;
   if (flattenProbability < 0.f || flattenProbability > 1.f) {
-    LLVMContext &ctx = getGlobalContext();
     ctx.emitError("Flatten: Probability must be between 0 and 1");
+    return false;
   }
-  // Seed engine and create distribution
-  if (!flattenSeed.empty()) {
-    std::seed_seq seed(flattenSeed.begin(), flattenSeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
-  }
+  // Create distributions, the engine is seeded for each function
   trial.param(
       std::bernoulli_distribution::param_type((double)flattenProbability));
 
+  if (flattenEdgeProbability < 0.f || flattenEdgeProbability > 1.f) {
+    ctx.emitError("Flatten: Edge probability must be between 0 and 1");
+    return false;
+  }
+  edgeTrial.param(
+      std::bernoulli_distribution::param_type((double)flattenEdgeProbability));
+
+  if (flattenGroupSize && !isPowerOf2_32(flattenGroupSize)) {
+    ctx.emitError("Flatten: Group size must be a power of 2");
+    return false;
+  }
+
+  if (flattenReplicate && flattenDispatch != tableDispatch) {
+    errs() << "WARNING: Flatten: Dispatchers are only replicated with "
+              "-flattenDispatch=table\n";
+  }
+
   return false;
 }
 
 bool Flatten::runOnFunction(Function &F) {
+  PassTrace::FunctionScope trace(this, F);
   // If the function is declared elsewhere in other translation unit
   // we should not modify it here
   if (F.isDeclaration()) {
@@ -100,6 +667,7 @@ bool Flatten::runOnFunction(Function &F) {
     DEBUG(errs() << "\tFunction not requested -- skipping\n");
     return false;
   }
+  RandomService::seed(engine, "flatten", flattenSeed, F);
 
   LLVMContext &context = F.getContext();
 
@@ -167,24 +735,69 @@ bool Flatten::runOnFunction(Function &F) {
     return false;
   }
 
-  if (!trial(engine)) {
+  // A function is as hot as its hottest block
+  uint64_t functionCount = 0;
+  if (!mustObfuscate && ProfileHotness::hasProfile()) {
+    BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfo>();
+    functionCount = ProfileHotness::getMaxBlockCount(F, BFI);
+  }
+
+  // Otherwise as hot as its most frequently executed block is estimated to be
+  double functionFrequency = 0.0;
+  if (!mustObfuscate && !ProfileHotness::hasProfile() &&
+      StaticHotness::isEnabled()) {
+    functionFrequency = getAnalysis<StaticHotness>().getMaxBlockFrequency(F);
+  }
+
+  if (ProfileHotness::isHot(functionCount)) {
+    DEBUG(errs() << "\tHot function: " << functionCount << "\n");
+    std::bernoulli_distribution hotTrial(
+        ProfileHotness::scaleProbability(trial.p(), functionCount));
+    if (!hotTrial(engine)) {
+      DEBUG(errs() << "\tSkipping: Bernoulli trial failed\n");
+      return false;
+    }
+  } else if (functionFrequency > 1.0) {
+    DEBUG(errs() << "\tEstimated frequency: " << functionFrequency << "\n");
+    std::bernoulli_distribution coldTrial(
+        StaticHotness::scaleProbability(trial.p(), functionFrequency));
+    if (!coldTrial(engine)) {
+      DEBUG(errs() << "\tSkipping: Bernoulli trial failed\n");
+      return false;
+    }
+  } else if (!trial(engine)) {
     DEBUG(errs() << "\tSkipping: Bernoulli trial failed\n");
     return false;
   }
 
   // DEBUG_WITH_TYPE("cfg", F.viewCFG());
 
-  // Demote all the PHI Nodes to stack
-  DEBUG(errs() << "\tDemoting PHI Nodes to stack\n");
-  for (auto block : blocks) {
-    std::vector<PHINode *> phis;
-    for (auto &inst : *block) {
-      if (PHINode *phiInst = dyn_cast<PHINode>(&inst)) {
-        phis.push_back(phiInst);
+  // Edges can only be kept when values are demoted to the stack
+  bool keepEdges = !flattenSSA &&
+                   (flattenLoops != allLoops || flattenEdgeProbability < 1.0);
+  LoopInfo &LI = getAnalysis<LoopInfo>();
+  if (keepEdges) {
+    findKeptLoops(LI, getAnalysis<ScalarEvolution>());
+  }
+
+  // Liveness has to be worked out on the original control flow
+  LiveOutMap liveOut;
+  if (flattenSSA) {
+    DEBUG(errs() << "\tComputing liveness\n");
+    computeLiveOut(F, liveOut);
+  } else {
+    // Demote all the PHI Nodes to stack
+    DEBUG(errs() << "\tDemoting PHI Nodes to stack\n");
+    for (auto block : blocks) {
+      std::vector<PHINode *> phis;
+      for (auto &inst : *block) {
+        if (PHINode *phiInst = dyn_cast<PHINode>(&inst)) {
+          phis.push_back(phiInst);
+        }
+      }
+      for (auto phiInst : phis) {
+        DemotePHIToStack(phiInst);
       }
-    }
-    for (auto phiInst : phis) {
-      DemotePHIToStack(phiInst);
     }
   }
 
@@ -197,6 +810,12 @@ bool Flatten::runOnFunction(Function &F) {
   } else {
     initialBlock = entryBlock.getTerminator()->getSuccessor(0);
   }
+  // Number the blocks for the dispatcher
+  DenseMap<BasicBlock *, unsigned> indices;
+  for (unsigned i = 0, iEnd = blocks.size(); i < iEnd; ++i) {
+    indices[blocks[i]] = i;
+  }
+
   DEBUG(entryBlock.setName("entry_block"));
   DEBUG(initialBlock->setName("initial_block"));
 
@@ -212,62 +831,27 @@ bool Flatten::runOnFunction(Function &F) {
   // Jump Block builder
   IRBuilder<> jumpBuilder(jumpBlock);
 
+  // The jump index is either the index of the block or, when dispatching
+  // directly on addresses, the block address itself
+  Type *jumpIndexType = flattenDispatch == addressDispatch
+                            ? Type::getInt8PtrTy(context)
+                            : Type::getInt32Ty(context);
   Twine jumpIndexName("");
   DEBUG(jumpIndexName = jumpIndexName.concat("jump_index"));
-  PHINode *jumpIndex = jumpBuilder.CreatePHI(Type::getInt32Ty(context),
-                                             blocks.size() + 1, jumpIndexName);
-
-  DEBUG(errs() << "\tCreating jump table:\n");
-  std::vector<Constant *> blockAddresses(blocks.size());
-
-  for (unsigned i = 0, iEnd = blocks.size(); i < iEnd; ++i) {
-    BasicBlock *block = blocks[i];
-    blockAddresses[i] = (Constant *)BlockAddress::get(block);
-  }
-  // Create JumpTables
-  DEBUG(errs() << "\tCreating jump table:\n");
-  ArrayType *jumpType =
-      ArrayType::get(Type::getInt8PtrTy(context), blocks.size());
-  Constant *jumpValues = ConstantArray::get(jumpType, blockAddresses);
-  Twine jumpTableName("");
-  DEBUG(jumpTableName = jumpTableName.concat(F.getName()).concat("_jumpTable"));
-  GlobalVariable *jumpTable = new GlobalVariable(
-      *(F.getParent()), jumpType, false, GlobalValue::PrivateLinkage,
-      jumpValues, jumpTableName);
-
-  Value *indices[2];
-  indices[0] = ConstantInt::get(Type::getInt32Ty(F.getContext()), 0, true);
-  indices[1] = jumpIndex;
-
-  // Create indirect branch
-  Twine jumpAddrPtrName("");
-  DEBUG(jumpAddrPtrName = jumpAddrPtrName.concat("jump_addr_ptr"));
-  Value *jumpAddressPtr =
-      jumpBuilder.CreateInBoundsGEP(jumpTable, indices, jumpAddrPtrName);
-  Twine jumpAddrName("");
-  DEBUG(jumpAddrName = jumpAddrName.concat("jump_addr"));
-  LoadInst *jumpAddr = jumpBuilder.CreateLoad(jumpAddressPtr, jumpAddrName);
-  IndirectBrInst *indirectBranch =
-      jumpBuilder.CreateIndirectBr(jumpAddr, blocks.size());
-  assert(indirectBranch && "IndirectBranchInst cannot be null!");
+  PHINode *jumpIndex =
+      jumpBuilder.CreatePHI(jumpIndexType, blocks.size() + 1, jumpIndexName);
 
   for (unsigned i = 0, iEnd = blocks.size(); i < iEnd; ++i) {
     BasicBlock *block = blocks[i];
     assert(block != &entryBlock && "Entry block should not be processed!");
     DEBUG(errs() << "\t" << block->getName() << ":\n");
-    ConstantInt *index = ConstantInt::get(Type::getInt32Ty(context), i, false);
-
-    // Using switch for now
-    // switchInst->addCase(index, block);
-    indirectBranch->addDestination(block);
 
     // Create jump index
     if (block == initialBlock) {
-      jumpIndex->addIncoming(index, &entryBlock);
+      jumpIndex->addIncoming(findBlock(context, indices, block), &entryBlock);
     }
 
     TerminatorInst *terminator = block->getTerminator();
-    bool hasSuccessor = terminator->getNumSuccessors() > 0;
     if (terminator->getNumSuccessors() == 0) {
       // No need to do anything
       DEBUG(errs() << "\t\t0 Successor\n");
@@ -276,11 +860,16 @@ bool Flatten::runOnFunction(Function &F) {
       // Trivial
       DEBUG(errs() << "\t\t1 Successor\n");
       BasicBlock *destination = terminator->getSuccessor(0);
-      Value *destinationIndexValue = findBlock(context, blocks, destination);
-      jumpIndex->addIncoming(destinationIndexValue, block);
+      if (keepEdges && keepsEdge(LI, block, destination)) {
+        DEBUG(errs() << "\t\tKeeping edge\n");
+      } else {
+        Value *destinationIndexValue =
+            findBlock(context, indices, destination);
+        jumpIndex->addIncoming(destinationIndexValue, block);
 
-      terminator->eraseFromParent();
-      BranchInst::Create(jumpBlock, block);
+        terminator->eraseFromParent();
+        BranchInst::Create(jumpBlock, block);
+      }
     } else { // > 1 succesors
       DEBUG(errs() << "\t\t" << terminator->getNumSuccessors()
                    << " Successors\n");
@@ -289,15 +878,29 @@ bool Flatten::runOnFunction(Function &F) {
         DEBUG(errs() << "\t\tConditional branch\n");
         BasicBlock *trueBlock = branch->getSuccessor(0);
         BasicBlock *falseBlock = branch->getSuccessor(1);
-        Value *trueIndex = findBlock(context, blocks, trueBlock);
-        Value *falseIndex = findBlock(context, blocks, falseBlock);
-        SelectInst *select = SelectInst::Create(
-            branch->getCondition(), trueIndex, falseIndex, "", terminator);
+        bool keepTrue = keepEdges && keepsEdge(LI, block, trueBlock);
+        bool keepFalse = keepEdges && keepsEdge(LI, block, falseBlock);
+        if (keepTrue && keepFalse) {
+          DEBUG(errs() << "\t\tKeeping edges\n");
+        } else if (keepTrue || keepFalse) {
+          // Only the flattened successor goes through the dispatcher
+          DEBUG(errs() << "\t\tKeeping one edge\n");
+          unsigned flattened = keepTrue ? 1 : 0;
+          jumpIndex->addIncoming(
+              findBlock(context, indices, branch->getSuccessor(flattened)),
+              block);
+          branch->setSuccessor(flattened, jumpBlock);
+        } else {
+          Value *trueIndex = findBlock(context, indices, trueBlock);
+          Value *falseIndex = findBlock(context, indices, falseBlock);
+          SelectInst *select = SelectInst::Create(
+              branch->getCondition(), trueIndex, falseIndex, "", terminator);
 
-        jumpIndex->addIncoming(select, block);
+          jumpIndex->addIncoming(select, block);
 
-        terminator->eraseFromParent();
-        BranchInst::Create(jumpBlock, block);
+          terminator->eraseFromParent();
+          BranchInst::Create(jumpBlock, block);
+        }
 
 // Disabled because Invoke edges are not supported in promoting PHI
 #if 0
@@ -305,7 +908,7 @@ bool Flatten::runOnFunction(Function &F) {
           // InvokeInst
           DEBUG(errs() << "\t\tInvoke Terminator\n");
           Value *destination =
-              findBlock(context, blocks, invoke->getNormalDest());
+              findBlock(context, indices, invoke->getNormalDest());
           BasicBlock *newDestination = BasicBlock::Create(context, "", &F);
           invoke->setNormalDest(newDestination);
           jumpIndex->addIncoming(destination, newDestination);
@@ -331,50 +934,39 @@ bool Flatten::runOnFunction(Function &F) {
         phi->moveBefore(jumpBlock->begin());
       }
 #endif
-
-    if (hasSuccessor) {
-      DEBUG(errs() << "\t\tHandling successor use\n");
-      for (auto &inst : *block) {
-        DEBUG(errs() << "\t\t\t" << inst << "\n");
-        std::vector<User *> users;
-        PHINode *phi = nullptr;
-        bool isUsed = false;
-        // Find the phi node in jumpBlock if it's there
-        for (auto user = inst.use_begin(), useEnd = inst.use_end();
-             user != useEnd; ++user) {
-          Instruction *userInst = dyn_cast<Instruction>(*user);
-          assert(userInst && "User is not an instruction");
-          BasicBlock *userBlock = userInst->getParent();
-          if (userBlock == jumpBlock) {
-            phi = dyn_cast<PHINode>(userInst);
-            if (phi && phi != jumpIndex) {
-              isUsed = true;
-            }
-          } else if (userBlock != block) {
-            isUsed = true;
-            users.push_back(*user);
-            DEBUG(errs() << "\t\t\t\tUsed in " << userBlock->getName() << "\n");
-          }
-        }
-        if (isUsed && !phi) {
-          DEBUG(errs() << "\t\t\t\tCreating PHI Node\n");
-          phi = jumpBuilder.CreatePHI(inst.getType(), users.size(), "");
-          phi->moveBefore(jumpBlock->begin());
-        }
-        if (isUsed) {
-          if (phi->getBasicBlockIndex(block) == -1)
-            phi->addIncoming(&inst, block);
-          for (User *user : users) {
-            user->replaceUsesOfWith(&inst, phi);
-          }
-          DemotePHIToStack(phi);
-        }
-      }
-    }
   }
 
   entryBuilder.CreateBr(jumpBlock);
 
+  if (!flattenSSA) {
+    demoteValues(jumpBlock, jumpIndex, blocks);
+    // Blocks reached by a kept edge bypass jumpBlock, so values used across
+    // blocks are reloaded at each use instead of in jumpBlock
+    if (keepEdges)
+      sinkReloads(jumpBlock);
+  }
+
+  // Address dispatch needs no index so it cannot be split by groups.
+  // Carried values have to go through jumpBlock so it cannot be bypassed
+  if (flattenSSA) {
+    carryValues(jumpBlock, liveOut);
+    GlobalVariable *jumpTable = nullptr;
+    createDispatch(jumpBlock, jumpIndex, blocks, jumpTable);
+  } else if (flattenGroupSize && blocks.size() > flattenGroupSize &&
+             flattenDispatch != addressDispatch) {
+    DEBUG(errs() << "\tCreating hierarchical dispatcher\n");
+    createHierarchicalDispatch(jumpBlock, jumpIndex, blocks);
+  } else {
+    GlobalVariable *jumpTable = nullptr;
+    createDispatch(jumpBlock, jumpIndex, blocks, jumpTable);
+
+    // Copies of the other dispatchers branch on a constant, or a select of
+    // constants, and would be folded back into direct branches
+    if (flattenReplicate && flattenDispatch == tableDispatch) {
+      replicateDispatch(jumpBlock, jumpIndex, blocks, jumpTable);
+    }
+  }
+
 #if 0
   // Iterate through PHINodes of jumpBlock and assign NULL values or other
   // necessary incoming
@@ -405,6 +997,10 @@ bool Flatten::runOnFunction(Function &F) {
   return true;
 }
 
+bool Flatten::carriesSSA() { return flattenSSA; }
+
+ArrayRef<std::string> Flatten::getRequestedFunctions() { return flattenFunc; }
+
 bool Flatten::isEligible(Function &F) {
   DEBUG(errs() << "Flatten: Checking " << F.getName() << " eligibility:\n");
   if (F.isDeclaration()) {
@@ -460,6 +1056,16 @@ bool Flatten::isEligible(Function &F) {
   return true;
 }
 
+void Flatten::getAnalysisUsage(AnalysisUsage &AU) const {
+  if (ProfileHotness::hasProfile())
+    AU.addRequired<BlockFrequencyInfo>();
+  if (StaticHotness::isEnabled() && !ProfileHotness::hasProfile())
+    AU.addRequired<StaticHotness>();
+  AU.addPreserved<StaticHotness>();
+  AU.addRequired<LoopInfo>();
+  AU.addRequired<ScalarEvolution>();
+}
+
 char Flatten::ID = 0;
 static RegisterPass<Flatten> X("flatten", "Flatten function control flow",
                                false, false);
@@ -0,0 +1,351 @@
+//=== function_transfer.cpp - Move functions between modules -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// The module a function is extracted into has the function, declarations of
+// the globals recorded before transformation and definitions of the globals
+// created since with their linkage, such as the state of opaque predicates,
+// jump tables or copies of functions. Those are found through the operands
+// of the instructions and initializers, looking through constants and
+// metadata.
+//
+// Bodies of functions are copied before initializers, which may take the
+// address of their blocks.
+
+#define DEBUG_TYPE "function-transfer"
+#include "Transform/function_transfer.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <vector>
+
+namespace {
+// Add the globals used by V, looking through constants and metadata
+void collectGlobals(Value *V, SmallPtrSet<Value *, 32> &visited,
+                    std::vector<GlobalValue *> &globals) {
+  if (!V || !visited.insert(V))
+    return;
+  if (GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
+    globals.push_back(GV);
+  } else if (Constant *C = dyn_cast<Constant>(V)) {
+    for (unsigned i = 0, e = C->getNumOperands(); i < e; ++i) {
+      collectGlobals(C->getOperand(i), visited, globals);
+    }
+  } else if (MDNode *node = dyn_cast<MDNode>(V)) {
+    for (unsigned i = 0, e = node->getNumOperands(); i < e; ++i) {
+      collectGlobals(node->getOperand(i), visited, globals);
+    }
+  }
+}
+
+// Add the globals used by the body or initializer of GV
+void collectGlobals(GlobalValue &GV, SmallPtrSet<Value *, 32> &visited,
+                    std::vector<GlobalValue *> &globals) {
+  if (GlobalVariable *variable = dyn_cast<GlobalVariable>(&GV)) {
+    if (variable->hasInitializer())
+      collectGlobals(variable->getInitializer(), visited, globals);
+    return;
+  }
+
+  SmallVector<std::pair<unsigned, MDNode *>, 4> metadata;
+  for (auto &block : cast<Function>(GV)) {
+    for (auto &inst : block) {
+      for (auto op = inst.op_begin(), opEnd = inst.op_end(); op != opEnd;
+           ++op) {
+        collectGlobals(*op, visited, globals);
+      }
+      inst.getAllMetadata(metadata);
+      for (auto &node : metadata) {
+        collectGlobals(node.second, visited, globals);
+      }
+    }
+  }
+}
+
+// Declare a global of the type of from in M
+GlobalValue *declare(Module &M, GlobalValue &from, StringRef name,
+                     ValueMapTypeRemapper *types) {
+  Type *type = from.getType()->getElementType();
+  if (types)
+    type = types->remapType(type);
+
+  if (FunctionType *functionType = dyn_cast<FunctionType>(type)) {
+    Function *function =
+        Function::Create(functionType, GlobalValue::ExternalLinkage, name, &M);
+    if (Function *fromFunction = dyn_cast<Function>(&from))
+      function->setAttributes(fromFunction->getAttributes());
+    return function;
+  }
+
+  GlobalVariable *variable = dyn_cast<GlobalVariable>(&from);
+  return new GlobalVariable(
+      M, type, variable && variable->isConstant(),
+      GlobalValue::ExternalLinkage, nullptr, name, nullptr,
+      variable ? variable->getThreadLocalMode()
+               : GlobalVariable::NotThreadLocal,
+      from.getType()->getAddressSpace());
+}
+
+// Create a global in M to receive the body or initializer of from
+GlobalValue *define(Module &M, GlobalValue &from,
+                    ValueMapTypeRemapper *types) {
+  Type *type = from.getType()->getElementType();
+  if (types)
+    type = types->remapType(type);
+
+  GlobalValue *to;
+  if (isa<Function>(&from)) {
+    to = Function::Create(cast<FunctionType>(type),
+                          GlobalValue::ExternalLinkage, from.getName(), &M);
+  } else {
+    GlobalVariable &variable = cast<GlobalVariable>(from);
+    to = new GlobalVariable(M, type, variable.isConstant(),
+                            GlobalValue::ExternalLinkage, nullptr,
+                            from.getName(), nullptr,
+                            variable.getThreadLocalMode(),
+                            from.getType()->getAddressSpace());
+  }
+  to->copyAttributesFrom(&from);
+  to->setLinkage(from.getLinkage());
+  return to;
+}
+
+// Copy the bodies and initializers of the definitions to their mappings
+void cloneDefinitions(ArrayRef<GlobalValue *> definitions,
+                      ValueToValueMapTy &VMap, ValueMapTypeRemapper *types) {
+  for (GlobalValue *GV : definitions) {
+    Function *function = dyn_cast<Function>(GV);
+    if (!function)
+      continue;
+
+    Value *mapped = VMap[function];
+    Function *clone = cast<Function>(mapped);
+    Function::arg_iterator cloneArg = clone->arg_begin();
+    for (auto &arg : function->getArgumentList()) {
+      cloneArg->setName(arg.getName());
+      VMap[&arg] = &*cloneArg;
+      ++cloneArg;
+    }
+    SmallVector<ReturnInst *, 8> returns;
+    CloneFunctionInto(clone, function, VMap, true, returns, "", nullptr,
+                      types);
+  }
+
+  for (GlobalValue *GV : definitions) {
+    GlobalVariable *variable = dyn_cast<GlobalVariable>(GV);
+    if (!variable || !variable->hasInitializer())
+      continue;
+
+    Value *mapped = VMap[variable];
+    cast<GlobalVariable>(mapped)->setInitializer(cast<Constant>(
+        MapValue(variable->getInitializer(), VMap, RF_None, types)));
+  }
+}
+};
+
+namespace FunctionTransfer {
+void recordGlobals(Module &M, GlobalsByName &globals) {
+  for (auto &GV : M.getGlobalList()) {
+    if (GV.hasName())
+      globals[GV.getName()] = &GV;
+  }
+  for (auto &F : M) {
+    if (F.hasName())
+      globals[F.getName()] = &F;
+  }
+  for (auto &alias : M.getAliasList()) {
+    if (alias.hasName())
+      globals[alias.getName()] = &alias;
+  }
+}
+
+void getNames(const GlobalsByName &globals, NamesOfGlobals &names) {
+  for (auto &global : globals) {
+    if (GlobalValue *GV = dyn_cast_or_null<GlobalValue>((Value *)global.second))
+      names[GV] = global.first;
+  }
+}
+
+bool isTransferable(Function &F) {
+  if (!F.hasName())
+    return false;
+  for (auto &block : F) {
+    // Addresses of the blocks do not survive the body being replaced
+    if (block.hasAddressTaken())
+      return false;
+    for (auto &inst : block) {
+      if (isa<DbgInfoIntrinsic>(&inst) || !inst.getDebugLoc().isUnknown())
+        return false;
+      for (auto op = inst.op_begin(), opEnd = inst.op_end(); op != opEnd;
+           ++op) {
+        GlobalValue *GV = dyn_cast<GlobalValue>(*op);
+        if (GV && !GV->hasName())
+          return false;
+      }
+    }
+  }
+  return true;
+}
+
+Type *TypeMapper::remapType(Type *type) {
+  DenseMap<Type *, Type *>::iterator it = mapped.find(type);
+  if (it != mapped.end())
+    return it->second;
+
+  Type *result = type;
+  if (StructType *structType = dyn_cast<StructType>(type)) {
+    if (structType->isLiteral()) {
+      std::vector<Type *> elements;
+      for (unsigned i = 0, e = structType->getNumElements(); i < e; ++i) {
+        elements.push_back(remapType(structType->getElementType(i)));
+      }
+      result = StructType::get(M.getContext(), elements,
+                               structType->isPacked());
+    } else if (structType->hasName()) {
+      result = findStruct(structType);
+    }
+  } else if (PointerType *pointer = dyn_cast<PointerType>(type)) {
+    result = PointerType::get(remapType(pointer->getElementType()),
+                              pointer->getAddressSpace());
+  } else if (ArrayType *array = dyn_cast<ArrayType>(type)) {
+    result = ArrayType::get(remapType(array->getElementType()),
+                            array->getNumElements());
+  } else if (VectorType *vector = dyn_cast<VectorType>(type)) {
+    result = VectorType::get(remapType(vector->getElementType()),
+                             vector->getNumElements());
+  } else if (FunctionType *function = dyn_cast<FunctionType>(type)) {
+    std::vector<Type *> params;
+    for (unsigned i = 0, e = function->getNumParams(); i < e; ++i) {
+      params.push_back(remapType(function->getParamType(i)));
+    }
+    result = FunctionType::get(remapType(function->getReturnType()), params,
+                               function->isVarArg());
+  }
+  mapped[type] = result;
+  return result;
+}
+
+Type *TypeMapper::findStruct(StructType *type) {
+  StringRef name = type->getName();
+  if (M.getTypeByName(name) == type)
+    return type;
+  StructType *original = M.getTypeByName(name.rsplit('.').first);
+  if (!original || !hasSameBody(type, original))
+    return type;
+  return original;
+}
+
+bool TypeMapper::hasSameBody(StructType *type, StructType *original) {
+  if (type->isOpaque() || original->isOpaque())
+    return type->isOpaque() == original->isOpaque();
+  if (type->isPacked() != original->isPacked() ||
+      type->getNumElements() != original->getNumElements())
+    return false;
+
+  // Recursive types refer to themselves
+  mapped[type] = original;
+  for (unsigned i = 0, e = type->getNumElements(); i < e; ++i) {
+    if (remapType(type->getElementType(i)) != original->getElementType(i)) {
+      mapped.erase(type);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool extract(Function &F, StringRef name, const NamesOfGlobals &originals,
+             Module &into) {
+  ValueToValueMapTy VMap;
+  std::vector<GlobalValue *> definitions;
+  std::vector<GlobalValue *> worklist;
+  SmallPtrSet<Value *, 32> visited;
+
+  Function *function = Function::Create(
+      F.getFunctionType(), GlobalValue::ExternalLinkage, name, &into);
+  function->copyAttributesFrom(&F);
+  VMap[&F] = function;
+  definitions.push_back(&F);
+  collectGlobals(F, visited, worklist);
+
+  while (!worklist.empty()) {
+    GlobalValue *GV = worklist.back();
+    worklist.pop_back();
+    if (VMap.count(GV))
+      continue;
+
+    NamesOfGlobals::const_iterator original = originals.find(GV);
+    if (original != originals.end() || GV->isDeclaration()) {
+      StringRef declName =
+          original != originals.end() ? original->second : GV->getName();
+      if (declName.empty() || into.getNamedValue(declName))
+        return false;
+      VMap[GV] = declare(into, *GV, declName, nullptr);
+      continue;
+    }
+
+    if (isa<GlobalAlias>(GV))
+      return false;
+    VMap[GV] = define(into, *GV, nullptr);
+    definitions.push_back(GV);
+    collectGlobals(*GV, visited, worklist);
+  }
+
+  cloneDefinitions(definitions, VMap, nullptr);
+  return true;
+}
+
+void splice(Function &F, StringRef name, Module &from,
+            const GlobalsByName &originals, TypeMapper &types) {
+  DEBUG(errs() << "FunctionTransfer: Splicing in " << name << "\n");
+  Module &M = *F.getParent();
+  ValueToValueMapTy VMap;
+  std::vector<GlobalValue *> definitions;
+
+  auto resolve = [&](GlobalValue &GV) -> Value * {
+    Value *resolved = nullptr;
+    GlobalsByName::const_iterator original = originals.find(GV.getName());
+    if (original != originals.end())
+      resolved = original->second;
+    if (!resolved)
+      resolved = M.getNamedValue(GV.getName());
+    if (!resolved)
+      return declare(M, GV, GV.getName(), &types);
+
+    Type *type = types.remapType(GV.getType());
+    if (resolved->getType() != type)
+      return ConstantExpr::getBitCast(cast<Constant>(resolved), type);
+    return resolved;
+  };
+
+  auto mapGlobal = [&](GlobalValue &GV) {
+    if (isa<Function>(&GV) && GV.getName() == name) {
+      VMap[&GV] = &F;
+      definitions.push_back(&GV);
+    } else if (GV.isDeclaration()) {
+      VMap[&GV] = resolve(GV);
+    } else {
+      VMap[&GV] = define(M, GV, &types);
+      definitions.push_back(&GV);
+    }
+  };
+
+  for (auto &GV : from.getGlobalList()) {
+    mapGlobal(GV);
+  }
+  for (auto &function : from) {
+    mapGlobal(function);
+  }
+
+  cloneDefinitions(definitions, VMap, &types);
+}
+};
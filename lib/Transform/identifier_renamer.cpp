@@ -8,6 +8,7 @@
 //===----------------------------------------------------------------------===//
 #define DEBUG_TYPE "renamer"
 #include "Transform/identifier_renamer.h"
+#include "Transform/pass_trace.h"
 #include "llvm/IR/GlobalValue.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
@@ -25,6 +26,7 @@ static cl::opt<bool> disableRenamer(
 bool IdentifierRenamer::runOnModule(Module &M) {
   if (disableRenamer)
     return false;
+  PassTrace::ModuleScope trace(this, M);
 
   // Rename globals if possible
   for (auto G = M.global_begin(), GEnd = M.global_end(); G != GEnd; ++G) {
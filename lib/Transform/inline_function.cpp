@@ -9,6 +9,8 @@
 #define DEBUG_TYPE "inline_function"
 #include "Transform/inline_function.h"
 #include "Transform/obf_utilities.h"
+#include "Transform/pass_trace.h"
+#include "Transform/random_service.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Value.h"
@@ -23,7 +25,6 @@
 #include "llvm/Transforms/Utils/Cloning.h"
 #include <algorithm>
 #include <vector>
-#include <chrono>
 
 static cl::opt<double> inlineProbability(
     "inlineProbability", cl::init(0.2),
@@ -31,7 +32,7 @@ static cl::opt<double> inlineProbability(
 
 static cl::opt<std::string> inlineSeed(
     "inlineSeed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to obfSeed"));
 
 static cl::opt<unsigned> inlinePass(
     "inlinePass", cl::init(2),
@@ -44,19 +45,12 @@ static cl::opt<bool>
 
 bool InlineFunctionPass::doInitialization(Module &M) {
   if (inlineProbability < 0.f || inlineProbability > 1.f) {
-    LLVMContext &ctx = getGlobalContext();
-    ctx.emitError("InlineFunctionPass: Probability must be between 0 and 1");
-  }
-
-  // Seed engine and create distribution
-  if (!inlineSeed.empty()) {
-    std::seed_seq seed(inlineSeed.begin(), inlineSeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
+    M.getContext().emitError(
+        "InlineFunctionPass: Probability must be between 0 and 1");
+    return false;
   }
 
+  // Create distribution, the engine is seeded for each function
   trial.param(
       std::bernoulli_distribution::param_type((double)inlineProbability));
 
@@ -66,6 +60,7 @@ bool InlineFunctionPass::doInitialization(Module &M) {
 bool InlineFunctionPass::runOnFunction(Function &F) {
   if (disableInline)
     return false;
+  PassTrace::FunctionScope trace(this, F);
   // If the function is declared elsewhere in other translation unit
   // we should not modify it here
   if (F.isDeclaration()) {
@@ -77,6 +72,7 @@ bool InlineFunctionPass::runOnFunction(Function &F) {
 
   bool hasBeenModified = false;
   DEBUG(errs() << "InlineFunctionPass: Function '" << F.getName() << "'\n");
+  RandomService::seed(engine, "inline-function", inlineSeed, F);
 
   for (unsigned i = 0; i < inlinePass; ++i) {
     DEBUG(errs() << "\tPass " << i << ":\n");
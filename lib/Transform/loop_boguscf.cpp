@@ -6,35 +6,107 @@
 // License. See LICENSE.TXT for details.
 //
 //===----------------------------------------------------------------------===//
+// Inserts an always true opaque predicate whose false edge leaves the loop.
+//
+// Command line options
+// - loopBcfMode - Where the predicate is evaluated. Default header
+//   - header: In the loop header, on every iteration
+//   - preheader: In the preheader, once per loop entry. The loop body is left
+//                untouched so it can still be vectorized or hoisted from
+//   - strided: In the loop, but only every loopBcfStride iterations, using a
+//              counter kept in a register
+// - loopBcfStride - Iterations between predicates in strided mode. Must be a
+//                   power of 2. Default 16
+//
+// When a profile is given with -obfProfile, loops whose header is above the
+// hot threshold are transformed with a probability scaled by -obfHotScale
 #define DEBUG_TYPE "loop_boguscf"
 #include "Transform/loop_boguscf.h"
 #include "Transform/opaque_predicate.h"
+#include "Transform/pass_trace.h"
+#include "Transform/profile_hotness.h"
+#include "Transform/random_service.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CFG.h"
+#include <random>
 
 STATISTIC(NumLoops, "Number of loops inspected");
 STATISTIC(NumLoopsObf, "Number of loops obfuscated");
+STATISTIC(NumLoopsHot, "Number of hot loops according to profile");
 
 static cl::opt<bool> disableLoopBcf(
     "disableLoopBcf", cl::init(false),
     cl::desc(
         "Disable Loop BCF pass regardless. Useful when used in -OX mode."));
 
+enum LoopBcfMode {
+  headerMode,
+  preheaderMode,
+  stridedMode
+};
+
+static cl::opt<LoopBcfMode> loopBcfMode(
+    "loopBcfMode", cl::init(headerMode),
+    cl::desc("Where the loop opaque predicate is evaluated"),
+    cl::values(clEnumValN(headerMode, "header", "Every iteration"),
+               clEnumValN(preheaderMode, "preheader", "Once per loop entry"),
+               clEnumValN(stridedMode, "strided",
+                          "Every loopBcfStride iterations"),
+               clEnumValEnd));
+
+static cl::opt<unsigned> loopBcfStride(
+    "loopBcfStride", cl::init(16),
+    cl::desc("Iterations between opaque predicates in strided mode"));
+
+static cl::opt<std::string> loopBcfSeed(
+    "loopBcfSeed", cl::init(""),
+    cl::desc("Seed for random number generator. Defaults to obfSeed"));
+
+LoopBogusCF::LoopBogusCF()
+    : LoopPass(ID), seededFunction(nullptr), checkedOptions(false),
+      validOptions(false) {}
+
 bool LoopBogusCF::runOnLoop(Loop *loop, LPPassManager &LPM) {
   if (disableLoopBcf)
     return false;
+  PassTrace::FunctionScope trace(this, *loop->getHeader()->getParent());
 
   ++NumLoops;
   DEBUG(errs() << "LoopBogusCF: Dumping loop info\n");
   // DEBUG(loop->dump());
 
   BasicBlock *header = loop->getHeader();
+  if (!checkedOptions) {
+    checkedOptions = true;
+    LLVMContext &ctx = header->getContext();
+    validOptions = ProfileHotness::checkProfile(ctx);
+    if (validOptions && loopBcfMode == stridedMode &&
+        !isPowerOf2_32(loopBcfStride)) {
+      ctx.emitError("LoopBogusCF: Stride must be a power of 2");
+      validOptions = false;
+    }
+  }
+  if (!validOptions)
+    return false;
+
+  // Loops of a function are visited in the same order whatever the order of
+  // functions, so one stream per function is enough
+  Function *F = header->getParent();
+  if (F != seededFunction) {
+    RandomService::seed(engine, "loop-boguscf", loopBcfSeed, *F);
+    seededFunction = F;
+  }
 
   BranchInst *branch = dyn_cast<BranchInst>(header->getTerminator());
   if (!branch || !branch->isConditional()) {
@@ -59,11 +131,34 @@ bool LoopBogusCF::runOnLoop(Loop *loop, LPPassManager &LPM) {
     return false;
   }
 
+  if (ProfileHotness::hasProfile()) {
+    BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfo>();
+    uint64_t count = ProfileHotness::getBlockCount(*header, BFI);
+    if (ProfileHotness::isHot(count)) {
+      DEBUG(errs() << "\t Hot loop: " << count << "\n");
+      ++NumLoopsHot;
+      std::bernoulli_distribution hotTrial(
+          ProfileHotness::scaleProbability(1.0, count));
+      if (!hotTrial(engine)) {
+        DEBUG(errs() << "\t Hot loop -- skipping\n");
+        return false;
+      }
+    }
+  }
+
   ++NumLoopsObf;
   // DEBUG(header->getParent()->viewCFG());
 
-  DEBUG(errs() << "\tCreating dummy block\n");
   LoopInfo &info = getAnalysis<LoopInfo>();
+  if (loopBcfMode == preheaderMode) {
+    insertInPreheader(loop, exitBlock, info);
+    return true;
+  } else if (loopBcfMode == stridedMode) {
+    insertStrided(loop, branch, exitBlock, info);
+    return true;
+  }
+
+  DEBUG(errs() << "\tCreating dummy block\n");
   // Split header block
   BasicBlock *dummy = header->splitBasicBlock(header->getTerminator());
   loop->addBasicBlockToLoop(dummy, info.getBase());
@@ -84,13 +179,166 @@ bool LoopBogusCF::runOnLoop(Loop *loop, LPPassManager &LPM) {
   OpaquePredicate::createStub(dummy, trueBlock, falseBlock,
                               OpaquePredicate::PredicateTrue, false);
 
+  // Splitting the header moved the exit edge of the PHIs in exitBlock to
+  // dummy, but exitBlock is still reached from the header as well
+  for (auto &inst : *exitBlock) {
+    PHINode *phi = dyn_cast<PHINode>(&inst);
+    if (!phi)
+      break;
+    int index = phi->getBasicBlockIndex(dummy);
+    if (index == -1)
+      continue;
+    phi->addIncoming(phi->getIncomingValue(index), header);
+  }
+
   // DEBUG(header->getParent()->viewCFG());
 
   return true;
 }
 
+void LoopBogusCF::insertInPreheader(Loop *loop, BasicBlock *exitBlock,
+                                    LoopInfo &info) {
+  DEBUG(errs() << "\tInserting predicate in preheader\n");
+  BasicBlock *preheader = loop->getLoopPreheader();
+  assert(preheader && "Simplified loop should have a preheader");
+
+  // Split so that the loop keeps a dedicated preheader
+  BasicBlock *newPreheader =
+      preheader->splitBasicBlock(preheader->getTerminator());
+  if (Loop *parent = loop->getParentLoop()) {
+    parent->addBasicBlockToLoop(newPreheader, info.getBase());
+  }
+
+  // Values of the loop used after it no longer dominate their uses once the
+  // preheader branches to exitBlock, so they are passed through PHI nodes
+  // in exitBlock, as in LCSSA form
+  formExitPHIs(loop, exitBlock);
+
+  OpaquePredicate::createStub(preheader, newPreheader, exitBlock,
+                              OpaquePredicate::PredicateTrue, false);
+
+  // Nothing computed in the loop is available on the new edge, but the edge
+  // is never taken either
+  for (auto &inst : *exitBlock) {
+    PHINode *phi = dyn_cast<PHINode>(&inst);
+    if (!phi)
+      break;
+    phi->addIncoming(UndefValue::get(phi->getType()), preheader);
+  }
+}
+
+void LoopBogusCF::formExitPHIs(Loop *loop, BasicBlock *exitBlock) {
+  // All predecessors of the dedicated exit block are in the loop
+  SmallVector<BasicBlock *, 4> exiting(pred_begin(exitBlock),
+                                       pred_end(exitBlock));
+  for (Loop::block_iterator block = loop->block_begin(),
+                            blockEnd = loop->block_end();
+       block != blockEnd; ++block) {
+    for (auto &inst : **block) {
+      PHINode *exitPHI = nullptr;
+      for (Value::use_iterator use = inst.use_begin(), useEnd = inst.use_end();
+           use != useEnd;) {
+        Use &operand = use.getUse();
+        ++use;
+        Instruction *user = cast<Instruction>(operand.getUser());
+        BasicBlock *userBlock = user->getParent();
+        if (PHINode *phi = dyn_cast<PHINode>(user))
+          userBlock = phi->getIncomingBlock(operand);
+        if (loop->contains(userBlock))
+          continue;
+
+        // The loop has a single exit block, so it dominates every use of a
+        // loop value outside the loop
+        if (!exitPHI) {
+          exitPHI = PHINode::Create(inst.getType(), exiting.size(), "",
+                                    exitBlock->begin());
+          for (BasicBlock *pred : exiting) {
+            exitPHI->addIncoming(&inst, pred);
+          }
+        }
+        operand.set(exitPHI);
+      }
+    }
+  }
+}
+
+void LoopBogusCF::insertStrided(Loop *loop, BranchInst *branch,
+                                BasicBlock *exitBlock, LoopInfo &info) {
+  DEBUG(errs() << "\tInserting predicate every " << loopBcfStride
+               << " iterations\n");
+  BasicBlock *header = loop->getHeader();
+  BasicBlock *preheader = loop->getLoopPreheader();
+  BasicBlock *latch = loop->getLoopLatch();
+  assert(preheader && latch && "Simplified loop should have a preheader and "
+                               "a single latch");
+
+  unsigned successor = branch->getSuccessor(0) == exitBlock ? 1 : 0;
+  BasicBlock *trueBlock = branch->getSuccessor(successor);
+  if (trueBlock == header) {
+    // The back edge would have to be split -- not worth it for a single block
+    DEBUG(errs() << "\tSingle block loop -- using preheader\n");
+    insertInPreheader(loop, exitBlock, info);
+    return;
+  }
+
+  LLVMContext &context = header->getContext();
+  Type *intType = Type::getInt32Ty(context);
+
+  // Iteration counter
+  PHINode *counter = PHINode::Create(intType, 2, "", header->begin());
+  BinaryOperator *next = BinaryOperator::Create(
+      Instruction::Add, counter, ConstantInt::get(intType, 1), "",
+      header->getFirstNonPHI());
+  counter->addIncoming(ConstantInt::get(intType, 0), preheader);
+  counter->addIncoming(next, latch);
+
+  // Check if this iteration should evaluate the predicate
+  BasicBlock *strideBlock =
+      BasicBlock::Create(context, "", header->getParent(), trueBlock);
+  BasicBlock *predicateBlock =
+      BasicBlock::Create(context, "", header->getParent(), trueBlock);
+  loop->addBasicBlockToLoop(strideBlock, info.getBase());
+  loop->addBasicBlockToLoop(predicateBlock, info.getBase());
+  branch->setSuccessor(successor, strideBlock);
+
+  BinaryOperator *masked =
+      BinaryOperator::Create(Instruction::And, counter,
+                             ConstantInt::get(intType, loopBcfStride - 1), "",
+                             strideBlock);
+  ICmpInst *isStride = new ICmpInst(*strideBlock, CmpInst::ICMP_EQ, masked,
+                                    ConstantInt::get(intType, 0));
+  BranchInst::Create(predicateBlock, trueBlock, isStride, strideBlock);
+
+  OpaquePredicate::createStub(predicateBlock, trueBlock, exitBlock,
+                              OpaquePredicate::PredicateTrue, false);
+
+  // trueBlock is now reached from strideBlock or predicateBlock, and
+  // exitBlock additionally from predicateBlock
+  for (auto &inst : *trueBlock) {
+    PHINode *phi = dyn_cast<PHINode>(&inst);
+    if (!phi)
+      break;
+    int index = phi->getBasicBlockIndex(header);
+    if (index == -1)
+      continue;
+    phi->setIncomingBlock(index, strideBlock);
+    phi->addIncoming(phi->getIncomingValue(index), predicateBlock);
+  }
+  for (auto &inst : *exitBlock) {
+    PHINode *phi = dyn_cast<PHINode>(&inst);
+    if (!phi)
+      break;
+    int index = phi->getBasicBlockIndex(header);
+    if (index == -1)
+      continue;
+    phi->addIncoming(phi->getIncomingValue(index), predicateBlock);
+  }
+}
+
 void LoopBogusCF::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.addRequired<LoopInfo>();
+  if (ProfileHotness::hasProfile())
+    AU.addRequired<BlockFrequencyInfo>();
 }
 
 char LoopBogusCF::ID = 0;
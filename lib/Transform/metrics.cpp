@@ -7,6 +7,7 @@
 //===----------------------------------------------------------------------===//
 #define DEBUG_TYPE "metrics"
 #include "Transform/metrics.h"
+#include "Transform/pass_trace.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
@@ -37,6 +38,7 @@ static cl::opt<std::string> metricsFormat(
     cl::desc("String format for results. If none, will be verbose output"));
 
 bool Metrics::runOnModule(Module &M) {
+  PassTrace::ModuleScope trace(this, M);
   unsigned long programLength = 0;
   unsigned long cyclomatic = 0;
   unsigned long nesting = 0;
@@ -90,8 +92,8 @@ bool Metrics::runOnModule(Module &M) {
         metricsOutputAppend ? sys::fs::F_Append : sys::fs::F_None);
 
     if (!errorInfo.empty()) {
-      LLVMContext &ctx = getGlobalContext();
-      ctx.emitError("Metrics: Unable to write to output file");
+      M.getContext().emitError("Metrics: Unable to write to output file");
+      return false;
     }
 
     output << format(metricsFormat.c_str(), programLength, cyclomatic, nesting);
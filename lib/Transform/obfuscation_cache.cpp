@@ -0,0 +1,444 @@
+//=== obfuscation_cache.cpp - Cache of obfuscated functions ---------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Every entry of the cache is a bitcode module holding one obfuscated
+// function, named <key>.bc after the MD5 of
+// - the IR of the function before obfuscation, printed from a module of its
+//   own so that attribute groups and metadata are numbered the same whatever
+//   else the module holds
+// - its estimated frequency, which scales the probabilities of the passes,
+//   when StaticHotness is used
+// - the bodies of the named struct types, the triple and the data layout
+// - the passes scheduled, and the options given on the command line with
+//   their values, as well as the contents of the profile given with
+//   -obfProfile
+// - the master seed. The random streams of the passes only depend on it and
+//   the function (see random_service.cpp)
+// linkonce_odr and other COMDAT functions have the same key in every
+// translation unit that instantiates them, and so are obfuscated once.
+//
+// Globals that existed before obfuscation are declarations in the entry and
+// are resolved by name when the entry is spliced in. Globals created by the
+// passes, like the state of the opaque predicates or the copies of functions,
+// are defined in the entry and get internal copies when spliced in.
+//
+// Functions with debug information, with blocks whose address is taken or
+// using unnamed globals are not cached. Functions are looked up once Copy and
+// InlineFunction have run (see schedule.cpp), as those look into other
+// functions. A cached function is then a declaration while the other passes
+// run, so that it is not obfuscated. The cache requires -obfSeed, otherwise
+// every key would be different.
+//
+// Options are read from /proc/self/cmdline, given either as -name=value or
+// as -name value. Where that is not available only the pipeline and the seed
+// tell the configurations apart.
+//
+// Command line options
+// - obfCache - Directory of the cache. Defaults to none, i.e. no caching
+
+#define DEBUG_TYPE "obfuscation-cache"
+#include "Transform/obfuscation_cache.h"
+#include "Transform/function_transfer.h"
+#include "Transform/pass_trace.h"
+#include "Transform/profile_hotness.h"
+#include "Transform/random_service.h"
+#include "Transform/static_hotness.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/TypeFinder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ValueHandle.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/system_error.h"
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static cl::opt<std::string> obfCache(
+    "obfCache", cl::init(""),
+    cl::desc("Directory of the cache of obfuscated functions. Defaults to "
+             "none"));
+
+STATISTIC(NumHits, "Functions spliced in from the cache");
+STATISTIC(NumStored, "Functions stored in the cache");
+STATISTIC(NumUncacheable, "Functions that cannot be cached");
+
+namespace {
+// Bumped whenever the layout of the entries changes
+const char *const cacheVersion = "obfuscation-cache-2";
+
+// A function that is looked up before obfuscation
+struct Entry {
+  WeakVH function;
+  std::string name;
+  GlobalValue::LinkageTypes linkage;
+  std::string path;
+  // Entry read from the cache, null if the function was not found
+  std::unique_ptr<Module> cached;
+};
+
+// Shared between lookup and store, which run on the same module
+struct CacheState {
+  // Globals of the module before obfuscation, by their names at the time
+  FunctionTransfer::GlobalsByName originals;
+  std::vector<Entry> misses;
+  std::vector<Entry> hits;
+
+  void clear() {
+    originals.clear();
+    misses.clear();
+    hits.clear();
+  }
+};
+
+// One state per module, as llvm-obfuscate transforms several at once
+struct CacheStates {
+  std::mutex mutex;
+  std::map<const Module *, CacheState> states;
+
+  CacheState &get(const Module &M) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return states[&M];
+  }
+
+  void remove(const Module &M) {
+    std::lock_guard<std::mutex> lock(mutex);
+    states.erase(&M);
+  }
+};
+
+CacheStates &getStates() {
+  static CacheStates states;
+  return states;
+}
+
+// Options that do not change the obfuscation. j, S and serve are those of
+// llvm-obfuscate
+bool isIgnoredOption(StringRef name) {
+  return name == "o" || name == "obfCache" || name == "stats" ||
+         name == "time-passes" || name == "debug" || name == "debug-only" ||
+         name == "info-output-file" || name == "j" || name == "S" ||
+         name == "serve";
+}
+
+// The same options with another profile obfuscate differently
+std::string hashProfile(StringRef path) {
+  OwningPtr<MemoryBuffer> buffer;
+  if (MemoryBuffer::getFile(path, buffer))
+    return "unreadable";
+  MD5 hash;
+  hash.update(buffer->getBuffer());
+  MD5::MD5Result result;
+  hash.final(result);
+  SmallString<32> digest;
+  MD5::stringifyResult(result, digest);
+  return digest.str();
+}
+
+std::string readOptions() {
+  std::string options;
+  StringMap<cl::Option *> registered;
+  cl::getRegisteredOptions(registered);
+
+  std::ifstream file("/proc/self/cmdline", std::ios::binary);
+  std::string arg;
+  // Name of the option the next argument is the value of, if any
+  std::string pending;
+  while (std::getline(file, arg, '\0')) {
+    StringRef ref(arg);
+    if (!pending.empty()) {
+      // clang passes -mllvm -name -mllvm value
+      if (ref == "-mllvm")
+        continue;
+      if (!isIgnoredOption(pending)) {
+        options += arg;
+        options += '\0';
+        if (pending == "obfProfile")
+          options += hashProfile(ref) + '\0';
+      }
+      pending.clear();
+      continue;
+    }
+
+    if (!ref.startswith("-"))
+      continue;
+    std::pair<StringRef, StringRef> nameValue = ref.ltrim('-').split('=');
+    StringRef name = nameValue.first;
+    StringMap<cl::Option *>::iterator option = registered.find(name);
+    if (option == registered.end())
+      continue;
+    // -name value
+    if (ref.find('=') == StringRef::npos &&
+        option->second->getValueExpectedFlag() == cl::ValueRequired)
+      pending = name.str();
+    if (isIgnoredOption(name))
+      continue;
+    options += arg;
+    options += '\0';
+    if (name == "obfProfile" && pending.empty())
+      options += hashProfile(nameValue.second) + '\0';
+  }
+  DEBUG(errs() << "ObfuscationCache: Options '" << options << "'\n");
+  return options;
+}
+
+// Options of this process, in the order in which they were given. Read once
+// even when several modules are obfuscated at the same time
+const std::string &getOptions() {
+  static const std::string options = readOptions();
+  return options;
+}
+
+// Everything but the function itself that goes into the key
+std::string getModuleKey(Module &M, StringRef pipeline) {
+  std::string key;
+  raw_string_ostream stream(key);
+  stream << cacheVersion << '\0' << pipeline << '\0' << getOptions() << '\0'
+         << RandomService::getMasterSeed() << '\0' << M.getTargetTriple()
+         << '\0' << M.getDataLayout() << '\0';
+
+  TypeFinder types;
+  types.run(M, true);
+  for (StructType *type : types) {
+    if (!type->hasName())
+      continue;
+    stream << type->getName() << (type->isPacked() ? " = <{" : " = {");
+    if (type->isOpaque())
+      stream << "opaque";
+    for (unsigned i = 0, e = type->getNumElements(); i < e; ++i) {
+      stream << ' ' << *type->getElementType(i);
+    }
+    stream << "}\n";
+  }
+  return stream.str();
+}
+
+// Empty if F cannot be printed on its own
+std::string getKey(Function &F, StringRef moduleKey,
+                   const FunctionTransfer::NamesOfGlobals &globals,
+                   StaticHotness *hotness) {
+  // Printed in the module it was extracted to, attribute groups and metadata
+  // are numbered from the function alone
+  Module alone(cacheVersion, F.getContext());
+  if (!FunctionTransfer::extract(F, F.getName(), globals, alone))
+    return "";
+  std::string ir;
+  raw_string_ostream stream(ir);
+  alone.print(stream, nullptr);
+  if (hotness)
+    stream << "frequency " << hotness->getFunctionFrequency(F) << '\n';
+
+  MD5 hash;
+  hash.update(moduleKey);
+  hash.update(stream.str());
+  MD5::MD5Result result;
+  hash.final(result);
+  SmallString<32> key;
+  MD5::stringifyResult(result, key);
+  return key.str();
+}
+
+void writeEntry(Module &cached, StringRef path) {
+  int fd;
+  SmallString<128> temporary;
+  if (sys::fs::createUniqueFile(path + ".%%%%%%", fd, temporary)) {
+    DEBUG(errs() << "ObfuscationCache: Unable to create " << path << "\n");
+    return;
+  }
+  {
+    raw_fd_ostream stream(fd, true);
+    WriteBitcodeToFile(&cached, stream);
+  }
+
+  // Other processes only ever see complete entries
+  if (sys::fs::rename(temporary.str(), path)) {
+    bool existed;
+    sys::fs::remove(temporary.str(), existed);
+  }
+}
+
+Module *readEntry(StringRef path, LLVMContext &context) {
+  OwningPtr<MemoryBuffer> buffer;
+  if (MemoryBuffer::getFile(path, buffer))
+    return nullptr;
+  std::string error;
+  Module *cached = ParseBitcodeFile(buffer.get(), context, &error);
+  if (!cached)
+    DEBUG(errs() << "ObfuscationCache: Ignoring " << path << ": " << error
+                 << "\n");
+  return cached;
+}
+
+// Replace the declaration left by lookup with the cached body
+bool splice(Entry &hit, CacheState &state,
+            FunctionTransfer::TypeMapper &types) {
+  Function *F = dyn_cast_or_null<Function>((Value *)hit.function);
+  if (!F || !F->isDeclaration())
+    return false;
+  FunctionTransfer::splice(*F, hit.name, *hit.cached, state.originals, types);
+  F->setLinkage(hit.linkage);
+  return true;
+}
+};
+
+namespace ObfuscationCache {
+bool isEnabled() { return !obfCache.empty(); }
+};
+
+bool ObfuscationCacheLookup::runOnModule(Module &M) {
+  if (!ObfuscationCache::isEnabled())
+    return false;
+  PassTrace::ModuleScope trace(this, M);
+
+  if (!RandomService::hasMasterSeed()) {
+    errs() << "WARNING: ObfuscationCache: No -obfSeed given, functions are "
+              "not cached\n";
+    return false;
+  }
+
+  // Left over if store did not run on a module at the same address
+  CacheState &state = getStates().get(M);
+  state.clear();
+
+  bool existed;
+  if (sys::fs::create_directories(Twine(obfCache), existed)) {
+    M.getContext().emitError("ObfuscationCache: Unable to create " +
+                             obfCache);
+    return false;
+  }
+
+  FunctionTransfer::recordGlobals(M, state.originals);
+  FunctionTransfer::NamesOfGlobals globals;
+  FunctionTransfer::getNames(state.originals, globals);
+
+  // The frequency of a function depends on its callers
+  StaticHotness *hotness = nullptr;
+  if (StaticHotness::isEnabled() && !ProfileHotness::hasProfile())
+    hotness = &getAnalysis<StaticHotness>();
+
+  std::string moduleKey = getModuleKey(M, pipeline);
+  FunctionTransfer::TypeMapper types(M);
+  for (auto &F : M) {
+    if (F.isDeclaration())
+      continue;
+    std::string key;
+    if (FunctionTransfer::isTransferable(F))
+      key = getKey(F, moduleKey, globals, hotness);
+    if (key.empty()) {
+      DEBUG(errs() << "ObfuscationCache: Cannot cache " << F.getName()
+                   << "\n");
+      ++NumUncacheable;
+      continue;
+    }
+
+    Entry entry;
+    entry.function = &F;
+    entry.name = F.getName();
+    entry.linkage = F.getLinkage();
+    SmallString<128> path(obfCache);
+    sys::path::append(path, key + ".bc");
+    entry.path = path.str();
+    entry.cached.reset(readEntry(entry.path, M.getContext()));
+
+    Function *cachedFunction =
+        entry.cached ? entry.cached->getFunction(entry.name) : nullptr;
+    if (cachedFunction && !cachedFunction->isDeclaration() &&
+        types.remapType(cachedFunction->getFunctionType()) ==
+            F.getFunctionType()) {
+      state.hits.push_back(std::move(entry));
+    } else {
+      entry.cached.reset();
+      state.misses.push_back(std::move(entry));
+    }
+  }
+
+  // Bodies are only removed once all keys are taken, as extracting a function
+  // declares what it calls
+  for (auto &hit : state.hits) {
+    cast<Function>((Value *)hit.function)->deleteBody();
+  }
+  DEBUG(errs() << "ObfuscationCache: " << state.hits.size() << " hits, "
+               << state.misses.size() << " misses\n");
+  return !state.hits.empty();
+}
+
+void ObfuscationCacheLookup::getAnalysisUsage(AnalysisUsage &AU) const {
+  // The frequencies taken into the keys are those the passes see, and not
+  // those of the module without the bodies of the cached functions
+  if (StaticHotness::isEnabled() && !ProfileHotness::hasProfile())
+    AU.addRequired<StaticHotness>();
+  AU.addPreserved<StaticHotness>();
+}
+
+bool ObfuscationCacheStore::runOnModule(Module &M) {
+  if (!ObfuscationCache::isEnabled() || !RandomService::hasMasterSeed())
+    return false;
+  PassTrace::ModuleScope trace(this, M);
+  CacheState &state = getStates().get(M);
+
+  FunctionTransfer::NamesOfGlobals originals;
+  FunctionTransfer::getNames(state.originals, originals);
+
+  for (auto &miss : state.misses) {
+    Function *F = dyn_cast_or_null<Function>((Value *)miss.function);
+    if (!F || F->isDeclaration())
+      continue;
+
+    Module cached(cacheVersion, M.getContext());
+    cached.setTargetTriple(M.getTargetTriple());
+    cached.setDataLayout(M.getDataLayout());
+    if (!FunctionTransfer::extract(*F, miss.name, originals, cached)) {
+      DEBUG(errs() << "ObfuscationCache: Cannot cache " << miss.name << "\n");
+      ++NumUncacheable;
+      continue;
+    }
+    writeEntry(cached, miss.path);
+    ++NumStored;
+  }
+
+  bool hasBeenModified = false;
+  FunctionTransfer::TypeMapper types(M);
+  for (auto &hit : state.hits) {
+    if (splice(hit, state, types)) {
+      hasBeenModified = true;
+      ++NumHits;
+    }
+    hit.cached.reset();
+  }
+
+  getStates().remove(M);
+  return hasBeenModified;
+}
+
+char ObfuscationCacheLookup::ID = 0;
+static RegisterPass<ObfuscationCacheLookup>
+    X("obfuscation-cache-lookup",
+      "Replace functions found in the obfuscation cache with declarations",
+      false, false);
+
+char ObfuscationCacheStore::ID = 0;
+static RegisterPass<ObfuscationCacheStore>
+    Y("obfuscation-cache-store",
+      "Store obfuscated functions in the cache and splice in cached ones",
+      false, false);
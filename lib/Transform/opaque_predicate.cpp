@@ -9,17 +9,83 @@
 // Opaque predicates are based on the equations given in the paper at
 // http://crypto.cs.mcgill.ca/~garboit/sp-paper.pdf
 // TODO: Natural Number and exponential formulaes
+//
+// Command line options
+// - opaque-global - Number of global variables used. Default 4
+// - opaque-seed - Seed for random number generator. Defaults to obfSeed
+// - opaque-state - How the globals are laid out. Default shared
+//   - shared: Plain globals shared by every thread
+//   - padded: Each global is aligned to its own cache line so that predicates
+//             do not falsely share lines with each other or program data
+//   - tls: Thread local globals so that threads do not contend at all
+//   The mode can be overridden for a module by a named metadata
+//   !opaque_state = !{!"tls"}
+// - opaque-formula - Cost class of the formulas used. Default any
+//   Formulas are classed by the cost TargetTransformInfo gives to the
+//   instructions they lower to
+//   - cheap: cost <= opaque-cheap-cost (default 4)
+//   - medium: cost <= opaque-medium-cost (default 10)
+//   - strong: anything more expensive
+// - opaque-weights - Give every predicate branch branch weights saying which
+//   edge is never taken, so that the code generator lays those blocks out
+//   after the hot path. Default false
+//   The weights are kept in the bitcode and point out every bogus edge, so
+//   only use it when code is generated in the same process, e.g. clang -c
+// - opaque-cold - Where blocks that are never executed are placed
+//   - none: Leave them in their function (default)
+//   - outline: Extract them into functions marked cold
+//   - section: Extract them as above and place the functions in the section
+//              given by opaque-cold-section (default .text.unlikely)
+//   Only blocks that are reached through nothing but a predicate are moved,
+//   i.e. the clones made by BogusCF and not the exits of LoopBogusCF
+// - opaque-source - Where the operands of predicates come from. Default memory
+//   - memory: Each predicate loads, advances and stores two globals
+//   - registers: Integer values already live where the predicate is placed,
+//                such as arguments, induction variables and the operands of
+//                earlier predicates. Nothing is loaded or stored, except for
+//                one global advanced at function entry if no value is live
+//   - hot: registers in blocks that StaticHotness estimates to run more than
+//          once per program run, memory elsewhere
+// - opaque-live-values - Number of live values considered for the registers
+//   source, nearest dominating definitions first. Default 8
+// - opaque-tbaa - Tag the loads and stores of the globals with a TBAA type of
+//   their own. Default true
+//   Without it alias analysis has to assume that every predicate may clobber
+//   program memory, which stops LICM and GVN from moving or forwarding the
+//   loads of loops that contain predicates. The type is placed under the TBAA
+//   root the program already uses, as types under different roots are never
+//   told apart. Scoped noalias metadata is not available in this version of
+//   LLVM, and moving the globals to another address space would change their
+//   meaning on targets such as x86
+// - opaque-batch - Evaluate formulas once per function instead of once per
+//   predicate. Default false
+//   opaque-seeds (default 2) always false formulas are evaluated at the end of
+//   the entry block and turned into opaque zeroes. Each predicate then only
+//   adds a random constant to seeds and compares the sum with the constant,
+//   so the cost per call is roughly constant in the number of predicates.
+//   The operands of the seeds follow opaque-source for the entry block
 
 #define DEBUG_TYPE "opaque"
 #include "Transform/opaque_predicate.h"
+#include "Transform/pass_trace.h"
+#include "Transform/random_service.h"
+#include "Transform/static_hotness.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
-#include <chrono>
+#include "llvm/Transforms/Utils/CodeExtractor.h"
 #include <random>
 #include <cassert>
 using namespace llvm;
@@ -30,7 +96,107 @@ static cl::opt<unsigned> opaqueGlobal(
 
 static cl::opt<std::string> opaqueSeed(
     "opaque-seed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to obfSeed"));
+
+enum OpaqueState {
+  shared,
+  padded,
+  tls
+};
+
+static cl::opt<OpaqueState> opaqueState(
+    "opaque-state", cl::init(shared),
+    cl::desc("Storage of the global variables for opaque predicates"),
+    cl::values(clEnumVal(shared, "Globals shared between threads"),
+               clEnumVal(padded, "Shared globals padded to a cache line"),
+               clEnumVal(tls, "Thread local globals"), clEnumValEnd));
+
+static cl::opt<unsigned> opaqueCacheLine(
+    "opaque-cache-line", cl::init(64),
+    cl::desc("Cache line size used to pad globals with -opaque-state=padded"));
+
+enum FormulaClass {
+  any,
+  cheap,
+  medium,
+  strong
+};
+
+static cl::opt<FormulaClass> opaqueFormula(
+    "opaque-formula", cl::init(any),
+    cl::desc("Cost class of formulas used for opaque predicates"),
+    cl::values(clEnumVal(any, "Any formula"),
+               clEnumVal(cheap, "Formulas lowering to a few native ops"),
+               clEnumVal(medium, "Formulas of moderate cost"),
+               clEnumVal(strong, "Expensive formulas"), clEnumValEnd));
+
+static cl::opt<unsigned> opaqueCheapCost(
+    "opaque-cheap-cost", cl::init(4),
+    cl::desc("Maximum target cost of a formula in the cheap class"));
+
+static cl::opt<unsigned> opaqueMediumCost(
+    "opaque-medium-cost", cl::init(10),
+    cl::desc("Maximum target cost of a formula in the medium class"));
+
+enum ColdPlacement {
+  none,
+  outline,
+  section
+};
+
+static cl::opt<bool> opaqueWeights(
+    "opaque-weights", cl::init(false),
+    cl::desc("Give predicate branches weights that tell the code generator "
+             "which edge is never taken. They remain in bitcode output"));
+
+static cl::opt<ColdPlacement> opaqueCold(
+    "opaque-cold", cl::init(none),
+    cl::desc("Placement of blocks never executed due to opaque predicates"),
+    cl::values(clEnumVal(none, "Leave them in their function"),
+               clEnumVal(outline, "Extract them into cold functions"),
+               clEnumVal(section, "Extract them into cold functions in a "
+                                  "separate section"),
+               clEnumValEnd));
+
+static cl::opt<std::string> opaqueColdSection(
+    "opaque-cold-section", cl::init(".text.unlikely"),
+    cl::desc("Section of the functions extracted with -opaque-cold=section"));
+
+enum OperandSource {
+  memory,
+  registers,
+  hot
+};
+
+static cl::opt<OperandSource> opaqueSource(
+    "opaque-source", cl::init(memory),
+    cl::desc("Source of the operands of opaque predicates"),
+    cl::values(clEnumVal(memory, "Globals advanced by every predicate"),
+               clEnumVal(registers, "Integer values live at the predicate"),
+               clEnumVal(hot, "Live values in frequently executed blocks, "
+                              "globals elsewhere"),
+               clEnumValEnd));
+
+static cl::opt<unsigned> opaqueLiveValues(
+    "opaque-live-values", cl::init(8),
+    cl::desc("Number of live values considered as predicate operands"));
+
+static cl::opt<bool> opaqueTBAA(
+    "opaque-tbaa", cl::init(true),
+    cl::desc("Tag accesses to the globals of opaque predicates with a TBAA "
+             "type of their own"));
+
+static cl::opt<bool> opaqueBatch(
+    "opaque-batch", cl::init(false),
+    cl::desc("Derive the predicates of a function from seeds computed once "
+             "at its entry"));
+
+static cl::opt<unsigned> opaqueSeeds(
+    "opaque-seeds", cl::init(2),
+    cl::desc("Number of seeds per function with -opaque-batch"));
+
+// Weight of the edge a predicate evaluates to. The other edge weighs 1
+static const uint32_t takenWeight = 1 << 20;
 
 static cl::opt<bool> disableOpaquePred(
     "disableOpaquePred", cl::init(false),
@@ -40,26 +206,54 @@ bool OpaquePredicate::runOnModule(Module &M) {
   if (disableOpaquePred)
     return false;
 
-  // Seed engine and create distribution
-  if (!opaqueSeed.empty()) {
-    std::seed_seq seed(opaqueSeed.begin(), opaqueSeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
+  if (opaqueBatch && opaqueSeeds == 0) {
+    M.getContext().emitError("OpaquePredicate: Batching needs at least 1 seed");
+    return false;
   }
 
+  PassTrace::ModuleScope trace(this, M);
+
+  // Work out the cost of formulas on this target
+  computeFormulaCosts(M, getAnalysis<TargetTransformInfo>());
+
   // Create globals
-  std::vector<GlobalVariable *> globals = prepareModule(M);
+  std::vector<Constant *> globals = prepareModule(M);
 
   std::uniform_int_distribution<int> distribution;
   std::uniform_int_distribution<int> distributionType(0, 1);
 
   LLVMContext &context = M.getContext();
   unsigned metaKind = context.getMDKindID(unreachableMarkName);
+  std::vector<BasicBlock *> coldBlocks;
+
+  StaticHotness *hotness = nullptr;
+  if (opaqueSource == hot) {
+    hotness = &getAnalysis<StaticHotness>();
+  }
 
   for (auto &function : M) {
+    if (function.isDeclaration())
+      continue;
     DEBUG(errs() << "\tFunction " << function.getName() << "\n");
+    PassTrace::FunctionScope functionTrace(this, function);
+    RandomService::seed(engine, "opaque-predicate", opaqueSeed, function);
+    DominatorTree *DT = nullptr;
+    // Global advanced at entry when no value is live at a predicate
+    Value *entryValue = nullptr;
+    // Opaque zeroes computed at entry with -opaque-batch
+    std::vector<Value *> seeds;
+    // Registers are used instead of memory for the operands in a block
+    auto fromRegisters = [&](BasicBlock &current) -> bool {
+      if (opaqueSource != registers &&
+          (opaqueSource != hot || hotness->getBlockFrequency(current) <= 1.0))
+        return false;
+      // The CFG is not changed until cold blocks are outlined, so the tree
+      // stays valid for the whole function
+      if (!DT)
+        DT = &getAnalysis<DominatorTree>(function);
+      return true;
+    };
+
     for (auto &block : function) {
       TerminatorInst *terminator = block.getTerminator();
 
@@ -93,31 +287,77 @@ bool OpaquePredicate::runOnModule(Module &M) {
         mark = false;
       }
 
+      // Seeds go at the end of the entry block, whose terminator may be this
+      // stub, so they are created before the stub is removed
+      if (opaqueBatch && seeds.empty()) {
+        DEBUG(errs() << "\t\tCreating " << opaqueSeeds << " seeds\n");
+        BasicBlock &entryBlock = function.getEntryBlock();
+        std::vector<Value *> liveValues;
+        if (fromRegisters(entryBlock))
+          getLiveValues(&entryBlock, *DT, liveValues);
+        createSeeds(entryBlock, globals, liveValues, [&]{
+          return distribution(engine);
+        }, seeds);
+      }
+
       branch->eraseFromParent();
       compare->eraseFromParent();
 
       PredicateType createdType;
-      if (type == PredicateTrue) {
-        createTrue(&block, trueBlock, falseBlock, globals, [&]{
+      if (opaqueBatch) {
+        createdType = type;
+        if (createdType == PredicateRandom)
+          createdType = static_cast<PredicateType>(distributionType(engine));
+        createFromSeeds(&block, trueBlock, falseBlock, seeds, createdType, [&]{
           return distribution(engine);
         });
-        createdType = PredicateTrue;
-      } else if (type == PredicateFalse) {
-        createFalse(&block, trueBlock, falseBlock, globals, [&]{
-          return distribution(engine);
-        });
-        createdType = PredicateTrue;
       } else {
-        createdType = create(&block, trueBlock, falseBlock, globals, [&]{
-          return distribution(engine);
-        },
-                             [&]()->OpaquePredicate::PredicateType{
-          return static_cast<OpaquePredicate::PredicateType>(
-              distributionType(engine));
-        });
-        DEBUG(errs() << "\t\tOpaque Predicate Created: " << createdType
-                     << "\n");
+        // Operands from registers instead of memory
+        std::vector<Value *> liveValues;
+        if (fromRegisters(block)) {
+          getLiveValues(&block, *DT, liveValues);
+          DEBUG(errs() << "\t\t" << liveValues.size() << " live values\n");
+
+          if (liveValues.empty()) {
+            if (!entryValue) {
+              DEBUG(errs() << "\t\tAdvancing global at entry\n");
+              BasicBlock &entryBlock = function.getEntryBlock();
+              TerminatorInst *entryTerminator = entryBlock.getTerminator();
+              if (entryTerminator)
+                entryTerminator->removeFromParent();
+              entryValue = advanceGlobal(
+                  &entryBlock, globals[distribution(engine) % globals.size()],
+                  [&] { return distribution(engine); });
+              if (entryTerminator)
+                entryBlock.getInstList().push_back(entryTerminator);
+            }
+            liveValues.push_back(entryValue);
+          }
+        }
+
+        if (type == PredicateTrue) {
+          createTrue(&block, trueBlock, falseBlock, globals, liveValues, [&]{
+            return distribution(engine);
+          });
+          createdType = PredicateTrue;
+        } else if (type == PredicateFalse) {
+          createFalse(&block, trueBlock, falseBlock, globals, liveValues, [&]{
+            return distribution(engine);
+          });
+          createdType = PredicateFalse;
+        } else {
+          createdType = create(&block, trueBlock, falseBlock, globals,
+                               liveValues, [&]{
+            return distribution(engine);
+          },
+                               [&]()->OpaquePredicate::PredicateType{
+            return static_cast<OpaquePredicate::PredicateType>(
+                distributionType(engine));
+          });
+        }
       }
+      DEBUG(errs() << "\t\tOpaque Predicate Created: " << createdType
+                   << "\n");
 
       // Check if we want any marking
       if (mark) {
@@ -126,11 +366,13 @@ bool OpaquePredicate::runOnModule(Module &M) {
           cleanDebug(*falseBlock);
           tagInstruction(*(falseBlock->begin()), unreachableName,
                          PredicateTrue);
+          coldBlocks.push_back(falseBlock);
           break;
         case PredicateFalse:
           cleanDebug(*trueBlock);
           tagInstruction(*(trueBlock->begin()), unreachableName,
                          PredicateFalse);
+          coldBlocks.push_back(trueBlock);
           break;
         default:
           llvm_unreachable("Unsupported predicate type");
@@ -139,11 +381,49 @@ bool OpaquePredicate::runOnModule(Module &M) {
       // DEBUG_WITH_TYPE("opaque_cfg", function.viewCFG());
     }
   }
+
+  // Functions are added to the module so this is done last
+  if (opaqueCold != none) {
+    outlineCold(coldBlocks);
+  }
   return true;
 }
 
+void OpaquePredicate::setWeights(BranchInst *branch,
+                                 OpaquePredicate::PredicateType type) {
+  if (!opaqueWeights)
+    return;
+  MDBuilder builder(branch->getContext());
+  MDNode *weights = type == PredicateTrue
+                        ? builder.createBranchWeights(takenWeight, 1)
+                        : builder.createBranchWeights(1, takenWeight);
+  branch->setMetadata(LLVMContext::MD_prof, weights);
+}
+
+void OpaquePredicate::outlineCold(const std::vector<BasicBlock *> &blocks) {
+  for (BasicBlock *block : blocks) {
+    DEBUG(errs() << "\tOutlining " << block->getName() << "\n");
+    CodeExtractor extractor(block);
+    if (!extractor.isEligible()) {
+      DEBUG(errs() << "\t\tSkipping: Not eligible for extraction\n");
+      continue;
+    }
+    Function *cold = extractor.extractCodeRegion();
+    if (!cold) {
+      DEBUG(errs() << "\t\tSkipping: Extraction failed\n");
+      continue;
+    }
+    cold->addFnAttr(Attribute::Cold);
+    cold->addFnAttr(Attribute::NoInline);
+    cold->addFnAttr(Attribute::OptimizeForSize);
+    if (opaqueCold == section) {
+      cold->setSection(opaqueColdSection);
+    }
+  }
+}
+
 // TODO: Use some runtime randomniser? Maybe?
-Value *OpaquePredicate::advanceGlobal(BasicBlock *block, GlobalVariable *global,
+Value *OpaquePredicate::advanceGlobal(BasicBlock *block, Constant *global,
                                       OpaquePredicate::Randomner randomner) {
   assert(global && "Null global pointer");
   DEBUG(errs() << "[Opaque Predicate] Randomly advancing global\n");
@@ -158,6 +438,8 @@ Value *OpaquePredicate::advanceGlobal(BasicBlock *block, GlobalVariable *global,
                                    randomValue, true);
   DEBUG(errs() << "\tLoading global\n");
   LoadInst *load = new LoadInst((Value *)global, "", block);
+  if (stateTag)
+    load->setMetadata(LLVMContext::MD_tbaa, stateTag);
   DEBUG(errs() << "\tAdding global\n");
 
   Instruction::BinaryOps op = Instruction::Add;
@@ -182,7 +464,9 @@ Value *OpaquePredicate::advanceGlobal(BasicBlock *block, GlobalVariable *global,
   // SelectInst to ensure non zero
   SelectInst *returnValue =
       SelectInst::Create(compare, random, advance, "", block);
-  new StoreInst(returnValue, (Value *)global, block);
+  StoreInst *store = new StoreInst(returnValue, (Value *)global, block);
+  if (stateTag)
+    store->setMetadata(LLVMContext::MD_tbaa, stateTag);
   return (Value *)returnValue;
 }
 
@@ -193,12 +477,16 @@ Value *OpaquePredicate::formula0(BasicBlock *block, Value *x, Value *y,
   assert(type != OpaquePredicate::PredicateIndeterminate &&
          "Formula 0 does not support indeterminate!");
 
-  // 96 bit integer type
-  Type *intType = (Type *)Type::getIntNTy(block->getContext(), 96);
+  // The identity holds for all integers so it still holds for 16 bit ones,
+  // whose squares cannot overflow 64 bits
+  Type *shortType = (Type *)Type::getInt16Ty(block->getContext());
+  Type *intType = (Type *)Type::getInt64Ty(block->getContext());
 
-  // Sign extend to 96 bits
-  Value *x1 = (Value *)new SExtInst(x, intType, "", block);
-  Value *y1 = (Value *)new SExtInst(y, intType, "", block);
+  // Truncate to 16 bits and sign extend to 64 bits
+  Value *x1 = (Value *)new SExtInst(new TruncInst(x, shortType, "", block),
+                                    intType, "", block);
+  Value *y1 = (Value *)new SExtInst(new TruncInst(y, shortType, "", block),
+                                    intType, "", block);
 
   Value *seven =
       ConstantInt::get(intType, 7, false);
@@ -236,11 +524,14 @@ Value *OpaquePredicate::formula1(BasicBlock *block, Value *x, Value *y1,
   assert(type != OpaquePredicate::PredicateIndeterminate &&
          "Formula 1 does not support indeterminate!");
 
-  // 96 bit integer type
-  Type *intType = (Type *)Type::getIntNTy(block->getContext(), 96);
+  // The identity holds for all integers so it still holds for 16 bit ones,
+  // whose cubes cannot overflow 64 bits
+  Type *shortType = (Type *)Type::getInt16Ty(block->getContext());
+  Type *intType = (Type *)Type::getInt64Ty(block->getContext());
 
-  // Sign extend to 96 bits
-  Value *x1 = (Value *)new SExtInst(x, intType, "", block);
+  // Truncate to 16 bits and sign extend to 64 bits
+  Value *x1 = (Value *)new SExtInst(new TruncInst(x, shortType, "", block),
+                                    intType, "", block);
 
   // x^2
   Value *x2 =
@@ -324,47 +615,423 @@ Value *OpaquePredicate::formula2(BasicBlock *block, Value *x, Value *y1,
     return BinaryOperator::CreateNot(condition, "", block);
 }
 
+// (x^2 ^ x) & 1 == 0 for all x in Z/2^32Z: x^2 has the parity of x
+Value *OpaquePredicate::formula3(BasicBlock *block, Value *x, Value *y1,
+                                 OpaquePredicate::PredicateType type) {
+  // y1 is unused
+  assert(type != OpaquePredicate::PredicateIndeterminate &&
+         "Formula 3 does not support indeterminate!");
+
+  Type *intType = x->getType();
+  Value *zero = ConstantInt::get(intType, 0, false);
+  Value *one = ConstantInt::get(intType, 1, false);
+
+  // x^2
+  Value *x2 =
+      (Value *)BinaryOperator::Create(Instruction::Mul, x, x, "", block);
+  // x^2 ^ x
+  Value *x3 =
+      (Value *)BinaryOperator::Create(Instruction::Xor, x2, x, "", block);
+  // (x^2 ^ x) & 1
+  Value *parity =
+      (Value *)BinaryOperator::Create(Instruction::And, x3, one, "", block);
+
+  Value *condition;
+  // Compare
+  if (type == OpaquePredicate::PredicateTrue)
+    condition = CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_EQ, parity,
+                                zero, "", block);
+  else
+    condition = CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_NE, parity,
+                                zero, "", block);
+
+  return condition;
+}
+
+// popcount(x) + popcount(~x) == 32 for all x in Z/2^32Z
+Value *OpaquePredicate::formula4(BasicBlock *block, Value *x, Value *y1,
+                                 OpaquePredicate::PredicateType type) {
+  // y1 is unused
+  assert(type != OpaquePredicate::PredicateIndeterminate &&
+         "Formula 4 does not support indeterminate!");
+
+  Type *intType = x->getType();
+  Module *module = block->getParent()->getParent();
+  Function *ctpop = Intrinsic::getDeclaration(module, Intrinsic::ctpop, intType);
+  Value *width =
+      ConstantInt::get(intType, intType->getIntegerBitWidth(), false);
+
+  // ~x
+  Value *notX = (Value *)BinaryOperator::CreateNot(x, "", block);
+  // popcount(x)
+  Value *lhs = (Value *)CallInst::Create(ctpop, x, "", block);
+  // popcount(~x)
+  Value *rhs = (Value *)CallInst::Create(ctpop, notX, "", block);
+  // popcount(x) + popcount(~x)
+  Value *sum =
+      (Value *)BinaryOperator::Create(Instruction::Add, lhs, rhs, "", block);
+
+  Value *condition;
+  // Compare
+  if (type == OpaquePredicate::PredicateTrue)
+    condition = CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_EQ, sum,
+                                width, "", block);
+  else
+    condition = CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_NE, sum,
+                                width, "", block);
+
+  return condition;
+}
+
+// (popcount(x ^ y) ^ popcount(x) ^ popcount(y)) & 1 == 0 for all x, y in
+// Z/2^32Z: the parity of x ^ y is the parity of x and y combined
+Value *OpaquePredicate::formula5(BasicBlock *block, Value *x, Value *y,
+                                 OpaquePredicate::PredicateType type) {
+  assert(type != OpaquePredicate::PredicateIndeterminate &&
+         "Formula 5 does not support indeterminate!");
+
+  Type *intType = x->getType();
+  Module *module = block->getParent()->getParent();
+  Function *ctpop = Intrinsic::getDeclaration(module, Intrinsic::ctpop, intType);
+  Value *zero = ConstantInt::get(intType, 0, false);
+  Value *one = ConstantInt::get(intType, 1, false);
+
+  // x ^ y
+  Value *xy =
+      (Value *)BinaryOperator::Create(Instruction::Xor, x, y, "", block);
+  // popcount(x ^ y)
+  Value *xyCount = (Value *)CallInst::Create(ctpop, xy, "", block);
+  // popcount(x)
+  Value *xCount = (Value *)CallInst::Create(ctpop, x, "", block);
+  // popcount(y)
+  Value *yCount = (Value *)CallInst::Create(ctpop, y, "", block);
+  // popcount(x ^ y) ^ popcount(x) ^ popcount(y)
+  Value *counts = (Value *)BinaryOperator::Create(
+      Instruction::Xor,
+      BinaryOperator::Create(Instruction::Xor, xyCount, xCount, "", block),
+      yCount, "", block);
+  // Parity
+  Value *parity =
+      (Value *)BinaryOperator::Create(Instruction::And, counts, one, "", block);
+
+  Value *condition;
+  // Compare
+  if (type == OpaquePredicate::PredicateTrue)
+    condition = CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_EQ, parity,
+                                zero, "", block);
+  else
+    condition = CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_NE, parity,
+                                zero, "", block);
+
+  return condition;
+}
+
+// ctz(x) == popcount((x & -x) - 1) for all x in Z/2^32Z, including 0 where
+// both are 32
+Value *OpaquePredicate::formula6(BasicBlock *block, Value *x, Value *y1,
+                                 OpaquePredicate::PredicateType type) {
+  // y1 is unused
+  assert(type != OpaquePredicate::PredicateIndeterminate &&
+         "Formula 6 does not support indeterminate!");
+
+  Type *intType = x->getType();
+  Module *module = block->getParent()->getParent();
+  Function *ctpop = Intrinsic::getDeclaration(module, Intrinsic::ctpop, intType);
+  Function *cttz = Intrinsic::getDeclaration(module, Intrinsic::cttz, intType);
+  Value *one = ConstantInt::get(intType, 1, false);
+  // ctz of zero must be defined
+  Value *zeroDefined = ConstantInt::getFalse(block->getContext());
+
+  // -x
+  Value *negX = (Value *)BinaryOperator::CreateNeg(x, "", block);
+  // x & -x
+  Value *lowest =
+      (Value *)BinaryOperator::Create(Instruction::And, x, negX, "", block);
+  // (x & -x) - 1
+  Value *mask =
+      (Value *)BinaryOperator::Create(Instruction::Sub, lowest, one, "", block);
+  // popcount((x & -x) - 1)
+  Value *rhs = (Value *)CallInst::Create(ctpop, mask, "", block);
+  // ctz(x)
+  Value *cttzArgs[2] = { x, zeroDefined };
+  Value *lhs = (Value *)CallInst::Create(cttz, cttzArgs, "", block);
+
+  Value *condition;
+  // Compare
+  if (type == OpaquePredicate::PredicateTrue)
+    condition = CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_EQ, lhs, rhs,
+                                "", block);
+  else
+    condition = CmpInst::Create(Instruction::ICmp, ICmpInst::ICMP_NE, lhs, rhs,
+                                "", block);
+
+  return condition;
+}
+
+std::vector<OpaquePredicate::FormulaInfo> &OpaquePredicate::getFormulas() {
+  // Initialised once even when modules are transformed at the same time
+  static std::vector<FormulaInfo> library = []() {
+    std::vector<FormulaInfo> formulas;
+    formulas.push_back(FormulaInfo("square", formula0));
+    formulas.push_back(FormulaInfo("cube", formula1));
+    formulas.push_back(FormulaInfo("square-mod8", formula2));
+    formulas.push_back(FormulaInfo("square-parity", formula3));
+    formulas.push_back(FormulaInfo("popcount", formula4));
+    formulas.push_back(FormulaInfo("popcount-parity", formula5));
+    formulas.push_back(FormulaInfo("ctz", formula6));
+    return formulas;
+  }();
+  return library;
+}
+
+void OpaquePredicate::registerFormula(StringRef name, Formula formula) {
+  getFormulas().push_back(FormulaInfo(name, formula));
+}
+
+void OpaquePredicate::computeFormulaCosts(Module &M,
+                                          const TargetTransformInfo &TTI) {
+  DEBUG(errs() << "[Opaque Predicate] Computing formula costs\n");
+  LLVMContext &context = M.getContext();
+  Type *intType = Type::getInt32Ty(context);
+  Type *argTypes[2] = { intType, intType };
+  FunctionType *type =
+      FunctionType::get(Type::getVoidTy(context), argTypes, false);
+
+  // Formulas declare the intrinsics they call. Those the module did not
+  // declare already are removed again with the scratch functions
+  SmallPtrSet<Function *, 8> declarations;
+  for (auto &F : M) {
+    if (F.isDeclaration())
+      declarations.insert(&F);
+  }
+
+  formulas = getFormulas();
+  for (FormulaInfo &info : formulas) {
+    // Lower the formula into a scratch function to see what it costs
+    Function *scratch =
+        Function::Create(type, GlobalValue::PrivateLinkage, "", &M);
+    BasicBlock *block = BasicBlock::Create(context, "", scratch);
+    Function::arg_iterator arg = scratch->arg_begin();
+    Value *x = arg++;
+    Value *y = arg;
+    info.formula(block, x, y, PredicateTrue);
+
+    info.cost = 0;
+    SmallPtrSet<Function *, 4> callees;
+    for (auto &inst : *block) {
+      info.cost += getInstructionCost(inst, TTI);
+      if (CallInst *call = dyn_cast<CallInst>(&inst))
+        if (Function *callee = call->getCalledFunction())
+          callees.insert(callee);
+    }
+    scratch->eraseFromParent();
+    for (Function *callee : callees) {
+      if (callee->isDeclaration() && callee->use_empty() &&
+          !declarations.count(callee))
+        callee->eraseFromParent();
+    }
+
+    if (info.cost <= opaqueCheapCost)
+      info.costClass = CostCheap;
+    else if (info.cost <= opaqueMediumCost)
+      info.costClass = CostMedium;
+    else
+      info.costClass = CostStrong;
+    DEBUG(errs() << "\t" << info.name << ": cost " << info.cost << ", class "
+                 << info.costClass << "\n");
+  }
+}
+
+unsigned OpaquePredicate::getInstructionCost(Instruction &inst,
+                                             const TargetTransformInfo &TTI) {
+  if (IntrinsicInst *intrinsic = dyn_cast<IntrinsicInst>(&inst)) {
+    std::vector<Type *> types;
+    for (unsigned i = 0, iEnd = intrinsic->getNumArgOperands(); i < iEnd; ++i)
+      types.push_back(intrinsic->getArgOperand(i)->getType());
+    return TTI.getIntrinsicInstrCost(intrinsic->getIntrinsicID(),
+                                     intrinsic->getType(), types);
+  } else if (BinaryOperator *binary = dyn_cast<BinaryOperator>(&inst)) {
+    TargetTransformInfo::OperandValueKind operand1 =
+        isa<ConstantInt>(binary->getOperand(0))
+            ? TargetTransformInfo::OK_UniformConstantValue
+            : TargetTransformInfo::OK_AnyValue;
+    TargetTransformInfo::OperandValueKind operand2 =
+        isa<ConstantInt>(binary->getOperand(1))
+            ? TargetTransformInfo::OK_UniformConstantValue
+            : TargetTransformInfo::OK_AnyValue;
+    return TTI.getArithmeticInstrCost(binary->getOpcode(), binary->getType(),
+                                      operand1, operand2);
+  } else if (CastInst *cast = dyn_cast<CastInst>(&inst)) {
+    return TTI.getCastInstrCost(cast->getOpcode(), cast->getDestTy(),
+                                cast->getSrcTy());
+  } else if (CmpInst *compare = dyn_cast<CmpInst>(&inst)) {
+    return TTI.getCmpSelInstrCost(compare->getOpcode(),
+                                  compare->getOperand(0)->getType());
+  } else if (SelectInst *select = dyn_cast<SelectInst>(&inst)) {
+    return TTI.getCmpSelInstrCost(Instruction::Select, select->getType(),
+                                  select->getCondition()->getType());
+  }
+  return 1;
+}
+
 OpaquePredicate::Formula
 OpaquePredicate::getFormula(OpaquePredicate::Randomner randomner) {
-  static const int number = 3;
-  static Formula formales[number] = { formula0, formula1, formula2 };
-  int n = randomner() % number;
-  DEBUG(errs() << "[Opaque Predicate] Formula " << n << "\n");
-  return formales[n];
+  std::vector<unsigned> candidates;
+  for (unsigned i = 0, iEnd = formulas.size(); i < iEnd; ++i) {
+    if (opaqueFormula == any ||
+        (opaqueFormula == cheap && formulas[i].costClass == CostCheap) ||
+        (opaqueFormula == medium && formulas[i].costClass == CostMedium) ||
+        (opaqueFormula == strong && formulas[i].costClass == CostStrong)) {
+      candidates.push_back(i);
+    }
+  }
+
+  // Nothing in the class on this target: fall back to every formula
+  if (candidates.empty()) {
+    DEBUG(errs() << "[Opaque Predicate] No formula in class -- using any\n");
+    for (unsigned i = 0, iEnd = formulas.size(); i < iEnd; ++i)
+      candidates.push_back(i);
+  }
+
+  unsigned n = candidates[randomner() % candidates.size()];
+  DEBUG(errs() << "[Opaque Predicate] Formula " << formulas[n].name << "\n");
+  return formulas[n].formula;
 }
 
-std::vector<GlobalVariable *> OpaquePredicate::prepareModule(Module &M) {
+std::vector<Constant *> OpaquePredicate::prepareModule(Module &M) {
   assert(opaqueGlobal >= 2 &&
          "Opaque Predicates need at least 2 global variables");
   DEBUG(errs() << "[Opaque Predicate] Creating " << opaqueGlobal
                << " globals\n");
-  std::vector<GlobalVariable *> globals(opaqueGlobal);
+
+  // Module can override the storage mode
+  OpaqueState state = opaqueState;
+  if (NamedMDNode *node = M.getNamedMetadata(stateName)) {
+    MDNode *meta = node->getNumOperands() ? node->getOperand(0) : nullptr;
+    MDString *str = meta && meta->getNumOperands()
+                        ? dyn_cast<MDString>(meta->getOperand(0))
+                        : nullptr;
+    if (!str) {
+      M.getContext().emitError("OpaquePredicate: Invalid " + stateName +
+                               " metadata");
+    } else if (str->getString() == "shared") {
+      state = shared;
+    } else if (str->getString() == "padded") {
+      state = padded;
+    } else if (str->getString() == "tls") {
+      state = tls;
+    } else {
+      M.getContext().emitError("OpaquePredicate: Unknown " + stateName +
+                               " " + str->getString());
+    }
+  }
+  DEBUG(errs() << "[Opaque Predicate] State mode " << state << "\n");
+
+  LLVMContext &context = M.getContext();
+  Type *intType = Type::getInt32Ty(context);
+  Type *globalType = intType;
+  Constant *zero = ConstantInt::get(intType, 0, true);
+  Constant *initializer = zero;
+  if (state == padded) {
+    // Pad each global to a whole cache line so that nothing else can share
+    // the line with it
+    assert(opaqueCacheLine > 4 && "Cache line must be larger than an i32");
+    ArrayType *padType =
+        ArrayType::get(Type::getInt8Ty(context), opaqueCacheLine - 4);
+    globalType = StructType::get(intType, padType, nullptr);
+    initializer = Constant::getNullValue(globalType);
+  }
+
+  std::vector<Constant *> globals(opaqueGlobal);
   for (unsigned i = 0; i < opaqueGlobal; ++i) {
     Twine globalName("");
     DEBUG(globalName = globalName.concat(Twine("global_")).concat(Twine(i)));
-    Value *zero = ConstantInt::get(Type::getInt32Ty(M.getContext()), 0, true);
-    GlobalVariable *global = new GlobalVariable(
-        M, Type::getInt32Ty(M.getContext()), false, GlobalValue::CommonLinkage,
-        (Constant *)zero, globalName);
+    GlobalVariable *global;
+    if (state == tls) {
+      // Each module gets its own copy: the predicates hold for any value so
+      // there is no need to share them with other translation units
+      global = new GlobalVariable(M, globalType, false,
+                                  GlobalValue::InternalLinkage, initializer,
+                                  globalName, nullptr,
+                                  GlobalVariable::InitialExecTLSModel);
+    } else {
+      global = new GlobalVariable(M, globalType, false,
+                                  GlobalValue::CommonLinkage, initializer,
+                                  globalName);
+    }
     assert(global && "Null globals created!");
-    globals[i] = global;
+
+    if (state == padded) {
+      global->setAlignment(opaqueCacheLine);
+      Constant *indices[2] = { zero, zero };
+      globals[i] = ConstantExpr::getInBoundsGetElementPtr(global, indices);
+    } else {
+      globals[i] = global;
+    }
   }
+
+  stateTag = opaqueTBAA ? createStateTag(M) : nullptr;
   return globals;
 }
 
+MDNode *OpaquePredicate::createStateTag(Module &M) {
+  // Find the root from any access of the program that is already tagged
+  MDNode *root = nullptr;
+  bool structPath = false;
+  for (auto &F : M) {
+    for (auto &block : F) {
+      for (auto &inst : block) {
+        MDNode *tag = inst.getMetadata(LLVMContext::MD_tbaa);
+        if (!tag || tag->getNumOperands() < 2)
+          continue;
+        // Struct-path tags are (base type, access type, offset). Scalar tags
+        // are the access type itself
+        structPath =
+            tag->getNumOperands() >= 3 && isa<MDNode>(tag->getOperand(0));
+        MDNode *node = structPath ? dyn_cast<MDNode>(tag->getOperand(1)) : tag;
+        // Types are (name, parent, ...) up to the root, which has a name only
+        while (node && node->getNumOperands() >= 2 &&
+               isa<MDNode>(node->getOperand(1))) {
+          node = cast<MDNode>(node->getOperand(1));
+        }
+        root = node;
+        break;
+      }
+      if (root)
+        break;
+    }
+    if (root)
+      break;
+  }
+
+  MDBuilder builder(M.getContext());
+  if (!root) {
+    DEBUG(errs() << "[Opaque Predicate] No TBAA in module -- new root\n");
+    root = builder.createTBAARoot("Opaque predicate TBAA");
+  }
+  if (structPath) {
+    MDNode *type = builder.createTBAAScalarTypeNode("opaque state", root);
+    return builder.createTBAAStructTagNode(type, type, 0);
+  }
+  return builder.createTBAANode("opaque state", root);
+}
+
 OpaquePredicate::PredicateType
 OpaquePredicate::create(BasicBlock *headBlock, BasicBlock *trueBlock,
                         BasicBlock *falseBlock,
-                        const std::vector<GlobalVariable *> &globals,
+                        const std::vector<Constant *> &globals,
+                        const std::vector<Value *> &liveValues,
                         Randomner randomner, PredicateTypeRandomner typeRand) {
 
   PredicateType type = typeRand();
   switch (type) {
   case PredicateFalse:
-    createFalse(headBlock, trueBlock, falseBlock, globals, randomner);
+    createFalse(headBlock, trueBlock, falseBlock, globals, liveValues,
+                randomner);
     break;
   case PredicateTrue:
-    createTrue(headBlock, trueBlock, falseBlock, globals, randomner);
+    createTrue(headBlock, trueBlock, falseBlock, globals, liveValues,
+               randomner);
   case PredicateIndeterminate:
     break;
   default:
@@ -373,50 +1040,198 @@ OpaquePredicate::create(BasicBlock *headBlock, BasicBlock *trueBlock,
   return type;
 }
 
-void OpaquePredicate::createTrue(BasicBlock *headBlock, BasicBlock *trueBlock,
-                                 BasicBlock *falseBlock,
-                                 const std::vector<GlobalVariable *> &globals,
-                                 OpaquePredicate::Randomner randomner) {
-  // Get our x and y
-  GlobalVariable *x = globals[randomner() % globals.size()];
-  GlobalVariable *y = globals[randomner() % globals.size()];
+void OpaquePredicate::createOperands(BasicBlock *headBlock,
+                                     const std::vector<Constant *> &globals,
+                                     const std::vector<Value *> &liveValues,
+                                     OpaquePredicate::Randomner randomner,
+                                     Value *&x1, Value *&y1) {
+  if (liveValues.empty()) {
+    // Get our x and y
+    Constant *x = globals[randomner() % globals.size()];
+    Constant *y = globals[randomner() % globals.size()];
+
+    while (x == y) {
+      y = globals[randomner() % globals.size()];
+    }
+
+    // Advance our x and y
+    x1 = advanceGlobal(headBlock, x, randomner);
+    y1 = advanceGlobal(headBlock, y, randomner);
+    return;
+  }
+
+  // The formulas hold for any value, so live values only need to be brought
+  // to 32 bits
+  Type *intType = Type::getInt32Ty(headBlock->getContext());
+  auto getOperand = [&]() -> Value * {
+    Value *value = liveValues[randomner() % liveValues.size()];
+    if (value->getType() == intType)
+      return value;
+    return CastInst::CreateIntegerCast(value, intType, true, "", headBlock);
+  };
+  x1 = getOperand();
+  y1 = getOperand();
+}
+
+void OpaquePredicate::createSeeds(BasicBlock &entryBlock,
+                                  const std::vector<Constant *> &globals,
+                                  const std::vector<Value *> &liveValues,
+                                  OpaquePredicate::Randomner randomner,
+                                  std::vector<Value *> &seeds) {
+  TerminatorInst *terminator = entryBlock.getTerminator();
+  if (terminator)
+    terminator->removeFromParent();
+
+  Type *intType = Type::getInt32Ty(entryBlock.getContext());
+  for (unsigned i = 0; i < opaqueSeeds; ++i) {
+    Value *x1, *y1;
+    createOperands(&entryBlock, globals, liveValues, randomner, x1, y1);
+    Formula formula = getFormula(randomner);
+    Value *condition = formula(&entryBlock, x1, y1, PredicateFalse);
+    // The condition never holds so the seed is always zero. A zext would
+    // tell InstCombine that bits 1 to 31 are zero, which is enough to fold
+    // an or with an odd constant. Multiplied with an operand, no bit of the
+    // seed is known
+    Value *mask = new SExtInst(condition, intType, "", &entryBlock);
+    if (x1->getType() != intType)
+      x1 = CastInst::CreateIntegerCast(x1, intType, true, "", &entryBlock);
+    seeds.push_back(BinaryOperator::CreateMul(mask, x1, "", &entryBlock));
+  }
+
+  if (terminator)
+    entryBlock.getInstList().push_back(terminator);
+}
+
+void OpaquePredicate::createFromSeeds(BasicBlock *headBlock,
+                                      BasicBlock *trueBlock,
+                                      BasicBlock *falseBlock,
+                                      const std::vector<Value *> &seeds,
+                                      OpaquePredicate::PredicateType type,
+                                      OpaquePredicate::Randomner randomner) {
+  static const Instruction::BinaryOps opcodes[] = {
+    Instruction::Add, Instruction::Xor, Instruction::Or
+  };
+  const unsigned numOpcodes = sizeof(opcodes) / sizeof(opcodes[0]);
+
+  // Both seeds are zero, so mixing them into the constant leaves it as is
+  Value *seed1 = seeds[randomner() % seeds.size()];
+  Value *seed2 = seeds[randomner() % seeds.size()];
+  Value *constant = ConstantInt::get(seed1->getType(), randomner());
+  Value *mixed = BinaryOperator::Create(opcodes[randomner() % numOpcodes],
+                                        seed1, constant, "", headBlock);
+  mixed = BinaryOperator::Create(opcodes[randomner() % numOpcodes], mixed,
+                                 seed2, "", headBlock);
+
+  Value *condition;
+  if (type == PredicateTrue)
+    condition = new ICmpInst(*headBlock, ICmpInst::ICMP_EQ, mixed, constant);
+  else
+    condition = new ICmpInst(*headBlock, ICmpInst::ICMP_NE, mixed, constant);
+
+  BranchInst *branch =
+      BranchInst::Create(trueBlock, falseBlock, condition, headBlock);
+  setWeights(branch, type);
+}
+
+bool OpaquePredicate::isWellDefined(Value *value, unsigned depth) {
+  if (isa<Argument>(value) || isa<LoadInst>(value))
+    return true;
+  if (isa<ConstantInt>(value))
+    return true;
+  Instruction *inst = dyn_cast<Instruction>(value);
+  if (!inst || depth == 0)
+    return false;
 
-  while (x == y) {
-    y = globals[randomner() % globals.size()];
+  // Results that overflow or are inexact are poison
+  if (OverflowingBinaryOperator *op =
+          dyn_cast<OverflowingBinaryOperator>(inst)) {
+    if (op->hasNoSignedWrap() || op->hasNoUnsignedWrap())
+      return false;
+  }
+  if (PossiblyExactOperator *op = dyn_cast<PossiblyExactOperator>(inst)) {
+    if (op->isExact())
+      return false;
+  }
+  // Shifting by the width or more is undef
+  if (inst->isShift() && !isa<ConstantInt>(inst->getOperand(1)))
+    return false;
+  if (!isa<BinaryOperator>(inst) && !isa<CastInst>(inst) &&
+      !isa<CmpInst>(inst) && !isa<SelectInst>(inst) && !isa<PHINode>(inst))
+    return false;
+
+  for (unsigned i = 0, e = inst->getNumOperands(); i < e; ++i) {
+    if (!isWellDefined(inst->getOperand(i), depth - 1))
+      return false;
+  }
+  return true;
+}
+
+void OpaquePredicate::getLiveValues(BasicBlock *block, DominatorTree &DT,
+                                    std::vector<Value *> &values) {
+  // Values that may be undef or poison would break the invariant of the
+  // formulas. Terminators are never taken: the result of an invoke is only
+  // defined on its normal edge, not in the landing pads a predicate may be
+  // placed after
+  auto isCandidate = [](Value *value) -> bool {
+    IntegerType *type = dyn_cast<IntegerType>(value->getType());
+    if (!type || type->getBitWidth() < 8)
+      return false;
+    return isWellDefined(value, 4);
+  };
+
+  // Walk up the dominator tree so that the values most likely to still be in
+  // registers come first
+  for (DomTreeNode *node = DT.getNode(block);
+       node && values.size() < opaqueLiveValues; node = node->getIDom()) {
+    BasicBlock *current = node->getBlock();
+    for (BasicBlock::reverse_iterator inst = current->rbegin(),
+                                      instEnd = current->rend();
+         inst != instEnd && values.size() < opaqueLiveValues; ++inst) {
+      if (isCandidate(&*inst))
+        values.push_back(&*inst);
+    }
   }
 
-  // Advance our x and y
-  Value *x1 = advanceGlobal(headBlock, x, randomner);
-  Value *y1 = advanceGlobal(headBlock, y, randomner);
+  Function *F = block->getParent();
+  for (Function::arg_iterator arg = F->arg_begin(), argEnd = F->arg_end();
+       arg != argEnd && values.size() < opaqueLiveValues; ++arg) {
+    if (isCandidate(arg))
+      values.push_back(arg);
+  }
+}
+
+void OpaquePredicate::createTrue(BasicBlock *headBlock, BasicBlock *trueBlock,
+                                 BasicBlock *falseBlock,
+                                 const std::vector<Constant *> &globals,
+                                 const std::vector<Value *> &liveValues,
+                                 OpaquePredicate::Randomner randomner) {
+  Value *x1, *y1;
+  createOperands(headBlock, globals, liveValues, randomner, x1, y1);
 
   Formula formula = getFormula(randomner);
   Value *condition = formula(headBlock, x1, y1, PredicateTrue);
 
   // Branch
-  BranchInst::Create(trueBlock, falseBlock, condition, headBlock);
+  BranchInst *branch =
+      BranchInst::Create(trueBlock, falseBlock, condition, headBlock);
+  setWeights(branch, PredicateTrue);
 }
 
 void OpaquePredicate::createFalse(BasicBlock *headBlock, BasicBlock *trueBlock,
                                   BasicBlock *falseBlock,
-                                  const std::vector<GlobalVariable *> &globals,
+                                  const std::vector<Constant *> &globals,
+                                  const std::vector<Value *> &liveValues,
                                   OpaquePredicate::Randomner randomner) {
-  // Get our x and y
-  GlobalVariable *x = globals[abs(randomner()) % globals.size()];
-  GlobalVariable *y = globals[abs(randomner()) % globals.size()];
-
-  while (x == y) {
-    y = globals[randomner() % globals.size()];
-  }
-
-  // Advance our x and y
-  Value *x1 = advanceGlobal(headBlock, x, randomner);
-  Value *y1 = advanceGlobal(headBlock, y, randomner);
+  Value *x1, *y1;
+  createOperands(headBlock, globals, liveValues, randomner, x1, y1);
 
   Formula formula = getFormula(randomner);
   Value *condition = formula(headBlock, x1, y1, PredicateFalse);
 
   // Branch
-  BranchInst::Create(trueBlock, falseBlock, condition, headBlock);
+  BranchInst *branch =
+      BranchInst::Create(trueBlock, falseBlock, condition, headBlock);
+  setWeights(branch, PredicateFalse);
 }
 
 void OpaquePredicate::createStub(BasicBlock *block, BasicBlock *trueBlock,
@@ -498,6 +1313,11 @@ bool OpaquePredicate::isBasicBlockUnreachable(BasicBlock &block) {
 
     BranchInst *branch = dyn_cast<BranchInst>(predecessor->getTerminator());
     assert(branch && "Predecessor block should have a BranchInst terminator");
+    // Blocks outlined by -opaque-cold are entered from the root block of
+    // their own function
+    if (branch->isUnconditional() &&
+        predecessor == &block.getParent()->getEntryBlock())
+      return true;
     assert(branch->isConditional() &&
            "Branch in predecessor should be conditional");
     // Checks conditions
@@ -579,6 +1399,15 @@ void OpaquePredicate::cleanDebug(BasicBlock &block) {
 StringRef OpaquePredicate::stubName("opaque_stub");
 StringRef OpaquePredicate::unreachableName("opaque_unreachable");
 StringRef OpaquePredicate::unreachableMarkName("opaque_mark");
+StringRef OpaquePredicate::stateName("opaque_state");
+void OpaquePredicate::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<TargetTransformInfo>();
+  if (opaqueSource != memory)
+    AU.addRequired<DominatorTree>();
+  if (opaqueSource == hot)
+    AU.addRequired<StaticHotness>();
+}
+
 char OpaquePredicate::ID = 0;
 static RegisterPass<OpaquePredicate>
     X("opaque-predicate", "Replace stub branch with opaque predicates", false,
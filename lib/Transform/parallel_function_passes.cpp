@@ -0,0 +1,503 @@
+//=== parallel_function_passes.cpp - Run function passes on threads -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// The module is written to bitcode once. Its functions are split into items
+// of about the same number of instructions, a few per thread, and every item
+// is queued on a thread. A thread takes items from the front of its own
+// queue and, when that is empty, steals from the back of the others.
+//
+// For an item, a thread reads the bitcode lazily into its own context. Only
+// the bodies of the functions of the item are read, so the others are
+// declarations to the passes, and a thread holds little more than its item.
+// Each function of the item is then extracted into a module of its own (see
+// function_transfer.h) and written to bitcode. Once all threads are done, the
+// functions are spliced back into the module in their original order, so
+// the result does not depend on which thread transformed what.
+//
+// Passes seed their random streams from the function alone (see
+// random_service.h), and StaticHotness reads the function frequencies of the
+// whole module from metadata, so a function is transformed as it would be
+// on a single thread. Functions that cannot be moved are transformed on the
+// calling thread once the others are done.
+//
+// The passes are grouped the same with a single thread, which transforms the
+// module in place. Either way the globals the passes created are then put in
+// the order the functions use them, local constants that are the same are
+// merged and local globals are named <function>.<name> after the first
+// function using them, so that neither the number of threads nor the items
+// the functions fell into show in the result.
+//
+// Command line options
+// - obfThreads - Threads running function passes. 0 is one per core.
+//                Default 1, i.e. passes are not run in parallel, or one per
+//                core when obfuscating the linked program (c.f. obfLTO)
+
+#define DEBUG_TYPE "parallel-function-passes"
+#include "Transform/parallel_function_passes.h"
+#include "Transform/function_transfer.h"
+#include "Transform/inline_function.h"
+#include "Transform/pass_trace.h"
+#include "Transform/schedule.h"
+#include "Transform/static_hotness.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+static cl::opt<unsigned>
+    obfThreads("obfThreads", cl::init(1),
+               cl::desc("Threads running function passes of the obfuscation "
+                        "in parallel. 0 is one per core. Defaults to 1, or "
+                        "0 with -obfLTO"));
+
+STATISTIC(NumParallel, "Functions transformed on worker threads");
+STATISTIC(NumSerial, "Functions transformed on the calling thread");
+
+namespace {
+// Items per thread. More items balance better but each one reads the globals
+// and declarations of the module
+const unsigned itemsPerThread = 4;
+
+// Functions transformed together in one copy of the module
+struct Item {
+  std::vector<unsigned> functions;
+  unsigned size;
+
+  Item() : size(0) {}
+};
+
+struct WorkQueue {
+  std::mutex mutex;
+  std::deque<unsigned> items;
+};
+
+// Errors reported in the copies, passed on to the context of the module.
+// Every copy checks the same options, so each message is passed on once
+struct ErrorForwarder {
+  std::mutex mutex;
+  LLVMContext *context;
+  std::set<std::string> reported;
+};
+
+void forwardError(const SMDiagnostic &diagnostic, void *context, unsigned) {
+  ErrorForwarder &forwarder = *static_cast<ErrorForwarder *>(context);
+  std::lock_guard<std::mutex> lock(forwarder.mutex);
+  if (forwarder.reported.insert(diagnostic.getMessage()).second)
+    forwarder.context->emitError(diagnostic.getMessage());
+}
+
+unsigned countInstructions(Function &F) {
+  unsigned count = 0;
+  for (auto &block : F) {
+    count += block.size();
+  }
+  return count;
+}
+
+// Largest functions first, each into the item with the fewest instructions
+std::vector<Item> partition(ArrayRef<Function *> functions, unsigned count) {
+  std::vector<unsigned> sizes;
+  std::vector<unsigned> order;
+  for (unsigned i = 0, e = functions.size(); i < e; ++i) {
+    sizes.push_back(countInstructions(*functions[i]));
+    order.push_back(i);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+    return sizes[a] > sizes[b];
+  });
+
+  std::vector<Item> items(std::min<unsigned>(count, functions.size()));
+  for (unsigned index : order) {
+    Item &smallest = *std::min_element(
+        items.begin(), items.end(),
+        [](const Item &a, const Item &b) { return a.size < b.size; });
+    smallest.functions.push_back(index);
+    smallest.size += sizes[index];
+  }
+  std::stable_sort(
+      items.begin(), items.end(),
+      [](const Item &a, const Item &b) { return a.size > b.size; });
+  return items;
+}
+
+// A global created by the passes and the first function using it
+struct CreatedGlobal {
+  GlobalValue *global;
+  Function *user;
+  std::string name;
+};
+
+void collectCreated(Value *V, Function *user,
+                    const std::set<GlobalValue *> &existing,
+                    SmallPtrSet<Value *, 32> &visited,
+                    std::vector<CreatedGlobal> &created);
+
+// Add the globals created by the passes that inst uses
+void collectCreatedUses(Instruction &inst, Function *user,
+                        const std::set<GlobalValue *> &existing,
+                        SmallPtrSet<Value *, 32> &visited,
+                        std::vector<CreatedGlobal> &created) {
+  for (auto op = inst.op_begin(), opEnd = inst.op_end(); op != opEnd; ++op) {
+    collectCreated(*op, user, existing, visited, created);
+  }
+  SmallVector<std::pair<unsigned, MDNode *>, 4> metadata;
+  inst.getAllMetadata(metadata);
+  for (auto &node : metadata) {
+    collectCreated(node.second, user, existing, visited, created);
+  }
+}
+
+// Add the globals created by the passes that V uses, and those they use
+void collectCreated(Value *V, Function *user,
+                    const std::set<GlobalValue *> &existing,
+                    SmallPtrSet<Value *, 32> &visited,
+                    std::vector<CreatedGlobal> &created) {
+  if (!V || !visited.insert(V))
+    return;
+  if (GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
+    if (existing.count(GV) || GV->isDeclaration())
+      return;
+    CreatedGlobal global = { GV, user, GV->getName() };
+    created.push_back(global);
+    if (GlobalVariable *variable = dyn_cast<GlobalVariable>(GV)) {
+      collectCreated(variable->getInitializer(), user, existing, visited,
+                     created);
+    } else if (Function *function = dyn_cast<Function>(GV)) {
+      for (auto &block : *function) {
+        for (auto &inst : block) {
+          collectCreatedUses(inst, user, existing, visited, created);
+        }
+      }
+    }
+  } else if (Constant *C = dyn_cast<Constant>(V)) {
+    for (unsigned i = 0, e = C->getNumOperands(); i < e; ++i) {
+      collectCreated(C->getOperand(i), user, existing, visited, created);
+    }
+  } else if (MDNode *node = dyn_cast<MDNode>(V)) {
+    for (unsigned i = 0, e = node->getNumOperands(); i < e; ++i) {
+      collectCreated(node->getOperand(i), user, existing, visited, created);
+    }
+  }
+}
+
+// Name as given by the pass, without the number added to make it unique
+StringRef getBaseName(StringRef name) {
+  size_t end = name.size();
+  while (end > 0 && isdigit(name[end - 1]))
+    --end;
+  return end ? name.substr(0, end) : name;
+}
+
+// Check if a and b are local constants that can be one global
+bool isMergeable(GlobalVariable *a, GlobalVariable *b) {
+  return a->isConstant() && b->isConstant() && a->hasLocalLinkage() &&
+         a->getLinkage() == b->getLinkage() && a->getType() == b->getType() &&
+         a->getInitializer() == b->getInitializer() &&
+         a->getAlignment() == b->getAlignment() &&
+         a->getSection() == b->getSection() &&
+         a->getThreadLocalMode() == b->getThreadLocalMode() &&
+         a->hasUnnamedAddr() == b->hasUnnamedAddr() &&
+         getBaseName(a->getName()) == getBaseName(b->getName());
+}
+
+// Order, merge and name the globals created by the passes the same whether
+// they were created in place or spliced in from copies of the module
+void normalizeCreated(Module &M, const std::set<GlobalValue *> &existing) {
+  std::vector<CreatedGlobal> created;
+  SmallPtrSet<Value *, 32> visited;
+  for (auto &F : M) {
+    if (!existing.count(&F))
+      continue;
+    for (auto &block : F) {
+      for (auto &inst : block) {
+        collectCreatedUses(inst, &F, existing, visited, created);
+      }
+    }
+  }
+
+  std::vector<CreatedGlobal> kept;
+  std::map<Constant *, std::vector<GlobalVariable *> > constants;
+  for (auto &global : created) {
+    GlobalVariable *variable = dyn_cast<GlobalVariable>(global.global);
+    if (variable && variable->isConstant()) {
+      std::vector<GlobalVariable *> &same =
+          constants[variable->getInitializer()];
+      auto first =
+          std::find_if(same.begin(), same.end(), [&](GlobalVariable *other) {
+            return isMergeable(other, variable);
+          });
+      if (first != same.end()) {
+        variable->replaceAllUsesWith(*first);
+        variable->eraseFromParent();
+        continue;
+      }
+      same.push_back(variable);
+    }
+    kept.push_back(global);
+  }
+
+  // Names are taken off first so that every global gets its own
+  for (auto &global : kept) {
+    if (global.global->hasLocalLinkage())
+      global.global->setName("");
+  }
+  for (auto &global : kept) {
+    GlobalValue *GV = global.global;
+    if (GlobalVariable *variable = dyn_cast<GlobalVariable>(GV)) {
+      variable->removeFromParent();
+      M.getGlobalList().push_back(variable);
+    } else if (Function *function = dyn_cast<Function>(GV)) {
+      function->removeFromParent();
+      M.getFunctionList().push_back(function);
+    }
+    if (GV->hasLocalLinkage() && !global.name.empty())
+      GV->setName(global.user->getName() + "." +
+                  getBaseName(global.name));
+  }
+}
+
+bool takeItem(std::vector<WorkQueue> &queues, unsigned self, unsigned &item) {
+  for (unsigned i = 0, e = queues.size(); i < e; ++i) {
+    WorkQueue &queue = queues[(self + i) % e];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.items.empty())
+      continue;
+    if (i == 0) {
+      item = queue.items.front();
+      queue.items.pop_front();
+    } else {
+      item = queue.items.back();
+      queue.items.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+}
+
+bool ParallelFunctionPasses::isFunctionLocal(Pass *pass) {
+  switch (pass->getPassKind()) {
+  case PT_Function:
+    // Inlining looks into the callees
+    return pass->getPassID() != &InlineFunctionPass::ID;
+  case PT_Loop:
+  case PT_BasicBlock:
+    return true;
+  default:
+    return false;
+  }
+}
+
+unsigned ParallelFunctionPasses::getThreads() {
+  // The linked program is one large module on an otherwise idle machine
+  bool linkTime =
+      ObfuscationSchedule::isLinkTime() && !obfThreads.getNumOccurrences();
+  if (obfThreads == 0 || linkTime)
+    return std::max(std::thread::hardware_concurrency(), 1u);
+  return obfThreads;
+}
+
+void ParallelFunctionPasses::runPasses(Module &M) const {
+  PassManager PM;
+  if (!M.getDataLayout().empty())
+    PM.add(new DataLayout(&M));
+  PassRegistry *registry = PassRegistry::getPassRegistry();
+  for (AnalysisID pass : passes) {
+    PM.add(registry->getPassInfo(pass)->createPass());
+  }
+  PM.run(M);
+}
+
+bool ParallelFunctionPasses::runOnModule(Module &M) {
+  PassTrace::ModuleScope trace(this, M);
+  unsigned threads = getThreads();
+  if (threads > 1 && !llvm_is_multithreaded() && !llvm_start_multithreaded()) {
+    DEBUG(errs() << "ParallelFunctionPasses: LLVM is built without threads\n");
+    threads = 1;
+  }
+
+  if (StaticHotness::isEnabled())
+    getAnalysis<StaticHotness>().exportFunctionFrequencies(M);
+
+  std::set<GlobalValue *> existing;
+  for (auto &GV : M.getGlobalList()) {
+    existing.insert(&GV);
+  }
+  for (auto &F : M) {
+    existing.insert(&F);
+  }
+  for (auto &alias : M.getAliasList()) {
+    existing.insert(&alias);
+  }
+
+  std::vector<Function *> functions;
+  std::vector<std::string> names;
+  if (threads > 1) {
+    for (auto &F : M) {
+      if (F.isDeclaration() || !FunctionTransfer::isTransferable(F))
+        continue;
+      functions.push_back(&F);
+      names.push_back(F.getName());
+    }
+  }
+
+  // Transformed functions as bitcode, empty if a thread failed
+  std::vector<std::string> results(functions.size());
+  if (!functions.empty()) {
+    std::string bitcode;
+    raw_string_ostream stream(bitcode);
+    WriteBitcodeToFile(&M, stream);
+    stream.flush();
+
+    std::vector<Item> items = partition(functions, threads * itemsPerThread);
+    std::vector<WorkQueue> queues(threads);
+    for (unsigned i = 0, e = items.size(); i < e; ++i) {
+      queues[i % threads].items.push_back(i);
+    }
+    DEBUG(errs() << "ParallelFunctionPasses: " << functions.size()
+                 << " functions in " << items.size() << " items on "
+                 << threads << " threads\n");
+
+    ErrorForwarder forwarder;
+    forwarder.context = &M.getContext();
+    auto runItem = [&](const Item &item) {
+      LLVMContext context;
+      context.setInlineAsmDiagnosticHandler(forwardError, &forwarder);
+      OwningPtr<MemoryBuffer> buffer(
+          MemoryBuffer::getMemBuffer(bitcode, "", false));
+      std::string error;
+      OwningPtr<Module> copy(
+          getLazyBitcodeModule(buffer.get(), context, &error));
+      if (!copy) {
+        DEBUG(errs() << "ParallelFunctionPasses: " << error << "\n");
+        return;
+      }
+      // The copy reads bodies from the buffer from now on
+      buffer.take();
+
+      // Only the bodies of the item are read, the other functions are
+      // declarations to the passes
+      for (unsigned index : item.functions) {
+        Function *F = copy->getFunction(names[index]);
+        if (F && F->isMaterializable() && F->Materialize(&error)) {
+          DEBUG(errs() << "ParallelFunctionPasses: " << error << "\n");
+          return;
+        }
+      }
+
+      FunctionTransfer::GlobalsByName globals;
+      FunctionTransfer::recordGlobals(*copy, globals);
+
+      runPasses(*copy);
+
+      FunctionTransfer::NamesOfGlobals originals;
+      FunctionTransfer::getNames(globals, originals);
+      for (unsigned index : item.functions) {
+        Function *F = copy->getFunction(names[index]);
+        if (!F || F->isDeclaration())
+          continue;
+        Module result(names[index], context);
+        result.setTargetTriple(copy->getTargetTriple());
+        result.setDataLayout(copy->getDataLayout());
+        if (!FunctionTransfer::extract(*F, names[index], originals, result))
+          continue;
+        raw_string_ostream resultStream(results[index]);
+        WriteBitcodeToFile(&result, resultStream);
+      }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned self = 0; self < threads; ++self) {
+      workers.push_back(std::thread([&, self]() {
+        unsigned item;
+        while (takeItem(queues, self, item)) {
+          runItem(items[item]);
+        }
+      }));
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  // Functions that were transformed are declarations while the others are
+  // transformed here
+  std::vector<GlobalValue::LinkageTypes> linkages;
+  for (unsigned i = 0, e = functions.size(); i < e; ++i) {
+    linkages.push_back(functions[i]->getLinkage());
+    if (!results[i].empty())
+      functions[i]->deleteBody();
+  }
+
+  unsigned remaining = 0;
+  for (auto &F : M) {
+    if (!F.isDeclaration())
+      ++remaining;
+  }
+  if (remaining) {
+    runPasses(M);
+    NumSerial += remaining;
+  }
+
+  FunctionTransfer::GlobalsByName globals;
+  FunctionTransfer::recordGlobals(M, globals);
+  FunctionTransfer::TypeMapper types(M);
+  for (unsigned i = 0, e = functions.size(); i < e; ++i) {
+    if (results[i].empty())
+      continue;
+    OwningPtr<MemoryBuffer> buffer(
+        MemoryBuffer::getMemBuffer(results[i], "", false));
+    std::string error;
+    OwningPtr<Module> result(
+        ParseBitcodeFile(buffer.get(), M.getContext(), &error));
+    if (!result) {
+      M.getContext().emitError("ParallelFunctionPasses: Unable to read " +
+                               names[i] + ": " + error);
+      continue;
+    }
+    FunctionTransfer::splice(*functions[i], names[i], *result, globals,
+                             types);
+    functions[i]->setLinkage(linkages[i]);
+    ++NumParallel;
+  }
+  normalizeCreated(M, existing);
+
+  StaticHotness::removeExportedFrequencies(M);
+  return true;
+}
+
+void ParallelFunctionPasses::getAnalysisUsage(AnalysisUsage &AU) const {
+  if (StaticHotness::isEnabled())
+    AU.addRequired<StaticHotness>();
+}
+
+char ParallelFunctionPasses::ID = 0;
+static RegisterPass<ParallelFunctionPasses>
+    X("parallel-function-passes",
+      "Run function passes on several threads, each with a copy of the module",
+      false, false);
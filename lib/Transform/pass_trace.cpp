@@ -0,0 +1,346 @@
+//=== pass_trace.cpp - Time passes and the growth of functions ------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Every scope that closes adds an event: the pass, the function or the
+// module, the thread, when it started and how long it took in microseconds,
+// and the instructions, blocks, allocas and PHI nodes before and after.
+// Events of all threads are kept in memory until they are flushed, which
+// appends them to the files and forgets them. The process flushes them when
+// it exits, and a tool that runs for long, such as llvm-obfuscate -serve,
+// after every module. The files are truncated by the first flush.
+//
+// The trace holds every event in the JSON array format of Chrome trace
+// events, to be opened in chrome://tracing or Perfetto. The closing bracket
+// of the array is left out, as the format allows, so that later flushes can
+// append to it. Each thread, such as those of ParallelFunctionPasses, is a
+// track of its own. The summary adds up the events of each pass and function
+// since the previous flush, most expensive first, with the columns
+//   pass, function, calls, microseconds, instructions before, instructions
+//   after, blocks before, blocks after, allocas created, PHIs demoted
+// before being the sizes at the first call and after those at the last.
+// Allocas created and PHIs demoted are the sums of the increase in allocas and
+// the decrease in PHI nodes over the calls. Module events have no function.
+//
+// Command line options
+// - obfTrace - File the trace is written to. Defaults to none
+// - obfTraceSummary - File the summary is written to, as CSV. Defaults to
+//                     none
+// %p in either name is replaced by the process id, so that compilations that
+// run at the same time do not write the same file.
+
+#include "Transform/pass_trace.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static cl::opt<std::string>
+    obfTrace("obfTrace", cl::init(""), cl::value_desc("filename"),
+             cl::desc("Write the time every obfuscation pass takes on every "
+                      "function as a Chrome trace. %p is the process id"));
+
+static cl::opt<std::string> obfTraceSummary(
+    "obfTraceSummary", cl::init(""), cl::value_desc("filename"),
+    cl::desc("Write the time and growth of every pass and function as CSV. "
+             "%p is the process id"));
+
+namespace {
+struct Event {
+  std::string pass;
+  // Empty for a module event
+  std::string function;
+  std::string module;
+  unsigned thread;
+  uint64_t start;
+  uint64_t duration;
+  PassTrace::Counts before;
+  PassTrace::Counts after;
+};
+
+// Events of a pass on a function added up
+struct Summary {
+  std::string pass;
+  std::string function;
+  unsigned calls;
+  uint64_t duration;
+  PassTrace::Counts before;
+  PassTrace::Counts after;
+  uint64_t allocasCreated;
+  uint64_t phisDemoted;
+
+  Summary() : calls(0), duration(0), allocasCreated(0), phisDemoted(0) {}
+};
+
+std::string getFilename(StringRef pattern) {
+  std::string filename;
+  for (unsigned i = 0, e = pattern.size(); i < e; ++i) {
+    if (pattern[i] == '%' && i + 1 < e && pattern[i + 1] == 'p') {
+      filename += utostr(getpid());
+      ++i;
+    } else {
+      filename += pattern[i];
+    }
+  }
+  return filename;
+}
+
+void writeJSONString(raw_ostream &out, StringRef string) {
+  out << '"';
+  for (unsigned char c : string) {
+    if (c == '"' || c == '\\')
+      out << '\\' << c;
+    else if (c < 0x20)
+      out << format("\\u%04x", c);
+    else
+      out << c;
+  }
+  out << '"';
+}
+
+void writeCSVString(raw_ostream &out, StringRef string) {
+  if (string.find_first_of(",\"\n") == StringRef::npos) {
+    out << string;
+    return;
+  }
+  out << '"';
+  for (char c : string) {
+    if (c == '"')
+      out << '"';
+    out << c;
+  }
+  out << '"';
+}
+
+void writeCounts(raw_ostream &out, StringRef name,
+                 const PassTrace::Counts &counts) {
+  out << "\"" << name << "Instructions\":" << counts.instructions << ",\""
+      << name << "Blocks\":" << counts.blocks << ",\"" << name
+      << "Allocas\":" << counts.allocas << ",\"" << name
+      << "PHIs\":" << counts.phis;
+}
+
+struct Trace {
+  std::mutex mutex;
+  std::chrono::steady_clock::time_point epoch;
+  std::map<std::thread::id, unsigned> threads;
+  std::vector<Event> events;
+  // Whether the files were started by a flush
+  bool flushed;
+
+  Trace() : epoch(std::chrono::steady_clock::now()), flushed(false) {}
+  ~Trace() { flush(); }
+
+  // Microseconds since the trace was first used
+  uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - epoch).count();
+  }
+
+  void add(Event &event) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto thread = threads.insert(
+        std::make_pair(std::this_thread::get_id(), threads.size()));
+    event.thread = thread.first->second;
+    events.push_back(std::move(event));
+  }
+
+  void flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (flushed && events.empty())
+      return;
+    if (!obfTrace.empty())
+      writeTrace(getFilename(obfTrace));
+    if (!obfTraceSummary.empty())
+      writeSummary(getFilename(obfTraceSummary));
+    events.clear();
+    flushed = true;
+  }
+
+  void writeTrace(const std::string &filename) {
+    std::string error;
+    raw_fd_ostream out(filename.c_str(), error,
+                       flushed ? sys::fs::F_Append : sys::fs::F_None);
+    if (!error.empty()) {
+      errs() << "WARNING: PassTrace: Unable to write " << filename << ": "
+             << error << "\n";
+      return;
+    }
+
+    if (!flushed)
+      out << "[\n";
+    for (const Event &event : events) {
+      out << "{\"name\":";
+      writeJSONString(out, event.pass);
+      out << ",\"cat\":\"" << (event.function.empty() ? "module" : "function")
+          << "\",\"ph\":\"X\",\"ts\":" << event.start
+          << ",\"dur\":" << event.duration << ",\"pid\":" << getpid()
+          << ",\"tid\":" << event.thread << ",\"args\":{\"module\":";
+      writeJSONString(out, event.module);
+      if (!event.function.empty()) {
+        out << ",\"function\":";
+        writeJSONString(out, event.function);
+      }
+      out << ",";
+      writeCounts(out, "before", event.before);
+      out << ",";
+      writeCounts(out, "after", event.after);
+      out << "}},\n";
+    }
+  }
+
+  void writeSummary(const std::string &filename) {
+    std::map<std::pair<std::string, std::string>, Summary> summaries;
+    for (const Event &event : events) {
+      Summary &summary =
+          summaries[std::make_pair(event.pass, event.function)];
+      if (!summary.calls) {
+        summary.pass = event.pass;
+        summary.function = event.function;
+        summary.before = event.before;
+      }
+      ++summary.calls;
+      summary.duration += event.duration;
+      summary.after = event.after;
+      if (event.after.allocas > event.before.allocas)
+        summary.allocasCreated += event.after.allocas - event.before.allocas;
+      if (event.before.phis > event.after.phis)
+        summary.phisDemoted += event.before.phis - event.after.phis;
+    }
+
+    std::vector<const Summary *> sorted;
+    for (const auto &summary : summaries) {
+      sorted.push_back(&summary.second);
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const Summary *a, const Summary *b) {
+      return a->duration > b->duration;
+    });
+
+    std::string error;
+    raw_fd_ostream out(filename.c_str(), error,
+                       flushed ? sys::fs::F_Append : sys::fs::F_None);
+    if (!error.empty()) {
+      errs() << "WARNING: PassTrace: Unable to write " << filename << ": "
+             << error << "\n";
+      return;
+    }
+
+    if (!flushed)
+      out << "pass,function,calls,microseconds,instructions_before,"
+             "instructions_after,blocks_before,blocks_after,allocas_created,"
+             "phis_demoted\n";
+    for (const Summary *summary : sorted) {
+      writeCSVString(out, summary->pass);
+      out << ",";
+      writeCSVString(out, summary->function);
+      out << "," << summary->calls << "," << summary->duration << ","
+          << summary->before.instructions << ","
+          << summary->after.instructions << "," << summary->before.blocks
+          << "," << summary->after.blocks << "," << summary->allocasCreated
+          << "," << summary->phisDemoted << "\n";
+    }
+  }
+};
+
+Trace &getTrace() {
+  static Trace trace;
+  return trace;
+}
+
+// The argument the pass is registered under, such as boguscf
+std::string getPassName(Pass *pass) {
+  const PassInfo *info =
+      PassRegistry::getPassRegistry()->getPassInfo(pass->getPassID());
+  if (info && info->getPassArgument()[0])
+    return info->getPassArgument();
+  return pass->getPassName();
+}
+};
+
+namespace PassTrace {
+void Counts::add(Function &F) {
+  for (auto &block : F) {
+    ++blocks;
+    for (auto &inst : block) {
+      ++instructions;
+      if (isa<AllocaInst>(inst))
+        ++allocas;
+      else if (isa<PHINode>(inst))
+        ++phis;
+    }
+  }
+}
+
+bool isEnabled() { return !obfTrace.empty() || !obfTraceSummary.empty(); }
+
+void flush() {
+  if (isEnabled())
+    getTrace().flush();
+}
+
+FunctionScope::FunctionScope(Pass *pass, Function &F)
+    : pass(nullptr), F(&F), start(0) {
+  if (!isEnabled())
+    return;
+  this->pass = pass;
+  name = F.getName();
+  before.add(F);
+  start = getTrace().now();
+}
+
+FunctionScope::~FunctionScope() {
+  if (!pass)
+    return;
+  Event event;
+  event.start = start;
+  event.duration = getTrace().now() - start;
+  event.pass = getPassName(pass);
+  event.function = name;
+  event.module = F->getParent()->getModuleIdentifier();
+  event.before = before;
+  event.after.add(*F);
+  getTrace().add(event);
+}
+
+ModuleScope::ModuleScope(Pass *pass, Module &M)
+    : pass(nullptr), M(&M), start(0) {
+  if (!isEnabled())
+    return;
+  this->pass = pass;
+  for (auto &F : M) {
+    before.add(F);
+  }
+  start = getTrace().now();
+}
+
+ModuleScope::~ModuleScope() {
+  if (!pass)
+    return;
+  Event event;
+  event.start = start;
+  event.duration = getTrace().now() - start;
+  event.pass = getPassName(pass);
+  event.module = M->getModuleIdentifier();
+  event.before = before;
+  for (auto &F : *M) {
+    event.after.add(F);
+  }
+  getTrace().add(event);
+}
+};
@@ -0,0 +1,234 @@
+//=== profile_hotness.cpp - Profile guided hotness queries -----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Function entry counts are read from a profile file. Counts of individual
+// blocks are then estimated by scaling the entry count with BlockFrequencyInfo,
+// which picks up the branch weights that the frontend attaches when compiling
+// with -fprofile-instr-use or -fprofile-sample-use.
+//
+// Two text formats are understood:
+// - instr: llvm-profdata text format. Binary .profdata files can be converted
+//   with llvm-profdata merge -text. Each record is
+//     function_name
+//     function_hash
+//     number_of_counters
+//     counter0 (function entry count)
+//     counter1
+//     ...
+//   Lines starting with # are comments.
+// - sample: Text sample profiles as produced from perf data by
+//   create_llvm_prof, and read by -sample-profile
+//     function_name:total_samples:head_samples
+//      offset[.discriminator]: samples [callee:samples ...]
+//
+// Command line options
+// - obfProfile - Profile to read. Defaults to none, i.e. profile is not used
+// - obfProfileFormat - Format of the profile. Defaults to instr
+// - obfHotPercentile - Counts at or above this percentile of all counts in
+//                      the profile are hot. Default 0.9
+// - obfHotScale - Probabilities of transforming hot code are multiplied by
+//                 this. Default 0, i.e. hot code is excluded
+
+#define DEBUG_TYPE "profile"
+#include "Transform/profile_hotness.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+enum ProfileFormat {
+  instr,
+  sample
+};
+
+static cl::opt<std::string> obfProfile(
+    "obfProfile", cl::init(""),
+    cl::desc("Profile used to avoid obfuscating hot code. Defaults to none"));
+
+static cl::opt<ProfileFormat> obfProfileFormat(
+    "obfProfileFormat", cl::init(instr),
+    cl::desc("Format of the profile given with obfProfile"),
+    cl::values(clEnumVal(instr, "llvm-profdata text format (instrumented)"),
+               clEnumVal(sample, "Text sample profile (sampled)"),
+               clEnumValEnd));
+
+static cl::opt<double> obfHotPercentile(
+    "obfHotPercentile", cl::init(0.9),
+    cl::desc("Percentile of profile counts above which code is hot"));
+
+static cl::opt<double> obfHotScale(
+    "obfHotScale", cl::init(0.0),
+    cl::desc("Factor applied to the probability of transforming hot code. "
+             "Defaults to 0 which excludes hot code"));
+
+namespace {
+struct Profile {
+  bool loaded;
+  uint64_t threshold;
+  StringMap<uint64_t> entryCounts;
+  // The profile is read once per process, so errors are kept to be reported
+  // on the context of each module, c.f. checkProfile
+  std::vector<std::string> errors;
+
+  Profile() : loaded(false), threshold(0) {
+    if (obfProfile.empty())
+      return;
+
+    if (obfHotPercentile < 0.f || obfHotPercentile > 1.f)
+      errors.push_back("Profile: Percentile must be between 0 and 1");
+    if (obfHotScale < 0.f || obfHotScale > 1.f)
+      errors.push_back("Profile: Hot scale must be between 0 and 1");
+    if (!errors.empty())
+      return;
+
+    std::ifstream file(obfProfile.c_str());
+    if (!file.good()) {
+      errors.push_back("Profile: Unable to read profile " + obfProfile);
+      return;
+    }
+
+    // All counts seen so that the percentile can be worked out
+    std::vector<uint64_t> counts;
+    if (obfProfileFormat == instr)
+      readInstr(file, counts);
+    else
+      readSample(file, counts);
+
+    DEBUG(errs() << "Profile: " << entryCounts.size() << " functions and "
+                 << counts.size() << " counts read\n");
+    if (counts.empty())
+      return;
+
+    std::sort(counts.begin(), counts.end());
+    unsigned index = obfHotPercentile * (counts.size() - 1);
+    threshold = std::max<uint64_t>(counts[index], 1);
+    loaded = true;
+    DEBUG(errs() << "Profile: Hot threshold is " << threshold << "\n");
+  }
+
+  // Next line of a record, skipping blank lines, comments such as
+  // "# Func Hash:" and the kind of profile such as ":ir"
+  bool getRecordLine(std::ifstream &file, std::string &line) {
+    while (std::getline(file, line)) {
+      StringRef ref = StringRef(line).trim();
+      if (!ref.empty() && ref[0] != '#' && ref[0] != ':')
+        return true;
+    }
+    return false;
+  }
+
+  void readInstr(std::ifstream &file, std::vector<uint64_t> &counts) {
+    std::string name, line;
+    while (getRecordLine(file, name)) {
+      // The hash is not checked
+      uint64_t numCounters;
+      if (!getRecordLine(file, line) || !getRecordLine(file, line) ||
+          StringRef(line).trim().getAsInteger(10, numCounters))
+        return;
+      for (uint64_t i = 0; i < numCounters; ++i) {
+        uint64_t count;
+        if (!getRecordLine(file, line) ||
+            StringRef(line).trim().getAsInteger(10, count))
+          return;
+        if (i == 0)
+          entryCounts[StringRef(name).trim()] = count;
+        if (count)
+          counts.push_back(count);
+      }
+    }
+  }
+
+  void readSample(std::ifstream &file, std::vector<uint64_t> &counts) {
+    std::string line;
+    while (std::getline(file, line)) {
+      StringRef ref(line);
+      if (ref.trim().empty())
+        continue;
+
+      uint64_t count;
+      if (ref[0] != ' ' && ref[0] != '\t') {
+        // Function header
+        std::pair<StringRef, StringRef> name = ref.rsplit(':');
+        if (name.second.trim().getAsInteger(10, count))
+          continue;
+        entryCounts[name.first.rsplit(':').first] = count;
+      } else {
+        // Body line: offset: samples [calls]
+        StringRef samples = ref.split(':').second.trim();
+        if (samples.split(' ').first.getAsInteger(10, count))
+          continue;
+      }
+      if (count)
+        counts.push_back(count);
+    }
+  }
+};
+
+Profile &getProfile() {
+  static Profile profile;
+  return profile;
+}
+};
+
+namespace ProfileHotness {
+bool hasProfile() { return getProfile().loaded; }
+
+bool checkProfile(LLVMContext &context) {
+  const std::vector<std::string> &errors = getProfile().errors;
+  for (const std::string &error : errors) {
+    context.emitError(error);
+  }
+  return errors.empty();
+}
+
+uint64_t getEntryCount(Function &F) {
+  Profile &profile = getProfile();
+  StringMap<uint64_t>::iterator it = profile.entryCounts.find(F.getName());
+  if (it == profile.entryCounts.end())
+    return 0;
+  return it->getValue();
+}
+
+uint64_t getBlockCount(BasicBlock &BB, BlockFrequencyInfo &BFI) {
+  uint64_t entryCount = getEntryCount(*BB.getParent());
+  if (!entryCount)
+    return 0;
+  uint64_t entryFreq =
+      BFI.getBlockFreq(&BB.getParent()->getEntryBlock()).getFrequency();
+  if (!entryFreq)
+    return entryCount;
+  uint64_t blockFreq = BFI.getBlockFreq(&BB).getFrequency();
+  return (double)entryCount * blockFreq / entryFreq;
+}
+
+uint64_t getMaxBlockCount(Function &F, BlockFrequencyInfo &BFI) {
+  uint64_t maxCount = 0;
+  for (auto &block : F) {
+    maxCount = std::max(maxCount, getBlockCount(block, BFI));
+  }
+  return maxCount;
+}
+
+uint64_t getHotThreshold() { return getProfile().threshold; }
+
+bool isHot(uint64_t count) {
+  return hasProfile() && count >= getHotThreshold();
+}
+
+double scaleProbability(double probability, uint64_t count) {
+  if (!isHot(count))
+    return probability;
+  return probability * obfHotScale;
+}
+};
@@ -0,0 +1,71 @@
+//=== random_service.cpp - Reproducible random streams --------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Every pass reseeds its engine for each function it transforms from the
+// seed, the name of the pass and the name of the function, hashed together by
+// std::seed_seq. Skipping, reordering or obfuscating other functions, in the
+// same pass or in earlier ones, then leaves the result for a function
+// unchanged.
+//
+// std::seed_seq and std::mt19937_64 are fully specified by the standard, but
+// the distributions drawing from them are not: results are reproducible
+// across builds that use the same standard library.
+//
+// Command line options
+// - obfSeed - Master seed of every pass. The seed option of a pass (bcfSeed,
+//             flattenSeed, ...) takes its place for that pass. Defaults to
+//             the system time, taken once per process
+
+#define DEBUG_TYPE "random-service"
+#include "Transform/random_service.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+static cl::opt<std::string> obfSeed(
+    "obfSeed", cl::init(""),
+    cl::desc("Master seed of the random number generators of all passes. "
+             "Defaults to system time"));
+
+namespace RandomService {
+StringRef getMasterSeed() {
+  if (!obfSeed.empty())
+    return obfSeed;
+  static const std::string clockSeed =
+      utostr(std::chrono::system_clock::now().time_since_epoch().count());
+  return clockSeed;
+}
+
+bool hasMasterSeed() { return !obfSeed.empty(); }
+
+void seed(std::mt19937_64 &engine, StringRef pass, StringRef passSeed,
+          const Function &F) {
+  StringRef master = passSeed.empty() ? getMasterSeed() : passSeed;
+  StringRef name = F.getName();
+
+  // The three strings, each terminated by a zero
+  std::vector<uint32_t> key;
+  key.reserve(master.size() + pass.size() + name.size() + 3);
+  for (StringRef part : { master, pass, name }) {
+    for (char c : part) {
+      key.push_back((unsigned char)c);
+    }
+    key.push_back(0);
+  }
+
+  DEBUG(errs() << "RandomService: Seeding " << pass << " for " << name
+               << "\n");
+  std::seed_seq sequence(key.begin(), key.end());
+  engine.seed(sequence);
+}
+}
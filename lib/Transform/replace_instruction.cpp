@@ -9,6 +9,8 @@
 #define DEBUG_TYPE "replace-instruction"
 #include "Transform/replace_instruction.h"
 #include "Transform/opaque_predicate.h"
+#include "Transform/pass_trace.h"
+#include "Transform/random_service.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Module.h"
@@ -22,14 +24,13 @@
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include <algorithm>
 #include <random>
-#include <chrono>
 #include <climits>
 #include <utility>
 #include <vector>
 
 static cl::opt<std::string> replaceSeed(
     "replaceSeed", cl::init(""),
-    cl::desc("Seed for random number generator. Defaults to system time"));
+    cl::desc("Seed for random number generator. Defaults to obfSeed"));
 
 static cl::opt<bool>
     disableReplaceInst("disableReplaceInst", cl::init(false),
@@ -71,6 +72,18 @@ static unsigned floatCompare[floatCompareSize] = {
 };
 }
 
+bool ReplaceInstruction::doInitialization(Function &F) {
+  // Blocks are visited in order, so one stream per function is enough
+  RandomService::seed(engine, "replace-instruction", replaceSeed, F);
+  trace.reset(new PassTrace::FunctionScope(this, F));
+  return false;
+}
+
+bool ReplaceInstruction::doFinalization(Function &F) {
+  trace.reset();
+  return false;
+}
+
 bool ReplaceInstruction::runOnBasicBlock(BasicBlock &block) {
   if (disableReplaceInst)
     return false;
@@ -82,16 +95,7 @@ bool ReplaceInstruction::runOnBasicBlock(BasicBlock &block) {
   DEBUG(errs() << "Unreachable Block: " << block.getName() << "\n");
   ++NumUnreachableBlocks;
 
-  std::mt19937_64 engine;
   std::uniform_int_distribution<int64_t> distribution;
-  // Seed engine and create distribution
-  if (!replaceSeed.empty()) {
-    std::seed_seq seed(replaceSeed.begin(), replaceSeed.end());
-    engine.seed(seed);
-  } else {
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    engine.seed(seed);
-  }
 
   bool hasBeenModified = false;
 
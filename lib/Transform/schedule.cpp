@@ -6,6 +6,12 @@
 // License. See LICENSE.TXT for details.
 //
 //===----------------------------------------------------------------------===//
+// Command line options
+// - obfLTO - Do not obfuscate translation units but the linked program, by
+//            running the obfuscate pass on it after linking. The whole
+//            program is visible to Copy and InlineFunction and gets one set
+//            of opaque predicate globals. Default false
+#include "Transform/schedule.h"
 #include "Transform/boguscf.h"
 #include "Transform/cleanup.h"
 #include "Transform/copy.h"
@@ -15,10 +21,16 @@
 #include "Transform/loop_boguscf.h"
 #include "Transform/opaque_predicate.h"
 #include "Transform/metrics.h"
+#include "Transform/obfuscation_cache.h"
+#include "Transform/parallel_function_passes.h"
+#include "Transform/pass_trace.h"
 #include "Transform/replace_instruction.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/LinkAllPasses.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Support/CommandLine.h"
+#include <algorithm>
+#include <string>
 #include <vector>
 
 using namespace llvm;
@@ -32,6 +44,11 @@ static cl::opt<bool> trivialObfuscation(
     cl::desc(
         "Only scheudle trivial obfuscation passes that do not modify the CFG"));
 
+static cl::opt<bool>
+    obfLTO("obfLTO", cl::init(false),
+           cl::desc("Obfuscate the linked program instead of every "
+                    "translation unit"));
+
 static cl::opt<bool>
     scheduleMetrics("schedule-metrics", cl::init(false),
                   cl::desc("Schedule Metrics Passes"));
@@ -101,6 +118,11 @@ std::vector<Pass *> getPasses() {
         passes.push_back(new ReplaceInstruction());
         break;
       case flattenPass:
+        // Values have to be in registers for Flatten to carry them in SSA
+        // form. Every other pass is followed by mem2reg already
+        if (Flatten::carriesSSA() &&
+            passes.back()->getPassID() == &DemoteRegisterToMemoryID)
+          passes.push_back(createPromoteMemoryToRegisterPass());
         passes.push_back(new Flatten());
         break;
       case cleanupPass:
@@ -143,6 +165,9 @@ std::vector<Pass *> getPasses() {
     passes.push_back(new ReplaceInstruction());
 
     // Flatten the control flow
+    // Values have to be in registers for Flatten to carry them in SSA form
+    if (Flatten::carriesSSA())
+      passes.push_back(createPromoteMemoryToRegisterPass());
     passes.push_back(new Flatten());
 
     // Clean ups
@@ -158,19 +183,79 @@ std::vector<Pass *> getPasses() {
 
   return passes;
 }
+
+// Look functions up in the cache before the passes, and splice them in before
+// identifiers are removed so that the renamer treats them like the others.
+// Copy and InlineFunction look into other functions than the one they
+// transform, so functions are only looked up once those have run, and a
+// cached function still has its body while they run, as without the cache
+void addCache(std::vector<Pass *> &passes) {
+  std::string pipeline;
+  for (Pass *pass : passes) {
+    pipeline += pass->getPassName();
+    pipeline += '\n';
+  }
+
+  auto store = std::find_if(passes.begin(), passes.end(), [](Pass *pass) {
+    return pass->getPassID() == &IdentifierRenamer::ID;
+  });
+  store = passes.insert(store, new ObfuscationCacheStore());
+  auto lookup = passes.begin();
+  for (auto pass = passes.begin(); pass != store; ++pass) {
+    AnalysisID id = (*pass)->getPassID();
+    if (id == &Copy::ID || id == &InlineFunctionPass::ID)
+      lookup = pass + 1;
+  }
+  passes.insert(lookup, new ObfuscationCacheLookup(pipeline));
 }
 
-  // Schedue the passes
-  // http://homes.cs.washington.edu/~bholt/posts/llvm-quick-tricks.html
-static RegisterStandardPasses Y(PassManagerBuilder::EP_OptimizerLast,
-                                [](const PassManagerBuilder &,
-                                   PassManagerBase &PM) {
+// Passes worth the copies of the module made to run them in parallel
+bool isParallelWorthy(Pass *pass) {
+  AnalysisID id = pass->getPassID();
+  return id == &BogusCF::ID || id == &LoopBogusCF::ID ||
+         id == &ReplaceInstruction::ID || id == &Flatten::ID;
+}
 
-  if (noObfSchedule) {
-    return;
+// Run runs of function local passes that contain an obfuscation on several
+// threads. The other passes stay on the calling thread
+void addParallel(std::vector<Pass *> &passes) {
+  std::vector<Pass *> scheduled;
+  std::vector<Pass *> local;
+  auto flush = [&]() {
+    if (std::any_of(local.begin(), local.end(), isParallelWorthy)) {
+      std::vector<AnalysisID> ids;
+      for (Pass *pass : local) {
+        ids.push_back(pass->getPassID());
+        delete pass;
+      }
+      scheduled.push_back(new ParallelFunctionPasses(ids));
+    } else {
+      scheduled.insert(scheduled.end(), local.begin(), local.end());
+    }
+    local.clear();
+  };
+
+  for (Pass *pass : passes) {
+    if (ParallelFunctionPasses::isFunctionLocal(pass)) {
+      local.push_back(pass);
+    } else {
+      flush();
+      scheduled.push_back(pass);
+    }
   }
+  flush();
+  passes.swap(scheduled);
+}
+}
 
+namespace ObfuscationSchedule {
+void addPasses(PassManagerBase &PM) {
   std::vector<Pass *> passes = getPasses();
+  if (ObfuscationCache::isEnabled() && !passes.empty())
+    addCache(passes);
+  // Also with a single thread, so that passes are grouped the same whatever
+  // the number of threads
+  addParallel(passes);
 
   if (scheduleMetrics) {
     PM.add(new Metrics());
@@ -183,4 +268,76 @@ static RegisterStandardPasses Y(PassManagerBuilder::EP_OptimizerLast,
   if (scheduleMetrics) {
     PM.add(new Metrics());
   }
+}
+
+bool isLinkTime() { return obfLTO; }
+
+bool getSelectedFunctions(StringSet<> &names) {
+  bool restricted = false;
+  bool unrestricted = false;
+  for (Pass *pass : getPasses()) {
+    AnalysisID id = pass->getPassID();
+    delete pass;
+
+    // LoopBogusCF transforms every function it sees, so without a list of its
+    // own it leaves the selection unrestricted. OpaquePredicate,
+    // ReplaceInstruction and Cleanup only touch the blocks the passes with a
+    // list mark, InlineFunction only needs the callees of the selected
+    // functions and IdentifierRenamer can be run again once the module is
+    // read, so they are not counted, like the LLVM passes
+    ArrayRef<std::string> requested;
+    if (id == &BogusCF::ID)
+      requested = BogusCF::getRequestedFunctions();
+    else if (id == &Flatten::ID)
+      requested = Flatten::getRequestedFunctions();
+    else if (id == &Copy::ID)
+      requested = Copy::getRequestedFunctions();
+    else if (id != &LoopBogusCF::ID)
+      continue;
+
+    if (requested.empty())
+      unrestricted = true;
+    for (const std::string &name : requested) {
+      names.insert(name);
+    }
+    restricted = true;
+  }
+  return restricted && !unrestricted;
+}
+
+bool isScheduled(AnalysisID pass) {
+  bool scheduled = false;
+  for (Pass *scheduledPass : getPasses()) {
+    scheduled |= scheduledPass->getPassID() == pass;
+    delete scheduledPass;
+  }
+  return scheduled;
+}
+};
+
+bool Obfuscate::runOnModule(Module &M) {
+  PassTrace::ModuleScope trace(this, M);
+  PassManager PM;
+  if (!M.getDataLayout().empty())
+    PM.add(new DataLayout(&M));
+  ObfuscationSchedule::addPasses(PM);
+  return PM.run(M);
+}
+
+char Obfuscate::ID = 0;
+static RegisterPass<Obfuscate>
+    X("obfuscate", "Run the obfuscation pipeline on the linked program", false,
+      false);
+
+  // Schedue the passes
+  // http://homes.cs.washington.edu/~bholt/posts/llvm-quick-tricks.html
+static RegisterStandardPasses Y(PassManagerBuilder::EP_OptimizerLast,
+                                [](const PassManagerBuilder &,
+                                   PassManagerBase &PM) {
+
+  if (noObfSchedule || obfLTO) {
+    return;
+  }
+
+  ObfuscationSchedule::addPasses(PM);
 });
@@ -0,0 +1,206 @@
+//=== static_hotness.cpp - Static execution frequency estimates -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Within a function, BlockFrequencyInfo gives the frequency of each block
+// relative to the entry from the branch probabilities of BranchProbabilityInfo
+// (loop back edges, unlikely paths and so on). Across functions, the call
+// graph is walked top down from the functions that can be called from outside
+// the module: a callee is entered as often as all its call sites execute.
+// Calls within a strongly connected component of the call graph are ignored,
+// so recursion does not count as a loop.
+//
+// The estimates are only used when no profile is given with -obfProfile.
+//
+// Function frequencies can be exported to named metadata, which is read
+// instead of walking the call graph. Copies of a module that are transformed
+// in parallel with only some of the bodies (c.f. ParallelFunctionPasses) then
+// see the frequencies of the whole module.
+//
+// Command line options
+// - obfStaticHotness - Scale the probabilities of BogusCF, Flatten and Copy
+//                      down in frequently executed code. Default true
+// - obfStaticExponent - Probabilities are divided by the frequency raised to
+//                       this power. Default 1.0
+
+#define DEBUG_TYPE "static-hotness"
+#include "Transform/static_hotness.h"
+#include "Transform/pass_trace.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+static const char *const exportedFrequencies = "obf.static.frequencies";
+
+static cl::opt<bool> obfStaticHotness(
+    "obfStaticHotness", cl::init(true),
+    cl::desc("Estimate execution frequencies statically when no profile is "
+             "given, and obfuscate frequently executed code less"));
+
+static cl::opt<double> obfStaticExponent(
+    "obfStaticExponent", cl::init(1.0),
+    cl::desc("Probabilities are divided by the estimated frequency raised to "
+             "this power"));
+
+bool StaticHotness::runOnModule(Module &M) {
+  if (!obfStaticHotness)
+    return false;
+  PassTrace::ModuleScope trace(this, M);
+
+  if (obfStaticExponent < 0.f) {
+    M.getContext().emitError("StaticHotness: Exponent must not be negative");
+    return false;
+  }
+
+  for (auto &F : M) {
+    if (F.isDeclaration())
+      continue;
+    BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfo>(F);
+    double entryFreq =
+        std::max<uint64_t>(BFI.getBlockFreq(&F.getEntryBlock()).getFrequency(),
+                           1);
+    for (auto &block : F) {
+      relativeFrequencies[&block] =
+          BFI.getBlockFreq(&block).getFrequency() / entryFreq;
+    }
+    // Entered from outside the module
+    if (!F.hasLocalLinkage() || F.hasAddressTaken())
+      functionFrequencies[&F] = 1.0;
+  }
+
+  if (importFunctionFrequencies(M))
+    return false;
+
+  // Callers come before their callees in reverse post order
+  CallGraphNode *external = getAnalysis<CallGraph>().getExternalCallingNode();
+  std::vector<std::vector<CallGraphNode *> > sccs;
+  for (scc_iterator<CallGraphNode *> scc = scc_begin(external),
+                                     sccEnd = scc_end(external);
+       scc != sccEnd; ++scc) {
+    sccs.push_back(*scc);
+  }
+
+  for (auto scc = sccs.rbegin(), sccEnd = sccs.rend(); scc != sccEnd; ++scc) {
+    for (CallGraphNode *node : *scc) {
+      Function *caller = node->getFunction();
+      if (!caller || caller->isDeclaration())
+        continue;
+      double callerFreq = functionFrequencies.lookup(caller);
+      for (auto record = node->begin(), recordEnd = node->end();
+           record != recordEnd; ++record) {
+        Function *callee = record->second->getFunction();
+        Value *callValue = record->first;
+        Instruction *call = dyn_cast_or_null<Instruction>(callValue);
+        if (!callee || callee->isDeclaration() || !call ||
+            std::find(scc->begin(), scc->end(), record->second) != scc->end())
+          continue;
+        functionFrequencies[callee] +=
+            callerFreq * relativeFrequencies.lookup(call->getParent());
+      }
+    }
+  }
+
+  DEBUG(for (auto &F : M) {
+    if (!F.isDeclaration())
+      errs() << "StaticHotness: " << F.getName() << " entered "
+             << getFunctionFrequency(F) << " times\n";
+  });
+  return false;
+}
+
+void StaticHotness::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesAll();
+  AU.addRequired<BlockFrequencyInfo>();
+  AU.addRequired<CallGraph>();
+}
+
+void StaticHotness::releaseMemory() {
+  relativeFrequencies.clear();
+  functionFrequencies.clear();
+}
+
+void StaticHotness::exportFunctionFrequencies(Module &M) {
+  removeExportedFrequencies(M);
+  NamedMDNode *frequencies = M.getOrInsertNamedMetadata(exportedFrequencies);
+  Type *doubleType = Type::getDoubleTy(M.getContext());
+  for (auto &F : M) {
+    if (F.isDeclaration())
+      continue;
+    Value *values[] = { &F, ConstantFP::get(doubleType,
+                                            getFunctionFrequency(F)) };
+    frequencies->addOperand(MDNode::get(M.getContext(), values));
+  }
+}
+
+void StaticHotness::removeExportedFrequencies(Module &M) {
+  if (NamedMDNode *frequencies = M.getNamedMetadata(exportedFrequencies))
+    frequencies->eraseFromParent();
+}
+
+bool StaticHotness::importFunctionFrequencies(Module &M) {
+  NamedMDNode *frequencies = M.getNamedMetadata(exportedFrequencies);
+  if (!frequencies)
+    return false;
+
+  functionFrequencies.clear();
+  for (unsigned i = 0, e = frequencies->getNumOperands(); i < e; ++i) {
+    MDNode *node = frequencies->getOperand(i);
+    Function *F = dyn_cast_or_null<Function>(node->getOperand(0));
+    ConstantFP *frequency = dyn_cast_or_null<ConstantFP>(node->getOperand(1));
+    if (F && frequency)
+      functionFrequencies[F] = frequency->getValueAPF().convertToDouble();
+  }
+  DEBUG(errs() << "StaticHotness: Imported " << functionFrequencies.size()
+               << " function frequencies\n");
+  return true;
+}
+
+double StaticHotness::getFunctionFrequency(Function &F) {
+  return functionFrequencies.lookup(&F);
+}
+
+double StaticHotness::getBlockFrequency(BasicBlock &BB) {
+  // Blocks created after the estimate was made run as often as their
+  // function is entered
+  ValueMap<const BasicBlock *, double>::iterator relative =
+      relativeFrequencies.find(&BB);
+  double frequency = getFunctionFrequency(*BB.getParent());
+  if (relative == relativeFrequencies.end())
+    return frequency;
+  return frequency * relative->second;
+}
+
+double StaticHotness::getMaxBlockFrequency(Function &F) {
+  double maxFrequency = 0.0;
+  for (auto &block : F) {
+    maxFrequency = std::max(maxFrequency, getBlockFrequency(block));
+  }
+  return maxFrequency;
+}
+
+bool StaticHotness::isEnabled() { return obfStaticHotness; }
+
+double StaticHotness::scaleProbability(double probability, double frequency) {
+  if (frequency <= 1.0)
+    return probability;
+  return probability * std::pow(frequency, -obfStaticExponent);
+}
+
+char StaticHotness::ID = 0;
+static RegisterPass<StaticHotness>
+    X("static-hotness", "Estimate execution frequencies statically", false,
+      true);
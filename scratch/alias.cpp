@@ -0,0 +1,39 @@
+// Loops that LICM and GVN only optimize if TBAA tells the accesses of the
+// program apart from the accesses of opaque predicates
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+// The load of factor is hoisted: float stores cannot alias an int
+void scale(float *y, const int *factor, unsigned n) {
+  for (unsigned i = 0; i < n; ++i) {
+    y[i] = y[i] * *factor;
+  }
+}
+
+// The load of last is forwarded from the store before it
+int forward(int *last, float *y, unsigned n) {
+  int total = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    *last = i;
+    y[i] = 0.f;
+    total += *last;
+  }
+  return total;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: count\n";
+    return 0;
+  }
+
+  unsigned count = atoi(argv[1]);
+  std::vector<float> y(count, 2.f);
+  int factor = 3, last = 0;
+
+  for (unsigned i = 0; i < 100; ++i) {
+    scale(y.data(), &factor, count);
+  }
+  std::cout << y[count - 1] << " " << forward(&last, y.data(), count) << "\n";
+}
@@ -0,0 +1,67 @@
+#!/bin/bash
+set -eu
+# Checks that the loads LICM hoists and GVN removes without obfuscation are
+# still hoisted and removed when the loops contain opaque predicates, with
+# and without TBAA on the accesses of the predicates
+# Each line of the output is the flags, the number of instructions hoisted by
+# LICM and the number of loads deleted by GVN
+
+OUTPUT=alias.txt
+PROGRAMS=(alias)
+BUILD_DIR=build
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+
+# Keep the TBAA that clang only emits when optimizing, but leave the
+# optimizations themselves for later
+CLANG="$BUILD_DIR/Release+Asserts/bin/clang++ -Wall -std=c++11"
+CLANG_FLAG="-O2 -Xclang -disable-llvm-optzns"
+OPT="$BUILD_DIR/Release+Asserts/bin/opt"
+OPT_FLAG="-load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+
+LOOP_FLAG="-loop-simplify -loop-boguscf -loopBcfMode=header -opaque-predicate"
+
+FLAGS=(\
+    "$LOOP_FLAG -opaque-tbaa=false"\
+    "$LOOP_FLAG -opaque-tbaa=true"\
+    )
+
+# Value of a statistic when running -O3 over the given IR
+statistic() {
+    ($OPT ${OPT_FLAG} -noObfSchedule -O3 -stats "$1" -o /dev/null 2>&1 \
+        | grep "$2" | grep "$3" | awk '{ print $1 }') || true
+}
+
+counts() {
+    hoisted=$(statistic "$1" licm "Number of instructions hoisted out of loop")
+    deleted=$(statistic "$1" gvn "Number of loads deleted")
+    echo "${hoisted:-0} ${deleted:-0}"
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    for program in ${PROGRAMS[@]}; do
+        echo -e "\t$program..."
+        $CLANG $CLANG_FLAG -emit-llvm -S -o test/$program.ll $program.cpp
+        $OPT -mem2reg test/$program.ll -o test/$program.ll -S
+
+        echo "$program $(counts test/$program.ll)" >> $OUTPUT
+
+        for ((i = 0; i < ${#FLAGS[@]}; i++)); do
+            flags="${FLAGS[$i]}"
+            echo "$flags"
+            $OPT ${OPT_FLAG} $flags \
+                test/$program.ll -o test/${program}-obf.ll -S
+            echo "$flags: $(counts test/${program}-obf.ll)" >> $OUTPUT
+        done
+    done
+}
+
+main "$@"
@@ -0,0 +1,69 @@
+#!/bin/bash
+set -eu
+# Compares obfuscating every program with its own opt invocation against one
+# llvm-obfuscate invocation for all of them
+# Each line of the output is the mode, the number of jobs and the seconds
+# taken, followed by whether the outputs match those of opt
+
+OUTPUT=batch.txt
+PROGRAMS=(hanoi mergesort quicksort radixsort bubblesort stack-sort)
+JOBS=(1 2 4 8)
+BUILD_DIR=build
+LLVM_BIN="$BUILD_DIR/Release+Asserts/bin"
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+
+CLANG="$LLVM_BIN/clang++ -Wall -std=c++11"
+OPT="$LLVM_BIN/opt -load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+OBFUSCATE="$OBF_BUILD/bin/llvm-obfuscate"
+DIS="$LLVM_BIN/llvm-dis"
+
+OBF_FLAG="-obfSeed=42"
+
+hash() {
+    $DIS "$1" -o - | grep -v "^; ModuleID" | md5sum | awk '{ print $1 }'
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    inputs=""
+    for program in ${PROGRAMS[@]}; do
+        $CLANG -O2 -emit-llvm -c -o test/$program-batch.bc $program.cpp
+        inputs="$inputs test/$program-batch.bc"
+    done
+
+    echo -e "\topt..."
+    start=$(date +%s.%N)
+    for program in ${PROGRAMS[@]}; do
+        $OPT $OBF_FLAG -obfuscate test/$program-batch.bc \
+            -o test/$program-batch.opt.bc
+    done
+    end=$(date +%s.%N)
+    echo "opt 1 $(echo "$end - $start" | bc)" >> $OUTPUT
+
+    for jobs in ${JOBS[@]}; do
+        echo -e "\tllvm-obfuscate -j$jobs..."
+        start=$(date +%s.%N)
+        $OBFUSCATE $OBF_FLAG -j=$jobs $inputs
+        end=$(date +%s.%N)
+
+        same=yes
+        for program in ${PROGRAMS[@]}; do
+            if [[ $(hash test/$program-batch.obf.bc) != \
+                  $(hash test/$program-batch.opt.bc) ]]; then
+                same=no
+            fi
+        done
+        echo "llvm-obfuscate $jobs $(echo "$end - $start" | bc) $same" \
+            >> $OUTPUT
+    done
+}
+
+main "$@"
@@ -0,0 +1,57 @@
+#!/bin/bash
+set -eu
+# Measures the cost of Bogus CF on the sort programs: the time taken by the
+# pass and the number of instructions left after -O3. Run once on each
+# revision to compare them
+# Each line of the output is the program, the user time of the pass in
+# seconds and the instruction count after -O3
+
+OUTPUT=bcf.txt
+PROGRAMS=(bubblesort hanoi mergesort quicksort radixsort stack-sort)
+BUILD_DIR=build
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+
+CLANG="$BUILD_DIR/Release+Asserts/bin/clang++ -Wall -std=c++11"
+OPT="$BUILD_DIR/Release+Asserts/bin/opt"
+OPT_FLAG="-load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+
+BCF_FLAG="-boguscf -bcfProbability=0.5 -bcfSeed=bcf -opaque-predicate"
+
+# User time of the Bogus CF pass according to -time-passes
+pass_time() {
+    $OPT ${OPT_FLAG} -noObfSchedule $BCF_FLAG -time-passes "$1" \
+        -o "$2" 2>&1 \
+        | grep "Insert bogus control flow paths" | head -n 1 \
+        | awk '{ print $1 }'
+}
+
+# Number of instructions after running -O3 over the given IR
+instructions() {
+    ($OPT ${OPT_FLAG} -noObfSchedule -O3 -instcount -stats "$1" \
+        -o /dev/null 2>&1 \
+        | grep "Number of instructions (of all types)" \
+        | awk '{ print $1 }') || true
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    for program in ${PROGRAMS[@]}; do
+        echo -e "\t$program..."
+        $CLANG -O0 -emit-llvm -S -o test/$program.ll $program.cpp
+        $OPT -mem2reg test/$program.ll -o test/$program.ll -S
+
+        time=$(pass_time test/$program.ll test/${program}-bcf.ll)
+        count=$(instructions test/${program}-bcf.ll)
+        echo "$program $time ${count:-0}" >> $OUTPUT
+    done
+}
+
+main "$@"
@@ -0,0 +1,53 @@
+// Prints a function with the given number of basic blocks as LLVM IR, for
+// measuring how passes scale with function size. Every block branches to the
+// next two, and passes its value on through PHI Nodes
+#include <cstdlib>
+#include <iostream>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: number_of_blocks\n";
+    return 0;
+  }
+
+  unsigned count = atoi(argv[1]);
+  if (count < 2) {
+    std::cerr << "At least 2 blocks are needed\n";
+    return 0;
+  }
+
+  std::cout << "define i32 @blocks(i32 %x) {\n"
+            << "entry:\n"
+            << "  br label %b0\n";
+
+  for (unsigned i = 0; i < count; ++i) {
+    std::cout << "b" << i << ":\n";
+    if (i == 0) {
+      std::cout << "  %p0 = add i32 %x, 1\n";
+    } else if (i == 1) {
+      std::cout << "  %p1 = phi i32 [ %v0, %b0 ]\n";
+    } else {
+      std::cout << "  %p" << i << " = phi i32 [ %v" << i - 1 << ", %b"
+                << i - 1 << " ], [ %v" << i - 2 << ", %b" << i - 2 << " ]\n";
+    }
+    std::cout << "  %v" << i << " = add i32 %p" << i << ", " << i << "\n";
+
+    if (i == count - 1) {
+      std::cout << "  br label %exit\n";
+      break;
+    }
+    std::cout << "  %c" << i << " = icmp slt i32 %v" << i << ", %x\n";
+    std::cout << "  br i1 %c" << i << ", label %b" << i + 1 << ", label ";
+    if (i + 2 < count)
+      std::cout << "%b" << i + 2 << "\n";
+    else
+      std::cout << "%exit\n";
+  }
+
+  std::cout << "exit:\n"
+            << "  %r = phi i32 [ %v" << count - 2 << ", %b" << count - 2
+            << " ], [ %v" << count - 1 << ", %b" << count - 1 << " ]\n"
+            << "  ret i32 %r\n"
+            << "}\n";
+  return 0;
+}
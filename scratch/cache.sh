@@ -0,0 +1,51 @@
+#!/bin/bash
+set -eu
+# Obfuscates every program twice with the same seed and an empty cache: the
+# first run fills the cache, the second one should splice every function in
+# Each line of the output is the program, the seconds taken by the cold and
+# the warm run and the number of functions spliced in by the warm run
+
+OUTPUT=cache.txt
+PROGRAMS=(hanoi mergesort quicksort radixsort bubblesort stack-sort)
+BUILD_DIR=build
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+
+CLANG="$BUILD_DIR/Release+Asserts/bin/clang++ -Wall -std=c++11"
+OPT="$BUILD_DIR/Release+Asserts/bin/opt"
+OPT_FLAG="-load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+
+CACHE_DIR=test/cache
+CACHE_FLAG="-O2 -obfSeed=42 -obfCache=$CACHE_DIR"
+
+# Seconds taken to obfuscate the given IR, the statistics go to $2
+obfuscate() {
+    start=$(date +%s.%N)
+    $OPT ${OPT_FLAG} $CACHE_FLAG -stats "$1" -o /dev/null 2> "$2"
+    end=$(date +%s.%N)
+    echo "$end - $start" | bc
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    for program in ${PROGRAMS[@]}; do
+        echo -e "\t$program..."
+        $CLANG -emit-llvm -c -o test/$program.bc $program.cpp
+
+        rm -rf $CACHE_DIR
+        cold=$(obfuscate test/$program.bc test/$program-cold.txt)
+        warm=$(obfuscate test/$program.bc test/$program-warm.txt)
+        hits=$( (grep "Functions spliced in" test/$program-warm.txt || true) \
+            | awk '{ print $1 }')
+        echo "$program $cold $warm ${hits:-0}" >> $OUTPUT
+    done
+}
+
+main "$@"
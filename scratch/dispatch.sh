@@ -0,0 +1,68 @@
+#!/bin/bash
+set -eu
+# Compares the Flatten dispatch strategies using hardware counters
+# Flags
+# 1 - Table dispatch
+# 2 - Address dispatch
+# 3 - Switch dispatch
+
+OUTPUT=dispatch.txt
+SIZE=${SIZE:-100000}
+SORTS=(mergesort quicksort)
+EVENTS="cycles,branch-misses"
+
+FLATTEN_FLAGS="-mllvm -flattenPass -mllvm -opaquePredicatePass\
+    -mllvm -replaceInstructionPass -mllvm -flattenProbability=1.0"
+
+FLAGS=(\
+    "$FLATTEN_FLAGS -mllvm -flattenDispatch=table"\
+    "$FLATTEN_FLAGS -mllvm -flattenDispatch=address"\
+    "$FLATTEN_FLAGS -mllvm -flattenDispatch=switch"\
+    )
+
+# Prints the counters of a run separated by tabs
+measure() {
+    perf stat -x, -e $EVENTS "$@" 2>&1 >/dev/null \
+        | awk -F, '{ printf "\t%s %s", $1, $3 }'
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    echo "Building..."
+    export OBF_FLAGS=""
+    make
+
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+
+    echo "Generating sequence of $SIZE..."
+    test/generator $SIZE > "$tempdir/input-$SIZE.txt"
+
+    for sort in ${SORTS[@]}; do
+        echo -n "$sort" >> $OUTPUT
+        measure "test/$sort" "$tempdir/input-$SIZE.txt" >> $OUTPUT
+        echo "" >> $OUTPUT
+    done
+
+    for ((i = 0; i < ${#FLAGS[@]}; i++)); do
+        flags="${FLAGS[$i]}"
+        make clean-obf
+        (export OBF_FLAGS="$flags"; make)
+        echo "$flags" >> $OUTPUT
+
+        for sort in ${SORTS[@]}; do
+            echo -n "${sort}-obf" >> $OUTPUT
+            measure "test/${sort}-obf" "$tempdir/input-$SIZE.txt" >> $OUTPUT
+            echo "" >> $OUTPUT
+        done
+    done
+}
+
+main "$@"
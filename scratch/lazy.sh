@@ -0,0 +1,58 @@
+#!/bin/bash
+set -eu
+# Obfuscates a few functions of all programs linked into one module, reading
+# every function and with -lazy
+# Each line of the output is the mode, the seconds taken and the maximum
+# resident set size in kilobytes
+
+OUTPUT=lazy.txt
+PROGRAMS=(hanoi mergesort quicksort radixsort bubblesort stack-sort)
+SELECTED="main_hanoi,main_quicksort"
+BUILD_DIR=build
+LLVM_BIN="$BUILD_DIR/Release+Asserts/bin"
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+
+CLANG="$LLVM_BIN/clang++ -Wall -std=c++11"
+LINK="$LLVM_BIN/llvm-link"
+OBFUSCATE="$OBF_BUILD/bin/llvm-obfuscate"
+
+# The default schedule without LoopBogusCF, which would read every function
+OBF_FLAG="-obfSeed=42 -copyPass -inlineFunctionPass -bogusCFPass \
+-opaquePredicatePass -replaceInstructionPass -flattenPass -cleanupPass \
+-identifierRenamerPass -bcfFunc=$SELECTED -flattenFunc=$SELECTED \
+-copyFunc=$SELECTED"
+
+# Seconds and kilobytes taken by the given command
+measured() {
+    start=$(date +%s.%N)
+    kilobytes=$( { /usr/bin/time -f "%M" "$@" > /dev/null; } 2>&1 | tail -1)
+    end=$(date +%s.%N)
+    echo "$(echo "$end - $start" | bc) $kilobytes"
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    inputs=""
+    for program in ${PROGRAMS[@]}; do
+        # Every program has a main
+        $CLANG -emit-llvm -S -o - $program.cpp \
+            | sed "s/@main(/@main_${program//-/_}(/" > test/$program-main.ll
+        inputs="$inputs test/$program-main.ll"
+    done
+    $LINK $inputs -o test/lazy.bc
+
+    echo -e "\tfull..."
+    echo "full $(measured $OBFUSCATE $OBF_FLAG test/lazy.bc)" >> $OUTPUT
+    echo -e "\tlazy..."
+    echo "lazy $(measured $OBFUSCATE $OBF_FLAG -lazy test/lazy.bc)" >> $OUTPUT
+}
+
+main "$@"
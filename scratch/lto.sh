@@ -0,0 +1,93 @@
+#!/bin/bash
+set -eu
+# Compares obfuscating every translation unit with obfuscating the linked
+# program once (-obfLTO), for programs made of several translation units
+# Each line of the output is the program, the mode, the seconds taken to
+# obfuscate, the number of functions in the binary and its run time
+
+OUTPUT=lto.txt
+PROGRAMS=(mergesort quicksort stack-sort)
+UNITS=(get_input)
+SIZE=1000000
+BUILD_DIR=build
+LLVM_BIN="$BUILD_DIR/Release+Asserts/bin"
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+
+OBF_CLANG="./obf.sh -O2 -Wall -std=c++11"
+OPT="$LLVM_BIN/opt -load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+LINK="$LLVM_BIN/llvm-link"
+CLANG="$LLVM_BIN/clang++"
+NM="nm"
+
+SEED="-mllvm -obfSeed=42"
+
+# Seconds taken by the given command
+timed() {
+    start=$(date +%s.%N)
+    "$@"
+    end=$(date +%s.%N)
+    echo "$end - $start" | bc
+}
+
+functions() {
+    $NM "$1" | grep -c " [tT] "
+}
+
+running_time() {
+    start=$(date +%s.%N)
+    "$1" < test/lto-input.txt > /dev/null
+    end=$(date +%s.%N)
+    echo "$end - $start" | bc
+}
+
+per_unit() {
+    for unit in "$@"; do
+        $OBF_CLANG $SEED -c -o test/$unit-unit.o $unit.cpp
+    done
+}
+
+link_time() {
+    objects=""
+    for unit in "$@"; do
+        $OBF_CLANG $SEED -mllvm -obfLTO -emit-llvm -c -o test/$unit-lto.bc \
+            $unit.cpp
+        objects="$objects test/$unit-lto.bc"
+    done
+    $LINK $objects -o test/lto-linked.bc
+    $OPT -internalize -internalize-public-api-list=main -obfSeed=42 -obfLTO \
+        -obfuscate -O2 test/lto-linked.bc -o test/lto-obf.bc
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    make test/generator > /dev/null
+    test/generator $SIZE > test/lto-input.txt
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    for program in ${PROGRAMS[@]}; do
+        echo -e "\t$program..."
+        units="$program ${UNITS[@]}"
+
+        seconds=$(timed per_unit $units)
+        objects=""
+        for unit in $units; do
+            objects="$objects test/$unit-unit.o"
+        done
+        $CLANG -o test/$program-unit $objects
+        echo "$program unit $seconds $(functions test/$program-unit)" \
+            "$(running_time test/$program-unit)" >> $OUTPUT
+
+        seconds=$(timed link_time $units)
+        $CLANG -O2 -o test/$program-lto test/lto-obf.bc
+        echo "$program lto $seconds $(functions test/$program-lto)" \
+            "$(running_time test/$program-lto)" >> $OUTPUT
+    done
+}
+
+main "$@"
@@ -0,0 +1,56 @@
+#!/bin/bash
+set -eu
+# Obfuscates all programs linked into one module with a growing number of
+# threads running the function passes
+# Each line of the output is the number of threads, the seconds taken and the
+# MD5 of the result, which should be the same for every number of threads
+
+OUTPUT=parallel.txt
+PROGRAMS=(hanoi mergesort quicksort radixsort bubblesort stack-sort)
+THREADS=(1 2 4 8 16 32)
+BUILD_DIR=build
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+
+CLANG="$BUILD_DIR/Release+Asserts/bin/clang++ -Wall -std=c++11"
+OPT="$BUILD_DIR/Release+Asserts/bin/opt"
+LINK="$BUILD_DIR/Release+Asserts/bin/llvm-link"
+DIS="$BUILD_DIR/Release+Asserts/bin/llvm-dis"
+OPT_FLAG="-load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+
+OBF_FLAG="-O2 -obfSeed=42 -flattenProbability=1.0 -bcfProbability=1.0"
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    inputs=""
+    for program in ${PROGRAMS[@]}; do
+        # Every program has a main
+        $CLANG -emit-llvm -S -o - $program.cpp \
+            | sed "s/@main(/@main_${program//-/_}(/" > test/$program-main.ll
+        inputs="$inputs test/$program-main.ll"
+    done
+    $LINK $inputs -o test/parallel.bc
+
+    serialHash=""
+    for threads in ${THREADS[@]}; do
+        echo -e "\t$threads threads..."
+        start=$(date +%s.%N)
+        $OPT ${OPT_FLAG} $OBF_FLAG -obfThreads=$threads test/parallel.bc \
+            -o test/parallel-obf.bc
+        end=$(date +%s.%N)
+        hash=$($DIS test/parallel-obf.bc -o - | md5sum | awk '{ print $1 }')
+        echo -n "$threads $(echo "$end - $start" | bc) $hash" >> $OUTPUT
+        serialHash=${serialHash:-$hash}
+        [[ "$hash" == "$serialHash" ]] || echo -n " DIFFERENT" >> $OUTPUT
+        echo "" >> $OUTPUT
+    done
+}
+
+main "$@"
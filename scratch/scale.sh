@@ -0,0 +1,43 @@
+#!/bin/bash
+set -eu
+# Measures the time Flatten takes on synthetic functions of increasing size
+# Each line of the output is the number of blocks followed by the user time
+# of the pass in seconds
+
+OUTPUT=scale.txt
+SIZES=(1000 10000 100000)
+BUILD_DIR=build
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+
+OPT="$BUILD_DIR/Release+Asserts/bin/opt"
+OPT_FLAG="-load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+
+FLATTEN_FLAG="-flatten -flattenProbability=1.0 -flattenSeed=scale"
+
+# User time of the Flatten pass according to -time-passes
+pass_time() {
+    $OPT ${OPT_FLAG} -noObfSchedule $FLATTEN_FLAG -time-passes "$1" \
+        -o /dev/null 2>&1 \
+        | grep "Flatten function control flow" | head -n 1 \
+        | awk '{ print $1 }'
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    make test/blocks
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    for size in ${SIZES[@]}; do
+        echo -e "\t$size blocks..."
+        ./test/blocks $size > test/blocks-$size.ll
+        echo "$size $(pass_time test/blocks-$size.ll)" >> $OUTPUT
+    done
+}
+
+main "$@"
@@ -0,0 +1,88 @@
+#!/bin/bash
+set -eu
+# Compares obfuscating every program with opt against sending it to a running
+# llvm-obfuscate -serve with llvm-obfuscate-client
+# Each line of the output is the mode and the seconds taken, followed by
+# whether the outputs match those of opt
+
+OUTPUT=server.txt
+PROGRAMS=(hanoi mergesort quicksort radixsort bubblesort stack-sort)
+ROUNDS=10
+BUILD_DIR=build
+LLVM_BIN="$BUILD_DIR/Release+Asserts/bin"
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+
+CLANG="$LLVM_BIN/clang++ -Wall -std=c++11"
+OPT="$LLVM_BIN/opt -load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+SERVER="$OBF_BUILD/bin/llvm-obfuscate"
+CLIENT="$OBF_BUILD/bin/llvm-obfuscate-client"
+DIS="$LLVM_BIN/llvm-dis"
+SOCKET="test/obfuscate.sock"
+
+OBF_FLAG="-obfSeed=42"
+
+hash() {
+    $DIS "$1" -o - | grep -v "^; ModuleID" | md5sum | awk '{ print $1 }'
+}
+
+with_opt() {
+    for round in $(seq $ROUNDS); do
+        for program in ${PROGRAMS[@]}; do
+            $OPT $OBF_FLAG -obfuscate test/$program-server.bc \
+                -o test/$program-server.opt.bc
+        done
+    done
+}
+
+with_client() {
+    for round in $(seq $ROUNDS); do
+        for program in ${PROGRAMS[@]}; do
+            $CLIENT -socket=$SOCKET -o test/$program-server.client.bc \
+                test/$program-server.bc $OBF_FLAG
+        done
+    done
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    for program in ${PROGRAMS[@]}; do
+        $CLANG -O2 -emit-llvm -c -o test/$program-server.bc $program.cpp
+    done
+
+    echo -e "\topt..."
+    start=$(date +%s.%N)
+    with_opt
+    end=$(date +%s.%N)
+    echo "opt $(echo "$end - $start" | bc)" >> $OUTPUT
+
+    $SERVER -serve=$SOCKET $OBF_FLAG &
+    server=$!
+    trap "kill $server" EXIT
+    while [[ ! -S $SOCKET ]]; do
+        sleep 0.1
+    done
+
+    echo -e "\tclient..."
+    start=$(date +%s.%N)
+    with_client
+    end=$(date +%s.%N)
+
+    same=yes
+    for program in ${PROGRAMS[@]}; do
+        if [[ $(hash test/$program-server.client.bc) != \
+              $(hash test/$program-server.opt.bc) ]]; then
+            same=no
+        fi
+    done
+    echo "client $(echo "$end - $start" | bc) $same" >> $OUTPUT
+}
+
+main "$@"
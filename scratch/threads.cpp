@@ -0,0 +1,51 @@
+// Runs the same branchy workload on a number of threads so that contention on
+// the opaque predicate globals shows up in the running time
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+unsigned collatz(unsigned long number) {
+  unsigned steps = 0;
+  while (number != 1) {
+    if (number % 2 == 0) {
+      number /= 2;
+    } else {
+      number = 3 * number + 1;
+    }
+    ++steps;
+  }
+  return steps;
+}
+
+void work(unsigned start, unsigned count, unsigned long &result) {
+  unsigned long total = 0;
+  for (unsigned i = start; i < start + count; ++i) {
+    total += collatz(i);
+  }
+  result = total;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cerr << "Usage: number_of_threads numbers_per_thread\n";
+    return 0;
+  }
+
+  unsigned threadCount = atoi(argv[1]);
+  unsigned count = atoi(argv[2]);
+
+  std::vector<std::thread> threads;
+  std::vector<unsigned long> results(threadCount);
+  for (unsigned i = 0; i < threadCount; ++i) {
+    threads.push_back(
+        std::thread(work, 1 + i * count, count, std::ref(results[i])));
+  }
+
+  unsigned long total = 0;
+  for (unsigned i = 0; i < threadCount; ++i) {
+    threads[i].join();
+    total += results[i];
+  }
+  std::cout << total << "\n";
+}
@@ -0,0 +1,70 @@
+#!/bin/bash
+set -eu
+# Compares the opaque predicate state modes on a multithreaded workload
+# Flags
+# 1 - Shared globals
+# 2 - Shared globals padded to a cache line
+# 3 - Thread local globals
+
+OUTPUT=threads.txt
+THREADS=(1 2 4 8 16)
+COUNT=1000000
+
+BCF_FLAG="-mllvm -bogusCFPass -mllvm -loopBCFPass -mllvm -opaquePredicatePass\
+    -mllvm -replaceInstructionPass -mllvm -bcfProbability=1.0"
+
+FLAGS=(\
+    "$BCF_FLAG -mllvm -opaque-state=shared"\
+    "$BCF_FLAG -mllvm -opaque-state=padded"\
+    "$BCF_FLAG -mllvm -opaque-state=tls"\
+    )
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    echo "Building..."
+    export OBF_FLAGS=""
+    make test/threads
+
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    tempdir=temp
+    rm -rf $tempdir
+    mkdir -p $tempdir
+
+    for threads in ${THREADS[@]}; do
+        echo -ne "\t$threads" >> $OUTPUT
+    done
+    echo "" >> $OUTPUT
+
+    echo -n "threads" >> $OUTPUT
+    for threads in ${THREADS[@]}; do
+        echo -ne "\t" >> $OUTPUT
+        (/usr/bin/time -f "%e" "test/threads" "$threads" "$COUNT"\
+                > "$tempdir/threads-$threads.txt") 2>&1 | tr '\n' ' ' >>  $OUTPUT
+    done
+    echo "" >> $OUTPUT
+
+    for ((i = 0; i < ${#FLAGS[@]}; i++)); do
+        flags="${FLAGS[$i]}"
+        rm -f test/threads-obf
+        (export OBF_FLAGS="$flags"; make test/threads-obf)
+        echo "$flags" >> $OUTPUT
+
+        echo -n "threads-obf" >> $OUTPUT
+        for threads in ${THREADS[@]}; do
+            echo -ne "\t" >> $OUTPUT
+            (/usr/bin/time -f "%e" "test/threads-obf" "$threads" "$COUNT"\
+                    > "$tempdir/obf-threads-$threads.txt") 2>&1 | tr '\n' ' ' >>  $OUTPUT
+
+            diff "$tempdir/obf-threads-$threads.txt" "$tempdir/threads-$threads.txt"\
+             > /dev/null || echo -ne " DIFFER" >> $OUTPUT
+        done
+        echo "" >> $OUTPUT
+    done
+}
+
+main "$@"
@@ -0,0 +1,43 @@
+#!/bin/bash
+set -eu
+# Traces the obfuscation of every program and keeps the most expensive passes
+# The trace of each program is written to test/<program>-trace.json, to be
+# opened in chrome://tracing
+# Each line of the output is the program followed by a line of the summary:
+# pass, function, calls, microseconds, instructions and blocks before and
+# after, allocas created and PHIs demoted
+
+OUTPUT=trace.txt
+PROGRAMS=(hanoi mergesort quicksort radixsort bubblesort stack-sort)
+TOP=5
+BUILD_DIR=build
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+
+CLANG="$BUILD_DIR/Release+Asserts/bin/clang++ -Wall -std=c++11"
+OPT="$BUILD_DIR/Release+Asserts/bin/opt"
+OPT_FLAG="-load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+
+OBF_FLAG="-O2 -obfSeed=42"
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    for program in ${PROGRAMS[@]}; do
+        echo -e "\t$program..."
+        $CLANG -emit-llvm -c -o test/$program-trace.bc $program.cpp
+        $OPT ${OPT_FLAG} $OBF_FLAG -obfTrace=test/$program-trace.json \
+            -obfTraceSummary=test/$program-trace.csv test/$program-trace.bc \
+            -o /dev/null
+        tail -n +2 test/$program-trace.csv | head -n $TOP \
+            | sed "s/^/$program,/" >> $OUTPUT
+    done
+}
+
+main "$@"
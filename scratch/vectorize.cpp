@@ -0,0 +1,45 @@
+// Simple loops that the loop vectorizer handles when not obfuscated
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+void saxpy(float a, const float *x, float *y, unsigned n) {
+  for (unsigned i = 0; i < n; ++i) {
+    y[i] = a * x[i] + y[i];
+  }
+}
+
+int sum(const int *x, unsigned n) {
+  int total = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    total += x[i];
+  }
+  return total;
+}
+
+// The sum is computed in the loop body and returned after the loop
+int sumNonEmpty(const int *x, unsigned n) {
+  int total = 0;
+  unsigned i = 0;
+  do {
+    total += x[i];
+  } while (++i < n);
+  return total;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: count\n";
+    return 0;
+  }
+
+  unsigned count = atoi(argv[1]);
+  std::vector<float> x(count, 1.f), y(count, 2.f);
+  std::vector<int> numbers(count, 3);
+
+  for (unsigned i = 0; i < 100; ++i) {
+    saxpy(0.5f, x.data(), y.data(), count);
+  }
+  std::cout << y[count - 1] << " " << sum(numbers.data(), count) << " "
+            << sumNonEmpty(numbers.data(), count) << "\n";
+}
@@ -0,0 +1,79 @@
+#!/bin/bash
+set -eu
+# Checks that loops vectorized before Loop BCF are still vectorized when the
+# optimizer runs again over the obfuscated IR, and that the obfuscated
+# program still verifies and prints the same, including the sums returned
+# after their loops
+# Flags
+# 1 - Loop BCF in header
+# 2 - Loop BCF in preheader
+# 3 - Loop BCF every 16 iterations
+
+OUTPUT=vectorize.txt
+PROGRAMS=(vectorize)
+BUILD_DIR=build
+OBF_BUILD="$BUILD_DIR/projects/LLVM-Obfuscator/Release+Asserts"
+
+CLANG="$BUILD_DIR/Release+Asserts/bin/clang++ -Wall -std=c++11"
+OPT="$BUILD_DIR/Release+Asserts/bin/opt"
+OPT_FLAG="-load ${OBF_BUILD}/lib/LLVMObfuscatorTransforms.so"
+OBF_BASE="build/projects/LLVM-Obfuscator"
+COUNT=1000
+
+LOOP_FLAG="-loop-simplify -loop-boguscf -opaque-predicate"
+
+FLAGS=(\
+    "$LOOP_FLAG -loopBcfMode=header"\
+    "$LOOP_FLAG -loopBcfMode=preheader"\
+    "$LOOP_FLAG -loopBcfMode=strided -loopBcfStride=16"\
+    )
+
+# Number of loops vectorized when running -O3 over the given IR
+vectorized() {
+    ($OPT ${OPT_FLAG} -noObfSchedule -O3 -stats "$1" -o /dev/null 2>&1 \
+        | grep "loop-vectorize" | grep "Number of loops vectorized" \
+        | awk '{ print $1 }') || true
+}
+
+main() {
+    if [[ -n "${1+1}" ]]; then
+        OUTPUT=$1
+    fi
+
+    (cd $OBF_BASE && make > /dev/null)
+    echo "Writing results to $OUTPUT"
+    echo -n "" > $OUTPUT
+
+    for program in ${PROGRAMS[@]}; do
+        echo -e "\t$program..."
+        # Unoptimised but otherwise ready for the optimizer
+        $CLANG -O0 -emit-llvm -S -o test/$program.ll $program.cpp
+        $OPT -mem2reg test/$program.ll -o test/$program.ll -S
+
+        expected=$(vectorized test/$program.ll)
+        echo "$program ${expected:-0}" >> $OUTPUT
+        $CLANG -O3 -o test/$program test/$program.ll
+        expectedOutput=$(test/$program $COUNT)
+
+        for ((i = 0; i < ${#FLAGS[@]}; i++)); do
+            flags="${FLAGS[$i]}"
+            echo "$flags"
+            # opt verifies the module after the passes
+            if ! $OPT ${OPT_FLAG} $flags \
+                test/$program.ll -o test/${program}-obf.ll -S; then
+                echo "$flags: INVALID" >> $OUTPUT
+                continue
+            fi
+            actual=$(vectorized test/${program}-obf.ll)
+            echo -n "$flags: ${actual:-0}" >> $OUTPUT
+            [[ "${actual:-0}" -ge "${expected:-0}" ]] \
+                || echo -n " NOT VECTORIZED" >> $OUTPUT
+            $CLANG -O3 -o test/${program}-obf test/${program}-obf.ll
+            [[ "$(test/${program}-obf $COUNT)" == "$expectedOutput" ]] \
+                || echo -n " WRONG OUTPUT" >> $OUTPUT
+            echo "" >> $OUTPUT
+        done
+    done
+}
+
+main "$@"
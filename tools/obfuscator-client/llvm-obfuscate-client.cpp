@@ -0,0 +1,132 @@
+//=== llvm-obfuscate-client.cpp - Obfuscate with a running server ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Sends a bitcode file to llvm-obfuscate -serve and writes the obfuscated
+// bitcode it gets back, in place of
+//   opt -load LLVMObfuscatorTransforms.so <options> -obfuscate in.bc -o out.bc
+// The client only links the support library, and the server has the passes
+// loaded and its options parsed already.
+//
+// The obfuscation options follow the input, and have to be those the server
+// was started with, in the same order:
+//   llvm-obfuscate -serve=/tmp/obf.sock -obfSeed=42
+//   llvm-obfuscate-client -socket=/tmp/obf.sock -o out.bc in.bc -obfSeed=42
+//
+// Command line options
+// - socket - Unix socket of the server. Required
+// - o - Output file. Default standard output
+
+#include "Tools/server_protocol.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/system_error.h"
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string> socketPath("socket", cl::Required,
+                                       cl::value_desc("path"),
+                                       cl::desc("Unix socket of the server"));
+
+static cl::opt<std::string> inputFilename(cl::Positional, cl::init("-"),
+                                          cl::desc("<input bitcode>"));
+
+static cl::opt<std::string> outputFilename("o", cl::init("-"),
+                                           cl::value_desc("filename"),
+                                           cl::desc("Output filename"));
+
+static cl::list<std::string>
+    obfuscationOptions(cl::ConsumeAfter,
+                       cl::desc("<options the server was started with>..."));
+
+// Socket connected to the server, or -1
+static int connectToServer(StringRef path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(address.sun_path, path.data(), path.size());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (sockaddr *)&address, sizeof(address)) < 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  cl::ParseCommandLineOptions(argc, argv, "LLVM obfuscator client\n");
+
+  OwningPtr<MemoryBuffer> input;
+  if (error_code error = MemoryBuffer::getFileOrSTDIN(inputFilename, input)) {
+    errs() << argv[0] << ": " << inputFilename << ": " << error.message()
+           << "\n";
+    return 1;
+  }
+
+  std::string options;
+  for (const std::string &option : obfuscationOptions) {
+    options += option;
+    options += '\0';
+  }
+
+  int fd = connectToServer(socketPath);
+  if (fd < 0) {
+    errs() << argv[0] << ": Unable to connect to " << socketPath << ": "
+           << strerror(errno) << "\n";
+    return 1;
+  }
+  std::string status;
+  std::string response;
+  bool answered = ServerProtocol::writeFrame(fd, options) &&
+                  ServerProtocol::writeFrame(fd, input->getBuffer()) &&
+                  ServerProtocol::readFrame(fd, status) &&
+                  ServerProtocol::readFrame(fd, response);
+  close(fd);
+  if (!answered) {
+    errs() << argv[0] << ": Lost the connection to " << socketPath << "\n";
+    return 1;
+  }
+  if (status != ServerProtocol::statusOk) {
+    errs() << response;
+    return 1;
+  }
+
+  std::string error;
+  tool_output_file output(outputFilename.c_str(), error, sys::fs::F_Binary);
+  if (!error.empty()) {
+    errs() << argv[0] << ": " << error << "\n";
+    return 1;
+  }
+  output.os() << response;
+  output.keep();
+  return 0;
+}
@@ -1,5 +0,0 @@
-#include <stdio.h>
-
-int main() {
-	printf("Hello world!");
-}
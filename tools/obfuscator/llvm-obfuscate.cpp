@@ -0,0 +1,597 @@
+//=== llvm-obfuscate.cpp - Obfuscate many modules at once -----------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+// Runs the obfuscation pipeline on every bitcode or assembly file given, the
+// way the obfuscate pass does in opt. The transforms are linked in, and the
+// options are parsed once and apply to every module.
+//
+// Modules are taken in turn by a pool of threads. Each module is read into a
+// context of its own and gets its own pass manager, so modules only share
+// the options. Passes are seeded per function (see random_service.h), so the
+// output does not depend on the number of threads. As under opt, each pass
+// manager gets the analyses of the target of its module, such as the costs
+// OpaquePredicate classifies formulas with, and the errors the passes report
+// only fail their module.
+//
+// The obfuscation of foo.bc or foo.ll is written to foo.obf.bc, or
+// foo.obf.ll with -S, next to the input or into the directory given with -o.
+//
+// With -lazy, bitcode inputs are mapped into memory and only the bodies of
+// the functions given with bcfFunc, flattenFunc and copyFunc are read before
+// the passes run, along with the functions they call when InlineFunction is
+// scheduled. To the passes the other functions are declarations, so they are
+// left as they are. Their bodies are read once the passes are done, only to
+// be written out again, as the bitcode writer of this version of LLVM cannot
+// copy them without reading them, and IdentifierRenamer is run on them again
+// if it is scheduled. OpaquePredicate and ReplaceInstruction only act on the
+// blocks the selected obfuscations mark, so they do not need the others.
+// LoopBogusCF has no list and transforms every function, so every function is
+// read when it is scheduled, as it is in the default schedule. The functions
+// left unread differ from a run without -lazy in that InlineFunction does not
+// inline into them, Copy does not make them call copies, and the LLVM passes
+// of the schedule, such as simplifycfg, are not run on them.
+//
+// With -serve, no files are read. Instead the tool listens on a Unix socket
+// for the bitcode sent by llvm-obfuscate-client (see server_protocol.h), and
+// each connection is taken by a thread of the pool, which sends back the
+// obfuscated bitcode. A server only has the options it was started with, as
+// options are shared by the whole process, so a request has to give the same
+// options in the same order, each as -name=value, or it is refused.
+//
+// The events of obfTrace and obfTraceSummary are written after every module
+// or request, so that a server, which only exits when it is killed, does not
+// keep them all in memory.
+//
+// Command line options
+// - j - Modules obfuscated at the same time. 0 is one per core. Default 0
+// - o - Directory of the outputs. Defaults to the directory of each input
+// - S - Write assembly instead of bitcode
+// - lazy - Only transform the functions selected as above. Default false.
+//          Without the three lists, with one of them empty while its pass
+//          is scheduled, or with LoopBogusCF scheduled, every function is
+//          read
+// - serve - Unix socket to serve llvm-obfuscate-client on. Defaults to none,
+//           i.e. the files given are obfuscated
+// - serveTimeout - Seconds a client may stay silent, while sending its
+//                  request or reading the response, before the connection is
+//                  dropped. Default 30
+// All options of the passes, such as obfSeed, obfCache or obfThreads, are
+// accepted as well.
+
+#include "Transform/identifier_renamer.h"
+#include "Transform/inline_function.h"
+#include "Transform/pass_trace.h"
+#include "Transform/schedule.h"
+#include "Tools/server_protocol.h"
+#include "llvm/ADT/OwningPtr.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/Verifier.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/PassManager.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/system_error.h"
+#include "llvm/Target/TargetMachine.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> inputFilenames(cl::Positional, cl::ZeroOrMore,
+                                            cl::desc("<input files>"));
+
+static cl::opt<std::string>
+    outputDirectory("o", cl::init(""), cl::value_desc("directory"),
+                    cl::desc("Directory of the outputs. Defaults to the "
+                             "directory of each input"));
+
+static cl::opt<unsigned>
+    jobs("j", cl::init(0),
+         cl::desc("Modules obfuscated at the same time. 0 is one per core. "
+                  "Defaults to 0"));
+
+static cl::opt<bool> outputAssembly("S", cl::init(false),
+                                    cl::desc("Write assembly"));
+
+static cl::opt<bool>
+    lazy("lazy", cl::init(false),
+         cl::desc("Only read and transform the functions given with "
+                  "bcfFunc, flattenFunc and copyFunc, and their callees if "
+                  "calls are inlined"));
+
+static cl::opt<std::string>
+    serve("serve", cl::init(""), cl::value_desc("socket"),
+          cl::desc("Obfuscate the bitcode sent by llvm-obfuscate-client on "
+                   "this Unix socket instead of files"));
+
+static cl::opt<unsigned>
+    serveTimeout("serveTimeout", cl::init(30), cl::value_desc("seconds"),
+                 cl::desc("Seconds a client of -serve may stay silent "
+                          "before it is dropped. Defaults to 30"));
+
+namespace {
+// An input and what became of it
+struct Job {
+  std::string input;
+  std::string output;
+  // Errors in the order they were reported, empty on success
+  std::string errors;
+};
+
+std::string getOutputFilename(StringRef input) {
+  SmallString<128> output(outputDirectory.empty()
+                              ? sys::path::parent_path(input)
+                              : StringRef(outputDirectory));
+  sys::path::append(output, sys::path::stem(input) + ".obf");
+  output += outputAssembly ? ".ll" : ".bc";
+  return output.str();
+}
+
+// Errors the passes report through LLVMContext::emitError, which would
+// otherwise exit the whole process
+void collectError(const SMDiagnostic &diagnostic, void *context, unsigned) {
+  Job &job = *static_cast<Job *>(context);
+  job.errors += job.input + ": " + diagnostic.getMessage().str() + "\n";
+}
+
+// Read the bodies of the functions that the passes may transform. The
+// others stay in the bitcode until the module is written
+bool materializeSelected(Module &M, std::string &error) {
+  StringSet<> selected;
+  if (!ObfuscationSchedule::getSelectedFunctions(selected))
+    return !M.MaterializeAll(&error);
+
+  bool inlines = ObfuscationSchedule::isScheduled(&InlineFunctionPass::ID);
+  std::vector<Function *> worklist;
+  for (auto &F : M) {
+    if (selected.count(F.getName()) && F.isMaterializable())
+      worklist.push_back(&F);
+  }
+  while (!worklist.empty()) {
+    Function *F = worklist.back();
+    worklist.pop_back();
+    if (!F->isMaterializable())
+      continue;
+    if (F->Materialize(&error))
+      return false;
+    if (!inlines)
+      continue;
+
+    for (auto &block : *F) {
+      for (auto &inst : block) {
+        CallSite call(&inst);
+        if (!call)
+          continue;
+        Function *callee = call.getCalledFunction();
+        if (callee && callee->isMaterializable())
+          worklist.push_back(callee);
+      }
+    }
+  }
+  return true;
+}
+
+Module *readModule(Job &job, LLVMContext &context) {
+  SMDiagnostic diagnostic;
+  OwningPtr<MemoryBuffer> buffer;
+  const unsigned char *start = nullptr;
+  if (lazy) {
+    // Mapped, the file does not need to end with a zero
+    error_code error = MemoryBuffer::getFile(job.input, buffer, -1, false);
+    if (error) {
+      job.errors += job.input + ": " + error.message() + "\n";
+      return nullptr;
+    }
+    start = (const unsigned char *)buffer->getBufferStart();
+  }
+
+  // Assembly is always parsed whole
+  if (!buffer || !isBitcode(start, start + buffer->getBufferSize())) {
+    Module *M = ParseIRFile(job.input, diagnostic, context);
+    if (!M) {
+      raw_string_ostream stream(job.errors);
+      diagnostic.print("llvm-obfuscate", stream, false);
+    }
+    return M;
+  }
+
+  std::string error;
+  OwningPtr<Module> M(getLazyBitcodeModule(buffer.get(), context, &error));
+  if (!M) {
+    job.errors += job.input + ": " + error + "\n";
+    return nullptr;
+  }
+  // The module reads bodies from the buffer from now on
+  buffer.take();
+  if (!materializeSelected(*M, error)) {
+    job.errors += job.input + ": " + error + "\n";
+    return nullptr;
+  }
+  return M.take();
+}
+
+// The target of M, as opt builds it, so that the passes get the costs of
+// the target from TargetTransformInfo. Null if the target is unknown
+TargetMachine *getTargetMachine(Module &M) {
+  Triple triple(M.getTargetTriple());
+  if (triple.getArch() == Triple::UnknownArch)
+    return nullptr;
+  std::string error;
+  const Target *target = TargetRegistry::lookupTarget(triple.str(), error);
+  if (!target)
+    return nullptr;
+  return target->createTargetMachine(triple.str(), "", "", TargetOptions());
+}
+
+// Run the pipeline on M and read the bodies it left in the bitcode
+bool transform(Job &job, Module &M) {
+  OwningPtr<TargetMachine> TM(getTargetMachine(M));
+  PassManager PM;
+  if (TM)
+    TM->addAnalysisPasses(PM);
+  if (!M.getDataLayout().empty())
+    PM.add(new DataLayout(&M));
+  ObfuscationSchedule::addPasses(PM);
+  PM.run(M);
+  // The verifier pass would abort the whole process, and with it the other
+  // modules or requests in flight
+  std::string message;
+  if (verifyModule(M, ReturnStatusAction, &message))
+    job.errors += job.input + ": " + message;
+  if (!job.errors.empty())
+    return false;
+
+  bool unread = false;
+  for (auto &F : M) {
+    unread |= F.isMaterializable();
+  }
+  std::string error;
+  if (M.MaterializeAllPermanently(&error)) {
+    job.errors += job.input + ": " + error + "\n";
+    return false;
+  }
+
+  // Names in the bodies read last are removed as in the others
+  if (unread && ObfuscationSchedule::isScheduled(&IdentifierRenamer::ID)) {
+    PassManager renamer;
+    renamer.add(new IdentifierRenamer());
+    renamer.run(M);
+  }
+  return true;
+}
+
+void obfuscate(Job &job) {
+  LLVMContext context;
+  context.setInlineAsmDiagnosticHandler(collectError, &job);
+
+  OwningPtr<Module> M(readModule(job, context));
+  if (!M || !transform(job, *M))
+    return;
+
+  std::string error;
+  tool_output_file output(job.output.c_str(), error,
+                          outputAssembly ? sys::fs::F_None
+                                         : sys::fs::F_Binary);
+  if (!error.empty()) {
+    job.errors += job.output + ": " + error + "\n";
+    return;
+  }
+  if (outputAssembly)
+    output.os() << *M;
+  else
+    WriteBitcodeToFile(M.get(), output.os());
+  output.keep();
+}
+
+unsigned getJobs() {
+  unsigned threads =
+      jobs ? jobs : std::max(std::thread::hardware_concurrency(), 1u);
+  if (threads > 1 && !llvm_is_multithreaded() && !llvm_start_multithreaded())
+    threads = 1;
+  return threads;
+}
+
+// Options of the obfuscation given to this process, each terminated by a
+// zero. Those of the tool itself do not change the obfuscation
+std::string getObfuscationOptions(int argc, char **argv) {
+  std::string options;
+  for (int i = 1; i < argc; ++i) {
+    StringRef arg(argv[i]);
+    if (!arg.startswith("-"))
+      continue;
+    StringRef name = arg.ltrim('-').split('=').first;
+    if (name == "j" || name == "o" || name == "S" || name == "lazy" ||
+        name == "serve" || name == "serveTimeout")
+      continue;
+    options += arg;
+    options += '\0';
+  }
+  return options;
+}
+
+std::string printOptions(StringRef options) {
+  std::string printed = options;
+  std::replace(printed.begin(), printed.end(), '\0', ' ');
+  return printed;
+}
+
+bool obfuscateBitcode(Job &job, StringRef bitcode, std::string &result) {
+  LLVMContext context;
+  context.setInlineAsmDiagnosticHandler(collectError, &job);
+
+  OwningPtr<MemoryBuffer> buffer(
+      MemoryBuffer::getMemBuffer(bitcode, job.input, false));
+  std::string error;
+  OwningPtr<Module> M(ParseBitcodeFile(buffer.get(), context, &error));
+  if (!M) {
+    job.errors += job.input + ": " + error + "\n";
+    return false;
+  }
+  if (!transform(job, *M))
+    return false;
+
+  raw_string_ostream stream(result);
+  WriteBitcodeToFile(M.get(), stream);
+  stream.flush();
+  return true;
+}
+
+// Answer the request of a client and close the connection
+void serveConnection(int fd, StringRef options) {
+  // A client that stops sending or reading must not hold a thread forever
+  timeval timeout;
+  timeout.tv_sec = serveTimeout;
+  timeout.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  std::string requestOptions;
+  std::string bitcode;
+  if (ServerProtocol::readFrame(fd, requestOptions) &&
+      ServerProtocol::readFrame(fd, bitcode)) {
+    Job job;
+    job.input = "request";
+    std::string result;
+    if (requestOptions != options)
+      job.errors = "The options of the request, '" +
+                   printOptions(requestOptions) +
+                   "', are not those of the server, '" +
+                   printOptions(options) + "'\n";
+    else
+      obfuscateBitcode(job, bitcode, result);
+
+    bool ok = job.errors.empty();
+    if (ServerProtocol::writeFrame(fd, ok ? ServerProtocol::statusOk
+                                          : ServerProtocol::statusError))
+      ServerProtocol::writeFrame(fd, ok ? result : job.errors);
+  }
+  close(fd);
+}
+
+// Remove the socket left at address by a server that was killed. Anything
+// that is not a socket, or a socket a server still listens on, is left alone
+bool removeStaleSocket(const sockaddr_un &address, std::string &error) {
+  struct stat status;
+  if (lstat(address.sun_path, &status) < 0) {
+    if (errno == ENOENT)
+      return true;
+    error = strerror(errno);
+    return false;
+  }
+  if (!S_ISSOCK(status.st_mode)) {
+    error = "Not a socket";
+    return false;
+  }
+
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe < 0) {
+    error = strerror(errno);
+    return false;
+  }
+  bool listening =
+      connect(probe, (const sockaddr *)&address, sizeof(address)) == 0;
+  close(probe);
+  if (listening) {
+    error = "Another server is listening on it";
+    return false;
+  }
+  if (unlink(address.sun_path) < 0) {
+    error = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+// Serve clients on the socket at path until accepting fails or the process
+// is killed
+int serveClients(StringRef path, StringRef options, const char *argv0) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    errs() << argv0 << ": Socket path " << path << " is too long\n";
+    return 1;
+  }
+  memcpy(address.sun_path, path.data(), path.size());
+
+  std::string error;
+  if (!removeStaleSocket(address, error)) {
+    errs() << argv0 << ": Unable to use " << path << ": " << error << "\n";
+    return 1;
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      bind(listener, (sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listener, SOMAXCONN) < 0) {
+    errs() << argv0 << ": Unable to listen on " << path << ": "
+           << strerror(errno) << "\n";
+    return 1;
+  }
+  sys::RemoveFileOnSignal(path);
+
+  // Connections waiting for a thread
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<int> connections;
+  bool stopping = false;
+
+  auto work = [&]() {
+    while (true) {
+      std::unique_lock<std::mutex> lock(mutex);
+      ready.wait(lock, [&]() { return stopping || !connections.empty(); });
+      if (connections.empty())
+        return;
+      int fd = connections.front();
+      connections.pop_front();
+      lock.unlock();
+      serveConnection(fd, options);
+      PassTrace::flush();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 0, e = getJobs(); i < e; ++i) {
+    workers.push_back(std::thread(work));
+  }
+
+  int status = 0;
+  while (true) {
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0 && errno == EINTR)
+      continue;
+    if (fd < 0) {
+      errs() << argv0 << ": Unable to accept on " << path << ": "
+             << strerror(errno) << "\n";
+      status = 1;
+      break;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    connections.push_back(fd);
+    ready.notify_one();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  ready.notify_all();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  close(listener);
+  bool existed;
+  sys::fs::remove(path, existed);
+  return status;
+}
+};
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  PassRegistry &registry = *PassRegistry::getPassRegistry();
+  initializeCore(registry);
+  initializeScalarOpts(registry);
+  initializeIPO(registry);
+  initializeAnalysis(registry);
+  initializeIPA(registry);
+  initializeTransformUtils(registry);
+  initializeInstCombine(registry);
+  initializeTarget(registry);
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+
+  cl::ParseCommandLineOptions(argc, argv, "LLVM obfuscator\n");
+
+  if (!serve.empty())
+    return serveClients(serve, getObfuscationOptions(argc, argv), argv[0]);
+  if (inputFilenames.empty()) {
+    errs() << argv[0] << ": No input files\n";
+    return 1;
+  }
+
+  if (!outputDirectory.empty()) {
+    bool existed;
+    if (sys::fs::create_directories(Twine(outputDirectory), existed)) {
+      errs() << argv[0] << ": Unable to create " << outputDirectory << "\n";
+      return 1;
+    }
+  }
+
+  std::vector<Job> queue(inputFilenames.size());
+  StringSet<> outputs;
+  for (unsigned i = 0, e = inputFilenames.size(); i < e; ++i) {
+    queue[i].input = inputFilenames[i];
+    queue[i].output = getOutputFilename(inputFilenames[i]);
+    if (!outputs.insert(queue[i].output)) {
+      errs() << argv[0] << ": " << queue[i].input << " and another input are "
+             << "both written to " << queue[i].output << "\n";
+      return 1;
+    }
+  }
+
+  std::atomic<unsigned> next(0);
+  auto work = [&]() {
+    for (unsigned i = next++; i < queue.size(); i = next++) {
+      obfuscate(queue[i]);
+      PassTrace::flush();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  unsigned threads = std::min<unsigned>(getJobs(), queue.size());
+  for (unsigned i = 1; i < threads; ++i) {
+    workers.push_back(std::thread(work));
+  }
+  work();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  int status = 0;
+  for (auto &job : queue) {
+    if (job.errors.empty())
+      continue;
+    errs() << job.errors;
+    status = 1;
+  }
+  return status;
+}